@@ -12,21 +12,38 @@
    template class SinglyLinkedList<SinglyLinkedList<SinglyLinkedList<SinglyLinkedList<SinglyLinkedList<T>>>>>;
 
 template <class T>
-ArrayList<T>::ArrayList(int initCapacity)
-    : data { (T *)::operator new(initCapacity * sizeof(T)) }, capacity { initCapacity }, count {}
+ArrayList<T>::ArrayList(int initCapacity) : data { allocate(initCapacity) }, capacity { initCapacity }, count {}
 {
 }
 
 template <class T>
 ArrayList<T>::ArrayList(const ArrayList<T> &other) noexcept(std::is_nothrow_copy_constructible_v<T>)
-    : data((T *)::operator new(other.size() * sizeof(T))), capacity { other.capacity }, count { other.size() }
+    : data { allocate(other.capacity) }, capacity { other.capacity }, count { other.size() }
 {
+   if constexpr (relocatable)
+   {
+      // a moved-from list has no data, and memcpy from null is undefined even for 0 bytes
+      if (count > 0)
+      {
+         std::memcpy(static_cast<void *>(this->data), other.data, count * sizeof(T));
+      }
+      return;
+   }
    for (int i {}; i < count; i++)
    {
       new (&this->data[i]) T { other.data[i] };
    }
 }
 
+template <class T>
+ArrayList<T>::ArrayList(ArrayList<T> &&other) noexcept
+    : data { other.data }, capacity { other.capacity }, count { other.count }
+{
+   other.data = nullptr;
+   other.capacity = 0;
+   other.count = 0;
+}
+
 template <class T>
 ArrayList<T> &ArrayList<T>::operator=(const ArrayList<T> &other)
 
@@ -34,39 +51,63 @@ ArrayList<T> &ArrayList<T>::operator=(const ArrayList<T> &other)
 {
    if (this != &other)
    {
-      for (T &data : *this)
+      for (int i {}; i < this->count; i++)
       {
-         data.~T();
+         this->data[i].~T();
       }
-      ::operator delete(data, count * sizeof(T));
+      deallocate(data, capacity);
 
       this->count = other.count;
       this->capacity = other.capacity;
-      this->data = (T *)::operator new(capacity * sizeof(T));
+      this->data = allocate(capacity);
 
-      for (int i {}; i < this->count; i++)
+      if constexpr (relocatable)
       {
-         new (&this->data[i]) T { other.data[i] };
+         if (count > 0)
+         {
+            std::memcpy(static_cast<void *>(this->data), other.data, count * sizeof(T));
+         }
+      }
+      else
+      {
+         for (int i {}; i < this->count; i++)
+         {
+            new (&this->data[i]) T { other.data[i] };
+         }
       }
    }
    return *this;
 }
 
-template <typename T> void ArrayList<T>::clear() noexcept(std::is_nothrow_destructible_v<T>)
+template <class T> ArrayList<T> &ArrayList<T>::operator=(ArrayList<T> &&other) noexcept
 {
-   if (data != nullptr)
+   if (this != &other)
    {
-      for (T &data : *this)
+      for (int i {}; i < this->count; i++)
       {
-         data.~T();
+         this->data[i].~T();
       }
+      deallocate(data, capacity);
+
+      this->data = other.data;
+      this->capacity = other.capacity;
+      this->count = other.count;
 
-      ::operator delete(data, count * sizeof(T));
+      other.data = nullptr;
+      other.capacity = 0;
+      other.count = 0;
+   }
+   return *this;
+}
 
-      this->count = 0;
-      this->capacity = 10;
-      this->data = (T *)::operator new(capacity * sizeof(T));
+// keeps the buffer, a list that is cleared and refilled should not pay for growing again
+template <typename T> void ArrayList<T>::clear() noexcept(std::is_nothrow_destructible_v<T>)
+{
+   for (int i {}; i < this->count; i++)
+   {
+      this->data[i].~T();
    }
+   this->count = 0;
 }
 
 template <typename T> ArrayList<T>::~ArrayList() noexcept
@@ -76,48 +117,89 @@ template <typename T> ArrayList<T>::~ArrayList() noexcept
       this->data[i].~T();
    }
 
-   ::operator delete(data, count * sizeof(T));
+   deallocate(data, capacity);
 }
 
-template <typename T> void ArrayList<T>::ensureCapacity(int cap)
+template <typename T> void ArrayList<T>::reallocate(int newCapacity)
 {
-   if (cap >= this->capacity)
+   if constexpr (relocatable)
    {
-      this->capacity *= 1.5;
-
-      T *new_data { (T *)::operator new(capacity * sizeof(T)) };
-
-      for (int i {}; i < this->count; i++)
+      void *p { std::realloc(this->data, std::max(newCapacity, 1) * sizeof(T)) };
+      if (p == nullptr)
       {
-         new (&new_data[i]) T { std::move(data[i]) };
-         this->data[i].~T();
+         throw std::bad_alloc();
       }
-      ::operator delete(this->data, capacity * sizeof(T));
-      this->data = new_data;
+      this->data = static_cast<T *>(p);
+      this->capacity = newCapacity;
+      return;
+   }
+
+   T *new_data { allocate(newCapacity) };
+
+   for (int i {}; i < this->count; i++)
+   {
+      new (&new_data[i]) T { std::move(data[i]) };
+      this->data[i].~T();
    }
+   deallocate(this->data, this->capacity);
+
+   this->data = new_data;
+   this->capacity = newCapacity;
 }
 
-template <typename T> void ArrayList<T>::add(T e)
+template <typename T> void ArrayList<T>::ensureCapacity(int cap)
 {
-   ensureCapacity(this->count + 1);
-   return add(this->count, e);
+   if (cap > this->capacity)
+   {
+      reallocate(ArrayListGrowth<T>::next(this->capacity, cap));
+   }
 }
 
-template <typename T> void ArrayList<T>::add(int index, T e)
+template <typename T> void ArrayList<T>::reserve(int cap)
 {
-   if (index > count || index < 0)
+   if (cap > this->capacity)
    {
-      throw std::out_of_range("Index is invalid!");
+      reallocate(cap);
    }
+}
 
-   ensureCapacity(count + 1);
-
-   std::move_backward(&data[index], &data[count], &data[count + 1]);
-   new (&data[index]) T { std::move(e) };
+template <typename T> void ArrayList<T>::shrink_to_fit()
+{
+   if (this->count < this->capacity)
+   {
+      reallocate(this->count);
+   }
+}
 
-   this->count++;
+template <typename T> void ArrayList<T>::resize(int n, const T &fill)
+{
+   if (n < 0)
+   {
+      throw std::invalid_argument("Size cannot be negative!");
+   }
+   while (this->count > n)
+   {
+      this->data[--this->count].~T();
+   }
+   if (this->count < n)
+   {
+      T value { fill }; // fill may live in the storage reserve is about to move
+      reserve(n);
+      while (this->count < n)
+      {
+         new (&this->data[this->count++]) T { value };
+      }
+   }
 }
 
+template <typename T> void ArrayList<T>::add(const T &e) { emplace_back(e); }
+
+template <typename T> void ArrayList<T>::add(T &&e) { emplace_back(std::move(e)); }
+
+template <typename T> void ArrayList<T>::add(int index, const T &e) { emplace(index, e); }
+
+template <typename T> void ArrayList<T>::add(int index, T &&e) { emplace(index, std::move(e)); }
+
 template <typename T> T ArrayList<T>::removeAt(int index)
 {
    if (index >= count || index < 0)
@@ -157,7 +239,7 @@ template <typename T> void ArrayList<T>::set(int index, T e)
    this->data[index] = std::move(e);
 }
 
-template <typename T> int ArrayList<T>::indexOf(T e) const
+template <typename T> int ArrayList<T>::indexOf(const T &e) const
 {
    for (int i {}; i < this->count; i++)
    {
@@ -187,9 +269,28 @@ template <typename T> std::string ArrayList<T>::toString(std::string (*item2str)
    return oss.str();
 }
 
-template <typename T> bool ArrayList<T>::contains(T e) const { return (indexOf(e) != -1); }
+template <typename T> bool ArrayList<T>::contains(const T &e) const { return (indexOf(e) != -1); }
+
+template <typename T> T &ArrayList<T>::operator[](int index)
+{
+   if (index < 0 || index >= count)
+   {
+      throw std::out_of_range("Index out of range");
+   }
+   return data[index];
+}
+
+template <typename T> const T &ArrayList<T>::operator[](int index) const
+{
+   if (index < 0 || index >= count)
+   {
+      throw std::out_of_range("Index out of range");
+   }
+   return data[index];
+}
 
 // ----------------- Iterator of ArrayList Implementation -----------------
+#ifdef ARRAYLIST_CHECKED_ITERATOR
 template <typename T>
 ArrayList<T>::Iterator::Iterator(ArrayList<T> *pList, int index) : cursor { index }, pList { pList }
 {
@@ -269,24 +370,6 @@ template <typename T> typename ArrayList<T>::Iterator ArrayList<T>::begin() noex
 
 template <typename T> typename ArrayList<T>::Iterator ArrayList<T>::end() noexcept { return Iterator(this, count); }
 
-template <typename T> T &ArrayList<T>::operator[](int index)
-{
-   if (index < 0 || index >= count)
-   {
-      throw std::out_of_range("Index out of range");
-   }
-   return data[index];
-}
-
-template <typename T> const T &ArrayList<T>::operator[](int index) const
-{
-   if (index < 0 || index >= count)
-   {
-      throw std::out_of_range("Index out of range");
-   }
-   return data[index];
-}
-
 template <typename T> typename ArrayList<T>::Iterator &ArrayList<T>::Iterator::operator+=(int n)
 {
    if (-n > this->cursor)
@@ -365,7 +448,7 @@ template <typename T> T &ArrayList<T>::Iterator::operator[](int n) const
    return (*this->pList)[index];
 }
 
-// TODO: implement other methods of ArrayList::Iterator
+#endif // ARRAYLIST_CHECKED_ITERATOR
 
 // ----------------- SinglyLinkedList Implementation -----------------
 
@@ -373,16 +456,11 @@ template <typename T> SinglyLinkedList<T>::SinglyLinkedList() noexcept : head {
 
 template <typename T> SinglyLinkedList<T>::~SinglyLinkedList() noexcept { clear(); }
 
-template <typename T> void SinglyLinkedList<T>::add(int index, T e)
+template <typename T> typename SinglyLinkedList<T>::Node **SinglyLinkedList<T>::linkAt(int index) noexcept
 {
-   if (index < 0 || index > count)
-   {
-      throw std::out_of_range("Index is invalid!");
-   }
-
    if (index == this->count)
    {
-      return add(e);
+      return this->tail ? &this->tail->next : &this->head;
    }
 
    Node **prev { &this->head };
@@ -391,26 +469,27 @@ template <typename T> void SinglyLinkedList<T>::add(int index, T e)
    {
       prev = &(*prev)->next;
    }
-
-   *prev = new Node { e, *prev };
-
-   this->count++;
+   return prev;
 }
 
-template <typename T> void SinglyLinkedList<T>::add(T e)
+template <typename T> void SinglyLinkedList<T>::linkNode(Node **prev, Node *node) noexcept
 {
-   Node *tmp { new Node { e } };
-   this->count++;
-
-   if (tail)
+   *prev = node;
+   if (node->next == nullptr)
    {
-      this->tail->next = tmp;
-      this->tail = tmp;
-      return;
+      this->tail = node;
    }
-   this->head = this->tail = tmp;
+   this->count++;
 }
 
+template <typename T> void SinglyLinkedList<T>::add(int index, const T &e) { emplace(index, e); }
+
+template <typename T> void SinglyLinkedList<T>::add(int index, T &&e) { emplace(index, std::move(e)); }
+
+template <typename T> void SinglyLinkedList<T>::add(const T &e) { emplace_back(e); }
+
+template <typename T> void SinglyLinkedList<T>::add(T &&e) { emplace_back(std::move(e)); }
+
 template <typename T> T SinglyLinkedList<T>::removeAt(int index)
 {
    if (index < 0 || index >= count)
@@ -418,10 +497,12 @@ template <typename T> T SinglyLinkedList<T>::removeAt(int index)
       throw std::out_of_range("Index is invalid!");
    }
 
+   Node *before { nullptr };
    Node **prev { &head };
 
    for (int i {}; i < index; i++)
    {
+      before = *prev;
       prev = &(*prev)->next;
    }
 
@@ -430,7 +511,7 @@ template <typename T> T SinglyLinkedList<T>::removeAt(int index)
 
    if (Deleted == this->tail)
    {
-      this->tail = *prev;
+      this->tail = before;
    }
 
    T data { std::move(Deleted->data) };
@@ -441,7 +522,7 @@ template <typename T> T SinglyLinkedList<T>::removeAt(int index)
    return data;
 }
 
-template <typename T> bool SinglyLinkedList<T>::removeItem(T e)
+template <typename T> bool SinglyLinkedList<T>::removeItem(const T &e)
 {
    Node *current { this->head };
 
@@ -458,7 +539,7 @@ template <typename T> bool SinglyLinkedList<T>::removeItem(T e)
    return false;
 }
 
-template <typename T> bool SinglyLinkedList<T>::contains(T e) const
+template <typename T> int SinglyLinkedList<T>::indexOf(const T &e) const
 {
    Node *current { this->head };
 
@@ -466,13 +547,15 @@ template <typename T> bool SinglyLinkedList<T>::contains(T e) const
    {
       if (current->data == e)
       {
-         return true;
+         return i;
       }
       current = current->next;
    }
-   return false;
+   return -1;
 }
 
+template <typename T> bool SinglyLinkedList<T>::contains(const T &e) const { return (indexOf(e) != -1); }
+
 template <typename T> T &SinglyLinkedList<T>::get(int index)
 {
    if (index < 0 || index >= count)
@@ -490,6 +573,26 @@ template <typename T> T &SinglyLinkedList<T>::get(int index)
    return current->data;
 }
 
+template <typename T> int SinglyLinkedList<T>::copyTo(T *out, int n) const
+{
+   int copied {};
+   for (Node *current { this->head }; current != nullptr && copied < n; current = current->next)
+   {
+      out[copied++] = current->data;
+   }
+   return copied;
+}
+
+template <typename T> int SinglyLinkedList<T>::copyFrom(const T *in, int n)
+{
+   int written {};
+   for (Node *current { this->head }; current != nullptr && written < n; current = current->next)
+   {
+      current->data = in[written++];
+   }
+   return written;
+}
+
 template <typename T> void SinglyLinkedList<T>::clear() noexcept(std::is_nothrow_destructible_v<T>)
 {
    Node *current { this->head };
@@ -504,6 +607,43 @@ template <typename T> void SinglyLinkedList<T>::clear() noexcept(std::is_nothrow
    this->count = 0;
 }
 
+template <typename T> void SinglyLinkedList<T>::resize(int n, const T &fill)
+{
+   n = std::max(n, 0);
+   if (n >= this->count)
+   {
+      while (this->count < n)
+      {
+         add(fill);
+      }
+      return;
+   }
+
+   Node *last { nullptr };
+   Node *current { this->head };
+   for (int i {}; i < n; i++)
+   {
+      last = current;
+      current = current->next;
+   }
+   while (current != nullptr)
+   {
+      Node *next { current->next };
+      delete current;
+      current = next;
+   }
+   if (last)
+   {
+      last->next = nullptr;
+   }
+   else
+   {
+      this->head = nullptr;
+   }
+   this->tail = last;
+   this->count = n;
+}
+
 template <typename T> string SinglyLinkedList<T>::toString(string (*item2str)(T &)) const
 {
    if (this->head == nullptr)
@@ -592,19 +732,5061 @@ template <typename T> typename SinglyLinkedList<T>::Iterator SinglyLinkedList<T>
    return Iterator { nullptr };
 }
 
-// ----------------- VectorStore Implementation -----------------
+// ----------------- PointCloud Implementation -----------------
 
-VectorStore::VectorStore(int dimension, EmbedFn embeddingFunction)
+namespace
+{
+double *allocateCoords(int cap)
 {
-   // TODO
+   return static_cast<double *>(::operator new(std::max(cap, 1) * sizeof(double), std::align_val_t { 64 }));
 }
 
-VectorStore::~VectorStore()
+void freeCoords(double *p) noexcept { ::operator delete(p, std::align_val_t { 64 }); }
+
+// owns an array until every allocation of a constructor went through
+using CoordsPtr = std::unique_ptr<double, decltype(&freeCoords)>;
+} // namespace
+
+PointCloud::PointCloud(int initCapacity)
+    : xs { nullptr }, ys { nullptr }, zs { nullptr }, capacity { initCapacity }, count {}
+{
+   // the destructor does not run for a half-built cloud, so a throw here must not leave the first arrays behind
+   CoordsPtr x { allocateCoords(initCapacity), freeCoords };
+   CoordsPtr y { allocateCoords(initCapacity), freeCoords };
+   CoordsPtr z { allocateCoords(initCapacity), freeCoords };
+   xs = x.release();
+   ys = y.release();
+   zs = z.release();
+}
+
+PointCloud::PointCloud(const ArrayList<Point> &points) : PointCloud(points.size())
+{
+   for (int i {}; i < points.size(); i++)
+   {
+      const Point &p { points[i] };
+      xs[i] = p.getX();
+      ys[i] = p.getY();
+      zs[i] = p.getZ();
+   }
+   count = points.size();
+}
+
+PointCloud::PointCloud(const PointCloud &other) : PointCloud(other.count)
+{
+   // a moved-from cloud has null arrays
+   if (other.count > 0)
+   {
+      std::memcpy(xs, other.xs, other.count * sizeof(double));
+      std::memcpy(ys, other.ys, other.count * sizeof(double));
+      std::memcpy(zs, other.zs, other.count * sizeof(double));
+   }
+   count = other.count;
+}
+
+PointCloud::PointCloud(PointCloud &&other) noexcept
+    : xs { other.xs }, ys { other.ys }, zs { other.zs }, capacity { other.capacity }, count { other.count }
+{
+   other.xs = other.ys = other.zs = nullptr;
+   other.capacity = other.count = 0;
+}
+
+PointCloud::~PointCloud() noexcept
+{
+   freeCoords(xs);
+   freeCoords(ys);
+   freeCoords(zs);
+}
+
+PointCloud &PointCloud::operator=(const PointCloud &other)
+{
+   if (this != &other)
+   {
+      PointCloud tmp { other };
+      *this = std::move(tmp);
+   }
+   return *this;
+}
+
+PointCloud &PointCloud::operator=(PointCloud &&other) noexcept
+{
+   if (this != &other)
+   {
+      std::swap(xs, other.xs);
+      std::swap(ys, other.ys);
+      std::swap(zs, other.zs);
+      std::swap(capacity, other.capacity);
+      std::swap(count, other.count);
+   }
+   return *this;
+}
+
+void PointCloud::ensureCapacity(int cap)
+{
+   if (cap <= capacity)
+   {
+      return;
+   }
+   int newCapacity { ArrayListGrowth<double>::next(capacity, cap) };
+   double **arrays[3] { &xs, &ys, &zs };
+   for (double **arr : arrays)
+   {
+      double *fresh { allocateCoords(newCapacity) };
+      if (*arr != nullptr)
+      {
+         std::memcpy(fresh, *arr, count * sizeof(double));
+      }
+      freeCoords(*arr);
+      *arr = fresh;
+   }
+   capacity = newCapacity;
+}
+
+void PointCloud::reserve(int cap) { ensureCapacity(cap); }
+
+void PointCloud::add(const Point &p)
+{
+   ensureCapacity(count + 1);
+   xs[count] = p.getX();
+   ys[count] = p.getY();
+   zs[count] = p.getZ();
+   count++;
+}
+
+Point PointCloud::get(int index) const
+{
+   if (index < 0 || index >= count)
+   {
+      throw std::out_of_range("Index is invalid!");
+   }
+   return Point(xs[index], ys[index], zs[index]);
+}
+
+void PointCloud::set(int index, const Point &p)
+{
+   if (index < 0 || index >= count)
+   {
+      throw std::out_of_range("Index is invalid!");
+   }
+   xs[index] = p.getX();
+   ys[index] = p.getY();
+   zs[index] = p.getZ();
+}
+
+void PointCloud::clear() noexcept { count = 0; }
+
+ArrayList<Point> PointCloud::toList() const
+{
+   ArrayList<Point> out(count);
+   for (int i {}; i < count; i++)
+   {
+      out.emplace_back(xs[i], ys[i], zs[i]);
+   }
+   return out;
+}
+
+// the kernels below work on __restrict copies of the member pointers so the compiler knows the three arrays and
+// the output never alias and can vectorize every loop
+
+void PointCloud::translate(double dx, double dy, double dz) noexcept
+{
+   double *__restrict x { xs };
+   double *__restrict y { ys };
+   double *__restrict z { zs };
+   for (int i {}; i < count; i++)
+   {
+      x[i] += dx;
+      y[i] += dy;
+      z[i] += dz;
+   }
+}
+
+void PointCloud::scale(double factor) noexcept { scale(factor, Point()); }
+
+void PointCloud::scale(double factor, const Point &origin) noexcept
 {
-   // TODO
+   double *__restrict x { xs };
+   double *__restrict y { ys };
+   double *__restrict z { zs };
+   const double ox { origin.getX() }, oy { origin.getY() }, oz { origin.getZ() };
+   for (int i {}; i < count; i++)
+   {
+      x[i] = ox + (x[i] - ox) * factor;
+      y[i] = oy + (y[i] - oy) * factor;
+      z[i] = oz + (z[i] - oz) * factor;
+   }
+}
+
+void PointCloud::squaredDistancesTo(const Point &p, double *out) const noexcept
+{
+   const double *__restrict x { xs };
+   const double *__restrict y { ys };
+   const double *__restrict z { zs };
+   double *__restrict o { out };
+   const double px { p.getX() }, py { p.getY() }, pz { p.getZ() };
+   for (int i {}; i < count; i++)
+   {
+      double dx { x[i] - px };
+      double dy { y[i] - py };
+      double dz { z[i] - pz };
+      o[i] = dx * dx + dy * dy + dz * dz;
+   }
+}
+
+void PointCloud::distancesTo(const Point &p, double *out) const noexcept
+{
+   squaredDistancesTo(p, out);
+   double *__restrict o { out };
+   for (int i {}; i < count; i++)
+   {
+      o[i] = std::sqrt(o[i]);
+   }
+}
+
+void PointCloud::pairwiseDistances(double *out) const noexcept
+{
+   // 64x64 tiles keep both the rows being written and their mirrored columns in cache; only tiles on or above the
+   // diagonal are computed
+   constexpr int tile { 64 };
+   const double *__restrict x { xs };
+   const double *__restrict y { ys };
+   const double *__restrict z { zs };
+   const std::size_t n { static_cast<std::size_t>(count) };
+
+   for (int bi {}; bi < count; bi += tile)
+   {
+      int iEnd { std::min(bi + tile, count) };
+      for (int bj { bi }; bj < count; bj += tile)
+      {
+         int jEnd { std::min(bj + tile, count) };
+         for (int i { bi }; i < iEnd; i++)
+         {
+            double *__restrict row { out + i * n };
+            const double px { x[i] }, py { y[i] }, pz { z[i] };
+            for (int j { bj }; j < jEnd; j++)
+            {
+               double dx { x[j] - px };
+               double dy { y[j] - py };
+               double dz { z[j] - pz };
+               row[j] = std::sqrt(dx * dx + dy * dy + dz * dz);
+            }
+            if (bj != bi)
+            {
+               for (int j { bj }; j < jEnd; j++)
+               {
+                  out[j * n + i] = row[j];
+               }
+            }
+         }
+         if (bj == bi)
+         {
+            for (int i { bi }; i < iEnd; i++)
+            {
+               for (int j { bi }; j < i; j++)
+               {
+                  out[i * n + j] = out[j * n + i];
+               }
+            }
+         }
+      }
+   }
+}
+
+int PointCloud::nearestTo(const Point &p) const
+{
+   if (count == 0)
+   {
+      return -1;
+   }
+   const double px { p.getX() }, py { p.getY() }, pz { p.getZ() };
+   int best {};
+   double bestDist { std::numeric_limits<double>::infinity() };
+   for (int i {}; i < count; i++)
+   {
+      double dx { xs[i] - px };
+      double dy { ys[i] - py };
+      double dz { zs[i] - pz };
+      double d { dx * dx + dy * dy + dz * dz };
+      if (d < bestDist)
+      {
+         bestDist = d;
+         best = i;
+      }
+   }
+   return best;
+}
+
+// ----------------- KDTree Implementation -----------------
+
+namespace
+{
+// top_k results into an ArrayList, best first
+ArrayList<int> drainIndices(algorithms::top_k<double> &best)
+{
+   ArrayList<int> out(best.size());
+   for (int i {}; i < best.size(); i++)
+   {
+      out.add(0);
+   }
+   best.drain(out.rawData(), nullptr);
+   return out;
+}
+
+double squaredDistance(const PointCloud &points, int i, const double *q) noexcept
+{
+   double dx { points.xData()[i] - q[0] };
+   double dy { points.yData()[i] - q[1] };
+   double dz { points.zData()[i] - q[2] };
+   return dx * dx + dy * dy + dz * dz;
+}
+
+int buildThreads(int threads) noexcept
+{
+   return threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+} // namespace
+
+KDTree::KDTree(const ArrayList<Point> &points, int leafSize, int threads) : KDTree(PointCloud(points), leafSize, threads)
+{
+}
+
+KDTree::KDTree(const PointCloud &points, int leafSize, int threads)
+    : points { points }, order(points.size()), nodes(nodesFor(points.size(), std::max(1, leafSize))),
+      leafSize { std::max(1, leafSize) }
+{
+   for (int i {}; i < points.size(); i++)
+   {
+      order.add(i);
+   }
+
+   // the shape only depends on the size, so every node slot exists up front and subtrees can be built in parallel
+   int total { nodesFor(points.size(), this->leafSize) };
+   for (int i {}; i < total; i++)
+   {
+      nodes.add(Node {});
+   }
+   build(0, 0, points.size(), buildThreads(threads));
+}
+
+KDTree::KDTree(const KDTree &other) = default;
+KDTree::KDTree(KDTree &&other) noexcept = default;
+KDTree::~KDTree() noexcept = default;
+KDTree &KDTree::operator=(const KDTree &other) = default;
+KDTree &KDTree::operator=(KDTree &&other) noexcept = default;
+
+int KDTree::nodesFor(int n, int leafSize) noexcept
+{
+   if (n <= leafSize)
+   {
+      return 1;
+   }
+   return 1 + nodesFor(n / 2, leafSize) + nodesFor(n - n / 2, leafSize);
+}
+
+const double *KDTree::axisData(int axis) const noexcept
+{
+   return axis == 0 ? points.xData() : (axis == 1 ? points.yData() : points.zData());
+}
+
+void KDTree::build(int node, int begin, int end, int threads)
+{
+   Node &n { nodes[node] };
+   n.begin = begin;
+   n.end = end;
+   n.right = -1;
+   n.axis = 0;
+   n.split = 0;
+
+   if (end - begin <= leafSize)
+   {
+      return;
+   }
+
+   int *idx { order.rawData() };
+   double spread[3];
+   for (int axis {}; axis < 3; axis++)
+   {
+      const double *c { axisData(axis) };
+      double lo { c[idx[begin]] }, hi { lo };
+      for (int i { begin + 1 }; i < end; i++)
+      {
+         lo = std::min(lo, c[idx[i]]);
+         hi = std::max(hi, c[idx[i]]);
+      }
+      spread[axis] = hi - lo;
+   }
+   int axis { spread[1] > spread[0] ? 1 : 0 };
+   axis = spread[2] > spread[axis] ? 2 : axis;
+
+   const double *c { axisData(axis) };
+   int mid { begin + (end - begin) / 2 };
+   algorithms::nth_element(idx + begin, idx + mid, idx + end, [c](int a, int b) { return c[a] < c[b]; });
+
+   n.axis = axis;
+   n.split = c[idx[mid]];
+   n.right = node + 1 + nodesFor(mid - begin, leafSize);
+
+   int right { n.right };
+   if (threads > 1 && end - begin >= (1 << 14))
+   {
+      std::future<void> left { std::async(std::launch::async,
+                                          [this, node, begin, mid, threads]() { build(node + 1, begin, mid, threads / 2); }) };
+      build(right, mid, end, threads - threads / 2);
+      left.get();
+      return;
+   }
+   build(node + 1, begin, mid, 1);
+   build(right, mid, end, 1);
+}
+
+void KDTree::nearest(int node, const double *q, algorithms::top_k<double> &best) const
+{
+   const Node &n { nodes[node] };
+   if (n.right < 0)
+   {
+      const int *idx { order.rawData() };
+      for (int i { n.begin }; i < n.end; i++)
+      {
+         best.push(squaredDistance(points, idx[i], q), idx[i]);
+      }
+      return;
+   }
+
+   double diff { q[n.axis] - n.split };
+   int nearSide { diff < 0 ? node + 1 : n.right };
+   int farSide { diff < 0 ? n.right : node + 1 };
+
+   nearest(nearSide, q, best);
+   if (!best.full() || diff * diff <= best.threshold())
+   {
+      nearest(farSide, q, best);
+   }
+}
+
+void KDTree::withinRadius(int node, const double *q, double r, ArrayList<int> &out) const
+{
+   const Node &n { nodes[node] };
+   if (n.right < 0)
+   {
+      const int *idx { order.rawData() };
+      for (int i { n.begin }; i < n.end; i++)
+      {
+         if (squaredDistance(points, idx[i], q) <= r * r)
+         {
+            out.add(idx[i]);
+         }
+      }
+      return;
+   }
+   if (q[n.axis] - r <= n.split)
+   {
+      withinRadius(node + 1, q, r, out);
+   }
+   if (q[n.axis] + r >= n.split)
+   {
+      withinRadius(n.right, q, r, out);
+   }
+}
+
+void KDTree::inBox(int node, const double *lo, const double *hi, ArrayList<int> &out) const
+{
+   const Node &n { nodes[node] };
+   if (n.right < 0)
+   {
+      const int *idx { order.rawData() };
+      for (int i { n.begin }; i < n.end; i++)
+      {
+         int p { idx[i] };
+         double x { points.xData()[p] }, y { points.yData()[p] }, z { points.zData()[p] };
+         if (x >= lo[0] && x <= hi[0] && y >= lo[1] && y <= hi[1] && z >= lo[2] && z <= hi[2])
+         {
+            out.add(p);
+         }
+      }
+      return;
+   }
+   if (lo[n.axis] <= n.split)
+   {
+      inBox(node + 1, lo, hi, out);
+   }
+   if (hi[n.axis] >= n.split)
+   {
+      inBox(n.right, lo, hi, out);
+   }
+}
+
+ArrayList<int> KDTree::nearest(const Point &query, int k) const
+{
+   k = std::min(k, size()); // top_k allocates k slots up front
+   algorithms::top_k<double> best { k };
+   if (k > 0 && size() > 0)
+   {
+      double q[3] { query.getX(), query.getY(), query.getZ() };
+      nearest(0, q, best);
+   }
+   return drainIndices(best);
+}
+
+int KDTree::nearest(const Point &query) const
+{
+   ArrayList<int> one { nearest(query, 1) };
+   return one.empty() ? -1 : one[0];
+}
+
+ArrayList<int> KDTree::withinRadius(const Point &center, double radius) const
+{
+   ArrayList<int> out;
+   if (size() > 0 && radius >= 0)
+   {
+      double q[3] { center.getX(), center.getY(), center.getZ() };
+      withinRadius(0, q, radius, out);
+      out.sort();
+   }
+   return out;
+}
+
+ArrayList<int> KDTree::inBox(const Point &low, const Point &high) const
+{
+   ArrayList<int> out;
+   if (size() > 0)
+   {
+      double lo[3] { low.getX(), low.getY(), low.getZ() };
+      double hi[3] { high.getX(), high.getY(), high.getZ() };
+      inBox(0, lo, hi, out);
+      out.sort();
+   }
+   return out;
+}
+
+// ----------------- Octree Implementation -----------------
+
+namespace
+{
+// deep enough that splitting stops well before cubes reach double precision, and a pile of identical points
+// simply stays in one oversized leaf
+constexpr int OCTREE_MAX_DEPTH { 32 };
+
+double boxDistanceSq(double cx, double cy, double cz, double half, const double *q) noexcept
+{
+   double dx { std::max(0.0, std::fabs(q[0] - cx) - half) };
+   double dy { std::max(0.0, std::fabs(q[1] - cy) - half) };
+   double dz { std::max(0.0, std::fabs(q[2] - cz) - half) };
+   return dx * dx + dy * dy + dz * dz;
+}
+} // namespace
+
+Octree::Octree(int bucketSize) : points {}, nodes {}, bucketSize { std::max(1, bucketSize) } {}
+
+Octree::Octree(const ArrayList<Point> &points, int bucketSize) : Octree(bucketSize)
+{
+   this->points.reserve(points.size());
+   for (int i {}; i < points.size(); i++)
+   {
+      insert(points[i]);
+   }
+}
+
+Octree::Octree(const Octree &other) = default;
+Octree::Octree(Octree &&other) noexcept = default;
+Octree::~Octree() noexcept = default;
+Octree &Octree::operator=(const Octree &other) = default;
+Octree &Octree::operator=(Octree &&other) noexcept = default;
+
+bool Octree::rootContains(const Point &p) const noexcept
+{
+   const Node &root { nodes.rawData()[0] };
+   return std::fabs(p.getX() - root.cx) <= root.half && std::fabs(p.getY() - root.cy) <= root.half &&
+          std::fabs(p.getZ() - root.cz) <= root.half;
+}
+
+void Octree::reset(double cx, double cy, double cz, double half)
+{
+   nodes.clear();
+   nodes.add(Node { cx, cy, cz, half, 0, -1, ArrayList<int>() });
+   for (int i {}; i < points.size(); i++)
+   {
+      insertInto(i);
+   }
+}
+
+void Octree::subdivide(int node)
+{
+   int first { nodes.size() };
+   // copy the cube out first, the adds below may move the node array
+   Node parent { nodes[node].cx, nodes[node].cy, nodes[node].cz, nodes[node].half, nodes[node].depth, -1,
+                 ArrayList<int>(0) };
+   double h { parent.half / 2 };
+   for (int octant {}; octant < 8; octant++)
+   {
+      nodes.add(Node { parent.cx + ((octant & 1) ? h : -h), parent.cy + ((octant & 2) ? h : -h),
+                       parent.cz + ((octant & 4) ? h : -h), h, parent.depth + 1, -1, ArrayList<int>() });
+   }
+
+   ArrayList<int> items { std::move(nodes[node].items) };
+   nodes[node].items = ArrayList<int>(0);
+   nodes[node].child = first;
+   for (int index : items)
+   {
+      int octant { (points.xData()[index] >= parent.cx) | ((points.yData()[index] >= parent.cy) << 1) |
+                   ((points.zData()[index] >= parent.cz) << 2) };
+      nodes[first + octant].items.add(index);
+   }
+}
+
+void Octree::insertInto(int index)
+{
+   const double x { points.xData()[index] }, y { points.yData()[index] }, z { points.zData()[index] };
+   int node {};
+   while (nodes[node].child >= 0)
+   {
+      const Node &n { nodes[node] };
+      node = n.child + ((x >= n.cx) | ((y >= n.cy) << 1) | ((z >= n.cz) << 2));
+   }
+   nodes[node].items.add(index);
+   if (nodes[node].items.size() > bucketSize && nodes[node].depth < OCTREE_MAX_DEPTH)
+   {
+      subdivide(node);
+   }
+}
+
+int Octree::insert(const Point &p)
+{
+   int index { points.size() };
+   points.add(p);
+
+   if (nodes.empty())
+   {
+      reset(p.getX(), p.getY(), p.getZ(), 1.0);
+      return index;
+   }
+   if (!rootContains(p))
+   {
+      const Node &root { nodes[0] };
+      double half { root.half };
+      double cx { root.cx }, cy { root.cy }, cz { root.cz };
+      while (std::fabs(p.getX() - cx) > half || std::fabs(p.getY() - cy) > half || std::fabs(p.getZ() - cz) > half)
+      {
+         half *= 2;
+      }
+      // doubling means a rebuild, which happens O(log range) times over the life of the tree
+      reset(cx, cy, cz, half);
+      return index;
+   }
+   insertInto(index);
+   return index;
+}
+
+ArrayList<int> Octree::nearest(const Point &query, int k) const
+{
+   k = std::min(k, size()); // top_k allocates k slots up front
+   algorithms::top_k<double> best { k };
+   if (k <= 0 || nodes.empty())
+   {
+      return drainIndices(best);
+   }
+
+   const double q[3] { query.getX(), query.getY(), query.getZ() };
+   struct Pending
+   {
+      double dist;
+      int node;
+   };
+   auto closerFirst { [](const Pending &a, const Pending &b) { return a.dist > b.dist; } };
+   algorithms::heap<Pending, decltype(closerFirst), 4> frontier { 64, closerFirst };
+
+   const Node *all { nodes.rawData() };
+   frontier.push(Pending { boxDistanceSq(all[0].cx, all[0].cy, all[0].cz, all[0].half, q), 0 });
+   while (!frontier.empty())
+   {
+      Pending next { frontier.pop() };
+      if (best.full() && next.dist > best.threshold())
+      {
+         break;
+      }
+      const Node &n { all[next.node] };
+      if (n.child < 0)
+      {
+         const int *items { n.items.rawData() };
+         for (int i {}; i < n.items.size(); i++)
+         {
+            best.push(squaredDistance(points, items[i], q), items[i]);
+         }
+         continue;
+      }
+      for (int octant {}; octant < 8; octant++)
+      {
+         const Node &c { all[n.child + octant] };
+         if (c.child >= 0 || !c.items.empty())
+         {
+            frontier.push(Pending { boxDistanceSq(c.cx, c.cy, c.cz, c.half, q), n.child + octant });
+         }
+      }
+   }
+   return drainIndices(best);
+}
+
+int Octree::nearest(const Point &query) const
+{
+   ArrayList<int> one { nearest(query, 1) };
+   return one.empty() ? -1 : one[0];
+}
+
+ArrayList<int> Octree::withinRadius(const Point &center, double radius) const
+{
+   ArrayList<int> out;
+   if (nodes.empty() || radius < 0)
+   {
+      return out;
+   }
+   const double q[3] { center.getX(), center.getY(), center.getZ() };
+   const Node *all { nodes.rawData() };
+
+   ArrayList<int> stack;
+   stack.add(0);
+   while (!stack.empty())
+   {
+      const Node &n { all[stack.removeAt(stack.size() - 1)] };
+      if (boxDistanceSq(n.cx, n.cy, n.cz, n.half, q) > radius * radius)
+      {
+         continue;
+      }
+      if (n.child >= 0)
+      {
+         for (int octant {}; octant < 8; octant++)
+         {
+            stack.add(n.child + octant);
+         }
+         continue;
+      }
+      const int *items { n.items.rawData() };
+      for (int i {}; i < n.items.size(); i++)
+      {
+         if (squaredDistance(points, items[i], q) <= radius * radius)
+         {
+            out.add(items[i]);
+         }
+      }
+   }
+   out.sort();
+   return out;
+}
+
+ArrayList<int> Octree::inBox(const Point &low, const Point &high) const
+{
+   ArrayList<int> out;
+   if (nodes.empty())
+   {
+      return out;
+   }
+   const double lo[3] { low.getX(), low.getY(), low.getZ() };
+   const double hi[3] { high.getX(), high.getY(), high.getZ() };
+   const Node *all { nodes.rawData() };
+
+   ArrayList<int> stack;
+   stack.add(0);
+   while (!stack.empty())
+   {
+      const Node &n { all[stack.removeAt(stack.size() - 1)] };
+      if (n.cx + n.half < lo[0] || n.cx - n.half > hi[0] || n.cy + n.half < lo[1] || n.cy - n.half > hi[1] ||
+          n.cz + n.half < lo[2] || n.cz - n.half > hi[2])
+      {
+         continue;
+      }
+      if (n.child >= 0)
+      {
+         for (int octant {}; octant < 8; octant++)
+         {
+            stack.add(n.child + octant);
+         }
+         continue;
+      }
+      const int *items { n.items.rawData() };
+      for (int i {}; i < n.items.size(); i++)
+      {
+         int p { items[i] };
+         double x { points.xData()[p] }, y { points.yData()[p] }, z { points.zData()[p] };
+         if (x >= lo[0] && x <= hi[0] && y >= lo[1] && y <= hi[1] && z >= lo[2] && z <= hi[2])
+         {
+            out.add(p);
+         }
+      }
+   }
+   out.sort();
+   return out;
+}
+
+// ----------------- PointIndex Implementation -----------------
+
+namespace
+{
+constexpr double POINT_CELL { 2 * Point::EPSILON };
+
+// beyond 2^53 cells apart neighbouring doubles are more than EPSILON apart, so only exact matches exist there
+constexpr double POINT_CELL_EXACT { 9007199254740992.0 };
+} // namespace
+
+PointIndex::PointIndex(int initCapacity)
+    : points(initCapacity), next(initCapacity), table { nullptr }, tableSize {}, cells {}
+{
+   int size { 16 };
+   while (size < 2 * initCapacity)
+   {
+      size <<= 1;
+   }
+   rehash(size);
+}
+
+PointIndex::PointIndex(const ArrayList<Point> &points) : PointIndex(points.size())
+{
+   for (int i {}; i < points.size(); i++)
+   {
+      add(points[i]);
+   }
+}
+
+PointIndex::PointIndex(const PointIndex &other)
+    : points { other.points }, next { other.next }, table { new Cell[other.tableSize] }, tableSize { other.tableSize },
+      cells { other.cells }
+{
+   std::memcpy(table, other.table, tableSize * sizeof(Cell));
+}
+
+PointIndex::PointIndex(PointIndex &&other) noexcept
+    : points { std::move(other.points) }, next { std::move(other.next) }, table { other.table },
+      tableSize { other.tableSize }, cells { other.cells }
+{
+   other.table = nullptr;
+   other.tableSize = 0;
+   other.cells = 0;
+}
+
+PointIndex::~PointIndex() noexcept { delete[] table; }
+
+PointIndex &PointIndex::operator=(PointIndex other) noexcept
+{
+   std::swap(points, other.points);
+   std::swap(next, other.next);
+   std::swap(table, other.table);
+   std::swap(tableSize, other.tableSize);
+   std::swap(cells, other.cells);
+   return *this;
+}
+
+long long PointIndex::cellKey(double v) noexcept
+{
+   double c { std::floor(v / POINT_CELL) };
+   if (std::fabs(c) < POINT_CELL_EXACT)
+   {
+      return static_cast<long long>(c);
+   }
+   // huge, infinite or NaN: the bit pattern is as good a key as any
+   long long bits;
+   std::memcpy(&bits, &v, sizeof(bits));
+   return bits;
+}
+
+// cells that can hold a coordinate within EPSILON of v: its own and the neighbour on the near side. Both neighbours
+// are kept when v sits too close to the middle of the cell to tell the side apart reliably
+int PointIndex::cellCandidates(double v, long long *keys) noexcept
+{
+   double scaled { v / POINT_CELL };
+   double c { std::floor(scaled) };
+   keys[0] = cellKey(v);
+   if (!(std::fabs(c) < POINT_CELL_EXACT))
+   {
+      return 1;
+   }
+
+   int n { 1 };
+   double frac { scaled - c };
+   if (frac < 0.5 + 1e-6)
+   {
+      keys[n++] = keys[0] - 1;
+   }
+   if (frac > 0.5 - 1e-6)
+   {
+      keys[n++] = keys[0] + 1;
+   }
+   return n;
+}
+
+std::size_t PointIndex::hashCell(long long kx, long long ky, long long kz) noexcept
+{
+   // splitmix64 finalizer over a combination of the three keys
+   unsigned long long h { static_cast<unsigned long long>(kx) * 0x9E3779B97F4A7C15ULL };
+   h ^= static_cast<unsigned long long>(ky) + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+   h ^= static_cast<unsigned long long>(kz) + 0x85EBCA77C2B2AE63ULL + (h << 6) + (h >> 2);
+   h ^= h >> 30;
+   h *= 0xBF58476D1CE4E5B9ULL;
+   h ^= h >> 27;
+   h *= 0x94D049BB133111EBULL;
+   h ^= h >> 31;
+   return static_cast<std::size_t>(h);
+}
+
+// slot of the cell, or the empty slot where it would go
+int PointIndex::findSlot(long long kx, long long ky, long long kz) const noexcept
+{
+   int mask { tableSize - 1 };
+   int slot { static_cast<int>(hashCell(kx, ky, kz) & mask) };
+   while (table[slot].head >= 0 && (table[slot].kx != kx || table[slot].ky != ky || table[slot].kz != kz))
+   {
+      slot = (slot + 1) & mask;
+   }
+   return slot;
+}
+
+void PointIndex::link(int index)
+{
+   const Point &p { points[index] };
+   long long kx { cellKey(p.getX()) }, ky { cellKey(p.getY()) }, kz { cellKey(p.getZ()) };
+   Cell &cell { table[findSlot(kx, ky, kz)] };
+   if (cell.head < 0)
+   {
+      cell = Cell { kx, ky, kz, index, index };
+      cells++;
+      return;
+   }
+   next[cell.tail] = index;
+   cell.tail = index;
+}
+
+void PointIndex::rehash(int newSize)
+{
+   delete[] table;
+   table = new Cell[newSize];
+   tableSize = newSize;
+   cells = 0;
+   for (int i {}; i < newSize; i++)
+   {
+      table[i].head = -1;
+   }
+   for (int i {}; i < points.size(); i++)
+   {
+      next[i] = -1;
+      link(i);
+   }
+}
+
+int PointIndex::add(const Point &p)
+{
+   int index { points.size() };
+   points.add(p);
+   next.add(-1);
+   if (2 * (cells + 1) > tableSize)
+   {
+      rehash(tableSize * 2);
+      return index;
+   }
+   link(index);
+   return index;
+}
+
+int PointIndex::addUnique(const Point &p)
+{
+   int found { indexOf(p) };
+   return found >= 0 ? found : add(p);
+}
+
+int PointIndex::indexOf(const Point &p) const
+{
+   long long xs[3], ys[3], zs[3];
+   int nx { cellCandidates(p.getX(), xs) };
+   int ny { cellCandidates(p.getY(), ys) };
+   int nz { cellCandidates(p.getZ(), zs) };
+
+   int best { -1 };
+   const Point *all { points.rawData() };
+   const int *chain { next.rawData() };
+   for (int a {}; a < nx; a++)
+   {
+      for (int b {}; b < ny; b++)
+      {
+         for (int c {}; c < nz; c++)
+         {
+            const Cell &cell { table[findSlot(xs[a], ys[b], zs[c])] };
+            // chains run in insertion order, so the first hit is the smallest index in this cell
+            for (int i { cell.head }; i >= 0 && (best < 0 || i < best); i = chain[i])
+            {
+               if (all[i] == p)
+               {
+                  best = i;
+                  break;
+               }
+            }
+         }
+      }
+   }
+   return best;
+}
+
+bool PointIndex::contains(const Point &p) const { return indexOf(p) != -1; }
+
+ArrayList<Point> PointIndex::dedup(const ArrayList<Point> &points)
+{
+   PointIndex seen(points.size());
+   for (int i {}; i < points.size(); i++)
+   {
+      seen.addUnique(points[i]);
+   }
+   return std::move(seen.points);
+}
+
+// ----------------- TextNormalizer Implementation -----------------
+
+namespace
+{
+// the word tricks below read byte 0 from the low bits
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+constexpr bool LITTLE_ENDIAN_WORDS { true };
+#else
+constexpr bool LITTLE_ENDIAN_WORDS { false };
+#endif
+
+constexpr uint64_t ONES { 0x0101010101010101ull };
+constexpr uint64_t HIGHS { 0x8080808080808080ull };
+
+uint64_t loadWord(const char *p) noexcept
+{
+   uint64_t w;
+   std::memcpy(&w, p, sizeof w);
+   return w;
+}
+
+// high bit of each byte set where lo <= byte <= hi, for words with every high bit clear
+constexpr uint64_t inRange(uint64_t w, unsigned char lo, unsigned char hi) noexcept
+{
+   uint64_t geLo { (w + ONES * (0x80 - lo)) & HIGHS };
+   uint64_t gtHi { (w + ONES * (0x7f - hi)) & HIGHS };
+   return geLo & ~gtHi;
+}
+
+constexpr uint64_t upperMask(uint64_t w) noexcept { return inRange(w, 'A', 'Z'); }
+
+constexpr uint64_t alnumMask(uint64_t w) noexcept
+{
+   return inRange(w, '0', '9') | inRange(w, 'A', 'Z') | inRange(w, 'a', 'z');
+}
+
+// 'A'..'Z' differ from 'a'..'z' by 0x20, which is the high bit shifted down twice
+constexpr uint64_t lowerWord(uint64_t w) noexcept { return w | (upperMask(w) >> 2); }
+
+constexpr bool alnumAscii(unsigned char c) noexcept
+{
+   return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// length of the well-formed UTF-8 sequence starting at text[i], 0 when it is not one
+size_t utf8Length(std::string_view text, size_t i) noexcept
+{
+   auto byte { [&](size_t j) { return static_cast<unsigned char>(text[j]); } };
+   auto cont { [&](size_t j) { return j < text.size() && (byte(j) & 0xC0) == 0x80; } };
+
+   unsigned char c { byte(i) };
+   if (c < 0x80)
+   {
+      return 1;
+   }
+   if (c >= 0xC2 && c <= 0xDF)
+   {
+      return cont(i + 1) ? 2 : 0;
+   }
+   if (c >= 0xE0 && c <= 0xEF)
+   {
+      if (!cont(i + 1) || !cont(i + 2))
+      {
+         return 0;
+      }
+      unsigned char c1 { byte(i + 1) };
+      if ((c == 0xE0 && c1 < 0xA0) || (c == 0xED && c1 > 0x9F))
+      {
+         return 0; // overlong, or a UTF-16 surrogate
+      }
+      return 3;
+   }
+   if (c >= 0xF0 && c <= 0xF4)
+   {
+      if (!cont(i + 1) || !cont(i + 2) || !cont(i + 3))
+      {
+         return 0;
+      }
+      unsigned char c1 { byte(i + 1) };
+      if ((c == 0xF0 && c1 < 0x90) || (c == 0xF4 && c1 > 0x8F))
+      {
+         return 0; // overlong, or past U+10FFFF
+      }
+      return 4;
+   }
+   return 0;
+}
+} // namespace
+
+bool TextNormalizer::validUtf8(std::string_view text) noexcept
+{
+   size_t i {};
+   while (i < text.size())
+   {
+      if (i + 8 <= text.size() && (loadWord(text.data() + i) & HIGHS) == 0)
+      {
+         i += 8;
+         continue;
+      }
+      size_t len { utf8Length(text, i) };
+      if (len == 0)
+      {
+         return false;
+      }
+      i += len;
+   }
+   return true;
+}
+
+void TextNormalizer::toLowerAscii(char *text, size_t length) noexcept
+{
+   size_t i {};
+   for (; i + 8 <= length; i += 8)
+   {
+      uint64_t w { loadWord(text + i) };
+      // range test on the low 7 bits, then drop the bytes that had the high bit set
+      uint64_t upper { upperMask(w & ~HIGHS) & ~w };
+      w |= upper >> 2;
+      std::memcpy(text + i, &w, sizeof w);
+   }
+   for (; i < length; i++)
+   {
+      unsigned char c { static_cast<unsigned char>(text[i]) };
+      if (c >= 'A' && c <= 'Z')
+      {
+         text[i] = static_cast<char>(c | 0x20);
+      }
+   }
+}
+
+std::string_view TextNormalizer::normalize(std::string_view text)
+{
+   // worst case every byte is invalid and turns into a 3-byte U+FFFD
+   size_t needed { text.size() * 3 + 1 };
+   if (needed > capacity)
+   {
+      capacity = std::max(needed, capacity * 2);
+      buffer.reset(new char[capacity]);
+   }
+
+   char *out { buffer.get() };
+   size_t used {};
+   bool pendingSpace {};
+   auto separate { [&]() {
+      if (pendingSpace && used > 0)
+      {
+         out[used++] = ' ';
+      }
+      pendingSpace = false;
+   } };
+
+   size_t i {};
+   const size_t n { text.size() };
+   while (i < n)
+   {
+      // fast path over eight plain ASCII bytes: the leading run of letters/digits is copied lowercased in one
+      // store and the separator run after it is skipped, both measured with a count of trailing zeros. There is
+      // room for the full 8-byte store since the output never outgrows 3 bytes per input byte
+      if (LITTLE_ENDIAN_WORDS && i + 8 <= n)
+      {
+         uint64_t w { loadWord(text.data() + i) };
+         if ((w & HIGHS) == 0)
+         {
+            uint64_t alnum { alnumMask(w) };
+            uint64_t separators { ~alnum & HIGHS };
+            int word { separators ? __builtin_ctzll(separators) >> 3 : 8 };
+            if (word > 0)
+            {
+               separate();
+               uint64_t lowered { lowerWord(w) };
+               std::memcpy(out + used, &lowered, sizeof lowered);
+               used += word;
+               i += word;
+            }
+            if (word < 8)
+            {
+               uint64_t rest { alnum >> (word * 8) };
+               pendingSpace = true;
+               i += rest ? __builtin_ctzll(rest) >> 3 : 8 - word;
+            }
+            continue;
+         }
+      }
+
+      unsigned char c { static_cast<unsigned char>(text[i]) };
+      if (c < 0x80)
+      {
+         if (alnumAscii(c))
+         {
+            separate();
+            out[used++] = static_cast<char>(c >= 'A' && c <= 'Z' ? c | 0x20 : c);
+         }
+         else
+         {
+            pendingSpace = true;
+         }
+         i++;
+         continue;
+      }
+
+      separate();
+      size_t len { utf8Length(text, i) };
+      if (len == 0)
+      {
+         out[used++] = static_cast<char>(0xEF);
+         out[used++] = static_cast<char>(0xBF);
+         out[used++] = static_cast<char>(0xBD);
+         i++;
+      }
+      else
+      {
+         std::memcpy(out + used, text.data() + i, len);
+         used += len;
+         i += len;
+      }
+   }
+   return std::string_view { out, used };
+}
+
+namespace
+{
+// per-thread, so concurrent inserts and queries never share an output buffer
+TextNormalizer &normalizer()
+{
+   thread_local TextNormalizer local;
+   return local;
+}
+} // namespace
+
+// ----------------- TextArena Implementation -----------------
+namespace
+{
+// LZ4 block layout: token (literal length << 4 | match length - 4), literal length extension bytes, literals,
+// 2-byte little-endian offset, match length extension bytes. The last sequence carries literals only
+constexpr int LZ_MIN_MATCH { 4 };
+constexpr int LZ_LAST_LITERALS { 5 }; // a match never reaches into the last 5 bytes
+constexpr int LZ_MATCH_LIMIT { 12 };  // and never starts in the last 12
+constexpr int LZ_HASH_BITS { 12 };
+constexpr int LZ_MAX_OFFSET { 65535 };
+
+inline uint32_t load32(const char *p)
+{
+   uint32_t v;
+   std::memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+inline uint32_t lzHash(uint32_t seq) { return (seq * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+inline char *writeLength(char *op, int len)
+{
+   for (; len >= 255; len -= 255)
+   {
+      *op++ = static_cast<char>(255);
+   }
+   *op++ = static_cast<char>(len);
+   return op;
+}
+
+inline char *writeSequence(char *op, const char *literals, int literalLength, int offset, int matchLength)
+{
+   char *token { op++ };
+   *token = static_cast<char>(std::min(literalLength, 15) << 4);
+   if (literalLength >= 15)
+   {
+      op = writeLength(op, literalLength - 15);
+   }
+   std::memcpy(op, literals, literalLength);
+   op += literalLength;
+   if (matchLength == 0)
+   {
+      return op; // closing literals
+   }
+   *op++ = static_cast<char>(offset & 0xFF);
+   *op++ = static_cast<char>(offset >> 8);
+   int extra { matchLength - LZ_MIN_MATCH };
+   *token = static_cast<char>(*token | std::min(extra, 15));
+   if (extra >= 15)
+   {
+      op = writeLength(op, extra - 15);
+   }
+   return op;
+}
+
+// false when the extension runs past the input or the length past limit
+inline bool readLength(const unsigned char *in, int n, int &ip, int &len, int limit)
+{
+   unsigned char b;
+   do
+   {
+      if (ip >= n)
+      {
+         return false;
+      }
+      b = in[ip++];
+      len += b;
+      if (len > limit)
+      {
+         return false;
+      }
+   } while (b == 255);
+   return true;
+}
+} // namespace
+
+int TextArena::compress(const char *in, int n, char *out) noexcept
+{
+   char *op { out };
+   int anchor {};
+   if (n >= LZ_MATCH_LIMIT)
+   {
+      int table[1 << LZ_HASH_BITS];
+      std::fill(std::begin(table), std::end(table), -1);
+      int last { n - LZ_MATCH_LIMIT };
+      int matchEnd { n - LZ_LAST_LITERALS };
+      int i {};
+      int misses {};
+      while (i <= last)
+      {
+         uint32_t seq { load32(in + i) };
+         uint32_t h { lzHash(seq) };
+         int candidate { table[h] };
+         table[h] = i;
+         if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || load32(in + candidate) != seq)
+         {
+            // step further the longer nothing matches, incompressible input goes through quickly
+            i += 1 + (misses++ >> 6);
+            continue;
+         }
+         misses = 0;
+         while (i > anchor && candidate > 0 && in[i - 1] == in[candidate - 1])
+         {
+            i--;
+            candidate--;
+         }
+         int length { LZ_MIN_MATCH };
+         while (i + length < matchEnd && in[i + length] == in[candidate + length])
+         {
+            length++;
+         }
+         op = writeSequence(op, in + anchor, i - anchor, i - candidate, length);
+         i += length;
+         anchor = i;
+      }
+   }
+   op = writeSequence(op, in + anchor, n - anchor, 0, 0);
+   return static_cast<int>(op - out);
+}
+
+namespace
+{
+// Decodes sequences from in[ip] / out[op] on until at least `want` bytes are out or the input ends. Returns the
+// byte count, or -1 when the input is malformed. ip is left after the last sequence read, so decoding can resume.
+// A `want` past outSize decodes all of the input
+int decodePrefix(const unsigned char *in, int n, int &ip, char *out, int op, int outSize, int want) noexcept
+{
+   while (ip < n && op < want)
+   {
+      int token { in[ip++] };
+      int literals { token >> 4 };
+      if (literals == 15 && !readLength(in, n, ip, literals, outSize))
+      {
+         return -1;
+      }
+      if (literals > n - ip || literals > outSize - op)
+      {
+         return -1;
+      }
+      // short runs are copied 16 bytes at a time while both buffers have the room
+      if (literals <= 16 && n - ip >= 16 && outSize - op >= 16)
+      {
+         std::memcpy(out + op, in + ip, 16);
+      }
+      else
+      {
+         std::memcpy(out + op, in + ip, literals);
+      }
+      ip += literals;
+      op += literals;
+      if (ip == n)
+      {
+         break;
+      }
+
+      if (n - ip < 2)
+      {
+         return -1;
+      }
+      int offset { in[ip] | in[ip + 1] << 8 };
+      ip += 2;
+      int length { token & 15 };
+      if (length == 15 && !readLength(in, n, ip, length, outSize))
+      {
+         return -1;
+      }
+      length += LZ_MIN_MATCH;
+      if (offset == 0 || offset > op || length > outSize - op)
+      {
+         return -1;
+      }
+      char *dst { out + op };
+      const char *match { dst - offset };
+      if (offset >= 16 && outSize - op >= length + 16)
+      {
+         for (int j {}; j < length; j += 16)
+         {
+            std::memcpy(dst + j, match + j, 16);
+         }
+      }
+      else if (offset >= length)
+      {
+         std::memcpy(dst, match, length);
+      }
+      else
+      {
+         // overlapping copy repeats the last `offset` bytes
+         for (int j {}; j < length; j++)
+         {
+            dst[j] = match[j];
+         }
+      }
+      op += length;
+   }
+   return op;
+}
+} // namespace
+
+bool TextArena::decompress(const char *in, int n, char *out, int outSize) noexcept
+{
+   int ip {};
+   int produced { decodePrefix(reinterpret_cast<const unsigned char *>(in), n, ip, out, 0, outSize, INT_MAX) };
+   return produced == outSize && ip == n;
+}
+
+TextArena::TextArena()
+    : blocks {}, open { nullptr }, openSize {}, openCapacity {}, openLive {}, cacheLock {}, cache {}, useClock {},
+      storedBytes {}, rawBytes {}
+{
+}
+
+TextArena::~TextArena()
+{
+   clear();
+}
+
+void TextArena::clear()
+{
+   for (int i {}; i < blocks.size(); i++)
+   {
+      delete[] blocks[i].data;
+   }
+   blocks.clear();
+   delete[] open;
+   open = nullptr;
+   openSize = openCapacity = openLive = 0;
+
+   std::lock_guard<std::mutex> guard { cacheLock };
+   for (CacheSlot &slot : cache)
+   {
+      slot = CacheSlot {};
+   }
+   storedBytes = rawBytes = 0;
+}
+
+// compresses the open block and starts a new one, a block that does not shrink is kept as it is
+void TextArena::seal()
+{
+   std::unique_ptr<char[]> packed { new char[compressBound(openSize)] };
+   int size { compress(open, openSize, packed.get()) };
+   bool compressed { size < openSize };
+   if (!compressed)
+   {
+      size = openSize;
+   }
+   char *data { new char[size] };
+   std::memcpy(data, compressed ? packed.get() : open, size);
+   blocks.add(Block { data, size, openSize, compressed, openLive, false });
+   storedBytes += size;
+   openSize = openLive = 0;
+}
+
+TextArena::Ref TextArena::append(std::string_view text)
+{
+   int length { static_cast<int>(text.size()) };
+   if (openSize > 0 && openSize + length > BLOCK_SIZE)
+   {
+      seal();
+   }
+   if (openSize + length > openCapacity)
+   {
+      // a text longer than a block gets a block of its own
+      int newCapacity { std::max(BLOCK_SIZE, openSize + length) };
+      char *grown { new char[newCapacity] };
+      if (openSize > 0)
+      {
+         std::memcpy(grown, open, openSize);
+      }
+      delete[] open;
+      open = grown;
+      openCapacity = newCapacity;
+   }
+   Ref ref { blocks.size(), openSize, length };
+   if (length == 0)
+   {
+      return ref;
+   }
+   std::memcpy(open + openSize, text.data(), length);
+   openSize += length;
+   openLive += length;
+   rawBytes += length;
+   return ref;
+}
+
+void TextArena::discard(const Ref &ref) noexcept
+{
+   if (ref.block == blocks.size())
+   {
+      openLive -= ref.length;
+   }
+   else
+   {
+      blocks[ref.block].live -= ref.length;
+   }
+}
+
+int TextArena::condemn() noexcept
+{
+   int marked {};
+   for (int i {}; i < blocks.size(); i++)
+   {
+      Block &b { blocks[i] };
+      b.condemned = b.data != nullptr && b.live < b.rawSize - b.rawSize / 5;
+      marked += b.condemned;
+   }
+   return marked;
+}
+
+// A block keeps its slot in blocks once freed, so the Refs into later blocks stay valid
+void TextArena::releaseCondemned()
+{
+   std::lock_guard<std::mutex> guard { cacheLock };
+   for (int i {}; i < blocks.size(); i++)
+   {
+      Block &b { blocks[i] };
+      if (!b.condemned)
+      {
+         continue;
+      }
+      b.condemned = false;
+      if (b.live > 0)
+      {
+         continue;
+      }
+      for (CacheSlot &slot : cache)
+      {
+         if (slot.decoded.block == i)
+         {
+            slot = CacheSlot {};
+         }
+      }
+      delete[] b.data;
+      b.data = nullptr;
+      storedBytes -= b.size;
+      rawBytes -= b.rawSize;
+      b.size = b.rawSize = 0;
+   }
+}
+
+// Only the front of the block up to `need` bytes is decoded, into remembers how far it got and picks up from there
+// when a later read needs more
+const char *TextArena::decode(int block, int need, Cursor &into) const
+{
+   const Block &b { blocks[block] };
+   if (into.block == block && into.filled >= need)
+   {
+      return into.data.get();
+   }
+   if (into.block != block)
+   {
+      if (into.capacity < b.rawSize)
+      {
+         into.data.reset();
+         into.capacity = 0;
+         into.data.reset(new char[b.rawSize]);
+         into.capacity = b.rawSize;
+      }
+      into.block = block;
+      into.filled = into.consumed = 0;
+   }
+   int filled { decodePrefix(reinterpret_cast<const unsigned char *>(b.data), b.size, into.consumed, into.data.get(),
+                             into.filled, b.rawSize, need) };
+   if (filled < need)
+   {
+      into.block = -1;
+      throw std::runtime_error("Corrupted text block!");
+   }
+   into.filled = filled;
+   return into.data.get();
+}
+
+void TextArena::get(const Ref &ref, string &out)
+{
+   if (ref.block == blocks.size())
+   {
+      out.assign(open + ref.offset, ref.length);
+      return;
+   }
+   const Block &b { blocks[ref.block] };
+   if (!b.compressed)
+   {
+      out.assign(b.data + ref.offset, ref.length);
+      return;
+   }
+   std::lock_guard<std::mutex> guard { cacheLock };
+   CacheSlot *victim { &cache[0] };
+   for (CacheSlot &slot : cache)
+   {
+      if (slot.decoded.block == ref.block)
+      {
+         victim = &slot;
+         break;
+      }
+      if (slot.lastUse < victim->lastUse)
+      {
+         victim = &slot;
+      }
+   }
+   victim->lastUse = ++useClock;
+   out.assign(decode(ref.block, ref.offset + ref.length, victim->decoded) + ref.offset, ref.length);
+}
+
+void TextArena::get(const Ref &ref, string &out, Cursor &cursor) const
+{
+   if (ref.block == blocks.size())
+   {
+      out.assign(open + ref.offset, ref.length);
+      return;
+   }
+   const Block &b { blocks[ref.block] };
+   if (!b.compressed)
+   {
+      out.assign(b.data + ref.offset, ref.length);
+      return;
+   }
+   out.assign(decode(ref.block, ref.offset + ref.length, cursor) + ref.offset, ref.length);
+}
+
+int64_t TextArena::residentBytes() const
+{
+   return storedBytes + openCapacity + blocks.size() * static_cast<int64_t>(sizeof(Block)) + cacheBytes();
+}
+
+// readers refill the slots under the lock while the caller only holds the store's shared one
+int64_t TextArena::cacheBytes() const
+{
+   std::lock_guard<std::mutex> guard { cacheLock };
+   int64_t bytes {};
+   for (const CacheSlot &slot : cache)
+   {
+      bytes += slot.decoded.capacity;
+   }
+   return bytes;
+}
+
+void TextArena::trimCache()
+{
+   std::lock_guard<std::mutex> guard { cacheLock };
+   for (CacheSlot &slot : cache)
+   {
+      slot = CacheSlot {};
+   }
+}
+
+// ----------------- InvertedIndex Implementation -----------------
+namespace
+{
+inline void writeVarint(ArrayList<char> &out, uint32_t v)
+{
+   while (v >= 0x80)
+   {
+      out.add(static_cast<char>(v | 0x80));
+      v >>= 7;
+   }
+   out.add(static_cast<char>(v));
+}
+
+inline int readVarint(const char *bytes, int &pos)
+{
+   uint32_t v {};
+   for (int shift {};; shift += 7)
+   {
+      uint32_t byte { static_cast<unsigned char>(bytes[pos++]) };
+      v |= (byte & 0x7F) << shift;
+      if (byte < 0x80)
+      {
+         return static_cast<int>(v);
+      }
+   }
+}
+
+// term ids of a text, sorted, with repeats
+template <typename Lookup> void termIds(std::string_view text, ArrayList<int> &ids, Lookup lookup)
+{
+   ids.clear();
+   TextNormalizer::forEachToken(normalizer().normalize(text), [&](std::string_view token) {
+      if (token.empty())
+      {
+         return;
+      }
+      int id { lookup(token) };
+      if (id >= 0)
+      {
+         ids.add(id);
+      }
+   });
+   ids.sort();
+}
+} // namespace
+
+// Walks one posting list in doc order
+struct InvertedIndex::Cursor
+{
+   static constexpr int END { INT_MAX };
+
+   const Term *term;
+   double weight; // idf times how often the word is in the query
+   double upper;  // no document scores more than this for the term
+   int block;
+   int pos;
+   int left; // postings still to read in the block
+   int doc;
+   int tf;
+
+   Cursor(const Term *term, double weight, double upper)
+       : term { term }, weight { weight }, upper { upper }, block { -1 }, pos {}, left {}, doc {}, tf {}
+   {
+      next();
+   }
+
+   void loadBlock()
+   {
+      const Skip &skip { term->skips[block] };
+      pos = skip.offset;
+      doc = skip.base;
+      left = skip.count;
+   }
+
+   void next()
+   {
+      if (left == 0)
+      {
+         if (++block >= term->skips.size())
+         {
+            doc = END;
+            return;
+         }
+         loadBlock();
+      }
+      const char *bytes { term->bytes.rawData() };
+      doc += readVarint(bytes, pos);
+      tf = readVarint(bytes, pos);
+      left--;
+   }
+
+   // the block a seek to target would land in, found without decoding; -1 when the list ends before target
+   int blockFor(int target) const
+   {
+      int blocks { term->skips.size() };
+      int b { std::max(block, 0) };
+      while (b < blocks && term->skips[b].last < target)
+      {
+         b++;
+      }
+      return b < blocks ? b : -1;
+   }
+
+   // first doc >= target, whole blocks ending before it are skipped without decoding
+   void seek(int target)
+   {
+      if (doc >= target)
+      {
+         return;
+      }
+      if (term->skips[block].last < target)
+      {
+         int blocks { term->skips.size() };
+         do
+         {
+            block++;
+         } while (block < blocks && term->skips[block].last < target);
+         if (block == blocks)
+         {
+            doc = END;
+            return;
+         }
+         loadBlock();
+         next();
+      }
+      while (doc < target)
+      {
+         next();
+      }
+   }
+};
+
+InvertedIndex::InvertedIndex(double k1, double b)
+    : k1 { k1 }, b { b }, dictionary {}, terms {}, docKeys {}, docLengths {}, liveDoc {}, totalLength {}
+{
+}
+
+InvertedIndex::~InvertedIndex()
+{
+   clear();
+}
+
+void InvertedIndex::clear()
+{
+   for (int i {}; i < terms.size(); i++)
+   {
+      delete terms[i];
+   }
+   terms.clear();
+   dictionary.clear();
+   docKeys.clear();
+   docLengths.clear();
+   liveDoc.clear();
+   totalLength = 0;
+}
+
+// -1 for an unknown token unless create is set
+int InvertedIndex::termId(std::string_view token, bool create)
+{
+   thread_local string key;
+   key.assign(token);
+   auto found { dictionary.find(key) };
+   if (found != dictionary.end())
+   {
+      return found->second;
+   }
+   if (!create)
+   {
+      return -1;
+   }
+   terms.add(new Term { ArrayList<char>(0), ArrayList<Skip>(0), 0, 0, 0, INT_MAX });
+   dictionary.emplace(key, terms.size() - 1);
+   return terms.size() - 1;
+}
+
+void InvertedIndex::add(int key, std::string_view text)
+{
+   remove(key);
+   thread_local ArrayList<int> ids;
+   termIds(text, ids, [this](std::string_view token) { return termId(token, true); });
+
+   int doc { docKeys.size() };
+   int length { ids.size() };
+   docKeys.add(key);
+   docLengths.add(length);
+   liveDoc[key] = doc;
+   totalLength += length;
+
+   for (int i {}; i < ids.size();)
+   {
+      int j { i + 1 };
+      while (j < ids.size() && ids[j] == ids[i])
+      {
+         j++;
+      }
+      Term &term { *terms[ids[i]] };
+      int tf { j - i };
+      if (term.postings % BLOCK == 0)
+      {
+         term.skips.add(Skip { term.lastDoc, doc, term.bytes.size(), 0, 0, INT_MAX });
+      }
+      writeVarint(term.bytes, static_cast<uint32_t>(doc - term.lastDoc));
+      writeVarint(term.bytes, static_cast<uint32_t>(tf));
+      Skip &skip { term.skips[term.skips.size() - 1] };
+      skip.last = doc;
+      skip.count++;
+      skip.maxTf = std::max(skip.maxTf, tf);
+      skip.minLength = std::min(skip.minLength, length);
+      term.postings++;
+      term.lastDoc = doc;
+      term.maxTf = std::max(term.maxTf, tf);
+      term.minLength = std::min(term.minLength, length);
+      i = j;
+   }
+}
+
+void InvertedIndex::remove(int key)
+{
+   auto found { liveDoc.find(key) };
+   if (found == liveDoc.end())
+   {
+      return;
+   }
+   docLengths[found->second] = -1;
+   liveDoc.erase(found);
+}
+
+int InvertedIndex::search(std::string_view query, int k, int *keys, double *scores) const
+{
+   if (k <= 0)
+   {
+      throw invalid_k_value();
+   }
+   int docs { docKeys.size() };
+   if (totalLength == 0)
+   {
+      return 0;
+   }
+   double averageLength { static_cast<double>(totalLength) / docs };
+   // BM25 term frequency part, grows with tf and shrinks with the document length
+   auto saturation { [this, averageLength](int tf, int length) {
+      return tf * (k1 + 1) / (tf + k1 * (1 - b + b * length / averageLength));
+   } };
+
+   ArrayList<int> ids;
+   termIds(query, ids, [this](std::string_view token) {
+      auto found { dictionary.find(string { token }) };
+      return found == dictionary.end() ? -1 : found->second;
+   });
+   ArrayList<Cursor> cursors(ids.size());
+   for (int i {}; i < ids.size();)
+   {
+      int j { i + 1 };
+      while (j < ids.size() && ids[j] == ids[i])
+      {
+         j++;
+      }
+      const Term *term { terms[ids[i]] };
+      double idf { std::log(1 + (docs - term->postings + 0.5) / (term->postings + 0.5)) };
+      double weight { idf * (j - i) };
+      cursors.emplace_back(term, weight, weight * saturation(term->maxTf, term->minLength));
+      i = j;
+   }
+
+   // cursors still in play, re-sorted by doc every round (queries have a handful of words)
+   std::unique_ptr<Cursor *[]> order { new Cursor *[std::max(cursors.size(), 1)] };
+   int live {};
+   for (int i {}; i < cursors.size(); i++)
+   {
+      if (cursors[i].doc != Cursor::END)
+      {
+         order[live++] = &cursors[i];
+      }
+   }
+   auto byDoc { [](const Cursor *x, const Cursor *y) { return x->doc < y->doc; } };
+   algorithms::top_k<double, int, std::greater<double>> best { k };
+
+   // WAND: walking the cursors in doc order, the pivot is the first one where the summed bounds could still
+   // beat the k-th score. Documents before the pivot doc cannot make it, so the cursors behind it seek forward
+   while (live > 0)
+   {
+      algorithms::insertion_sort(order.get(), order.get() + live, byDoc);
+      double bound {};
+      int pivot { -1 };
+      for (int i {}; i < live; i++)
+      {
+         bound += order[i]->upper;
+         if (best.accepts(bound))
+         {
+            pivot = i;
+            break;
+         }
+      }
+      if (pivot < 0)
+      {
+         break;
+      }
+
+      int doc { order[pivot]->doc };
+      while (pivot + 1 < live && order[pivot + 1]->doc == doc)
+      {
+         pivot++;
+      }
+
+      // the same test against the blocks holding doc; when even those fall short, every doc up to the first
+      // block end is out too
+      double blockBound {};
+      int skipTo { pivot + 1 < live ? order[pivot + 1]->doc : Cursor::END };
+      for (int i {}; i <= pivot; i++)
+      {
+         int block { order[i]->blockFor(doc) };
+         if (block >= 0)
+         {
+            const Skip &skip { order[i]->term->skips[block] };
+            blockBound += order[i]->weight * saturation(skip.maxTf, skip.minLength);
+            skipTo = std::min(skipTo, skip.last + 1);
+         }
+      }
+      if (!best.accepts(blockBound))
+      {
+         for (int i {}; i <= pivot; i++)
+         {
+            order[i]->seek(skipTo);
+         }
+      }
+      else if (order[0]->doc == doc)
+      {
+         int length { docLengths[doc] };
+         double score {};
+         for (int i {}; i < live && order[i]->doc == doc; i++)
+         {
+            Cursor *c { order[i] };
+            if (length >= 0)
+            {
+               score += c->weight * saturation(c->tf, length);
+            }
+            c->next();
+         }
+         if (length >= 0)
+         {
+            best.push(score, docKeys[doc]);
+         }
+      }
+      else
+      {
+         for (int i {}; i < pivot; i++)
+         {
+            order[i]->seek(doc);
+         }
+      }
+      live = static_cast<int>(std::remove_if(order.get(), order.get() + live,
+                                             [](const Cursor *c) { return c->doc == Cursor::END; }) -
+                              order.get());
+   }
+   return best.drain(keys, scores);
+}
+
+int64_t InvertedIndex::bytes() const noexcept
+{
+   int64_t total { (docKeys.size() + docLengths.size()) * static_cast<int64_t>(sizeof(int)) };
+   for (int i {}; i < terms.size(); i++)
+   {
+      const Term &term { *terms[i] };
+      total += sizeof(Term) + term.bytes.getCapacity() + term.skips.getCapacity() * static_cast<int64_t>(sizeof(Skip));
+   }
+   for (const auto &entry : dictionary)
+   {
+      total += sizeof(entry) + entry.first.capacity();
+   }
+   return total + liveDoc.size() * static_cast<int64_t>(sizeof(std::pair<const int, int>) + sizeof(void *));
+}
+
+// ----------------- LshIndex Implementation -----------------
+namespace
+{
+// splitmix64, so a seed always draws the same hash functions on every platform
+class SplitMix
+{
+ private:
+   uint64_t state;
+
+ public:
+   explicit SplitMix(uint64_t seed) : state { seed } {}
+
+   uint64_t next()
+   {
+      uint64_t z { state += 0x9E3779B97F4A7C15ull };
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+   }
+
+   // uniform in (0, 1)
+   double uniform() { return ((next() >> 11) + 0.5) * (1.0 / (1ull << 53)); }
+
+   // Box-Muller, and the Cauchy quantile function
+   double gaussian() { return std::sqrt(-2 * std::log(uniform())) * std::cos(2 * PI * uniform()); }
+   double cauchy() { return std::tan(PI * (uniform() - 0.5)); }
+
+   static constexpr double PI { 3.14159265358979323846 };
+};
+
+inline uint64_t mixKey(uint64_t key, int64_t value) noexcept
+{
+   uint64_t h { key ^ (static_cast<uint64_t>(value) * 0x9E3779B97F4A7C15ull) };
+   h ^= h >> 30;
+   h *= 0xBF58476D1CE4E5B9ull;
+   h ^= h >> 27;
+   return h;
+}
+
+// a bucket next door: hash function `hash` of a table moved by step
+struct Probe
+{
+   float cost; // how far the query sits from that boundary
+   int hash;
+   int step;
+};
+} // namespace
+
+LshIndex::LshIndex(int dimension, Family family, int tables, int bits, double width, uint64_t seed)
+    : dimension { dimension }, family { family }, tables { tables }, bits { bits }, width { width },
+      projections { tables * bits + SIGNATURE_WORDS * 64 }, planes {}, offsets {}, normBound {}, slotKeys {},
+      bucketKeys {}, signatures {}, freeSlots {}, slotOf {}, buckets { nullptr }
+{
+   if (dimension <= 0 || tables <= 0 || bits <= 0 || bits > 64 || !(width > 0))
+   {
+      throw std::invalid_argument("Invalid LSH parameters!");
+   }
+   SplitMix rng { seed };
+   int rows { dimension + (family == Mips) };
+   planes.reset(new float[static_cast<size_t>(rows) * projections]);
+   offsets.reset(new float[tables * bits]);
+   // the table hashes, then the signature planes, which are always Gaussian so their signs are SimHash bits
+   int hashes { tables * bits };
+   for (int p {}; p < projections; p++)
+   {
+      if (family == BitSampling && p < hashes)
+      {
+         // a plane with a single one picks out a random component
+         int component { static_cast<int>(rng.next() % static_cast<uint64_t>(dimension)) };
+         for (int d {}; d < dimension; d++)
+         {
+            planes[static_cast<size_t>(d) * projections + p] = d == component ? 1.0f : 0.0f;
+         }
+         continue;
+      }
+      bool cauchy { family == Cauchy && p < hashes };
+      for (int d {}; d < rows; d++)
+      {
+         planes[static_cast<size_t>(d) * projections + p] = static_cast<float>(cauchy ? rng.cauchy() : rng.gaussian());
+      }
+   }
+   for (int p {}; p < hashes; p++)
+   {
+      offsets[p] = static_cast<float>(rng.uniform() * width);
+   }
+   buckets = new std::unordered_map<uint64_t, ArrayList<int>>[tables];
+}
+
+LshIndex::~LshIndex() { delete[] buckets; }
+
+// every projection of vector at once: the inner loop runs along a row of planes, which vectorizes. appended is the
+// extra component of the Mips reduction
+void LshIndex::project(const float *vector, float *out, float appended) const
+{
+   std::fill(out, out + projections, 0.0f);
+   int rows { dimension + (family == Mips) };
+   for (int d {}; d < rows; d++)
+   {
+      const float *plane { planes.get() + static_cast<size_t>(d) * projections };
+      float x { d < dimension ? vector[d] : appended };
+      for (int p {}; p < projections; p++)
+      {
+         out[p] += x * plane[p];
+      }
+   }
+}
+
+// bucket of table for the projected vector, with hash function `perturbed` moved by step (-1 for none)
+uint64_t LshIndex::tableKey(int table, const float *projected, int perturbed, int step) const
+{
+   const float *h { projected + table * bits };
+   uint64_t key {};
+   if (signHashes())
+   {
+      for (int i {}; i < bits; i++)
+      {
+         key |= static_cast<uint64_t>(h[i] > 0) << i;
+      }
+      return perturbed >= 0 ? key ^ (1ull << perturbed) : key;
+   }
+   const float *b { offsets.get() + table * bits };
+   for (int i {}; i < bits; i++)
+   {
+      int64_t value { static_cast<int64_t>(std::floor((h[i] + b[i]) / width)) };
+      key = mixKey(key, i == perturbed ? value + step : value);
+   }
+   return key;
+}
+
+void LshIndex::add(int key, const float *vector)
+{
+   remove(key);
+   dropStaleSlots();
+   int slot {};
+   if (freeSlots.empty())
+   {
+      slot = slotKeys.size();
+      slotKeys.add(key);
+      for (int t {}; t < tables; t++)
+      {
+         bucketKeys.add(0);
+      }
+      for (int w {}; w < SIGNATURE_WORDS; w++)
+      {
+         signatures.add(0);
+      }
+   }
+   else
+   {
+      slot = freeSlots.removeAt(freeSlots.size() - 1);
+      slotKeys[slot] = key;
+   }
+   slotOf[key] = slot;
+
+   float appended {};
+   if (family == Mips)
+   {
+      double squared {};
+      for (int d {}; d < dimension; d++)
+      {
+         squared += static_cast<double>(vector[d]) * vector[d];
+      }
+      appended = static_cast<float>(std::sqrt(std::max(normBound * normBound - squared, 0.0)));
+   }
+   thread_local ArrayList<float> projected;
+   projected.resize(projections);
+   project(vector, projected.rawData(), appended);
+   for (int t {}; t < tables; t++)
+   {
+      uint64_t bucket { tableKey(t, projected.rawData(), -1, 0) };
+      bucketKeys[slot * tables + t] = bucket;
+      buckets[t][bucket].add(slot);
+   }
+   const float *signPlanes { projected.rawData() + tables * bits };
+   for (int w {}; w < SIGNATURE_WORDS; w++)
+   {
+      uint64_t word {};
+      for (int i {}; i < 64; i++)
+      {
+         word |= static_cast<uint64_t>(signPlanes[w * 64 + i] >= 0) << i;
+      }
+      signatures[slot * SIGNATURE_WORDS + w] = word;
+   }
+}
+
+void LshIndex::remove(int key)
+{
+   auto found { slotOf.find(key) };
+   if (found == slotOf.end())
+   {
+      return;
+   }
+   int slot { found->second };
+   for (int t {}; t < tables; t++)
+   {
+      auto bucket { buckets[t].find(bucketKeys[slot * tables + t]) };
+      ArrayList<int> &slots { bucket->second };
+      int at { slots.indexOf(slot) };
+      slots[at] = slots[slots.size() - 1];
+      slots.removeAt(slots.size() - 1);
+      if (slots.empty())
+      {
+         buckets[t].erase(bucket);
+      }
+   }
+   slotKeys[slot] = -1;
+   freeSlots.add(slot);
+   slotOf.erase(found);
+}
+
+void LshIndex::clear()
+{
+   for (int t {}; t < tables; t++)
+   {
+      buckets[t].clear();
+   }
+   slotKeys.clear();
+   bucketKeys.clear();
+   signatures.clear();
+   freeSlots.clear();
+   slotOf.clear();
+}
+
+// The last slot is moved into the hole a free slot left, so the live slots end up dense without a full renumbering.
+// A free slot that ends up past the end stays in freeSlots until it comes up
+int LshIndex::compact(int maxMoves)
+{
+   int moved {};
+   for (; moved < maxMoves; moved++)
+   {
+      int last { slotKeys.size() - 1 };
+      if (last >= 0 && slotKeys[last] < 0)
+      {
+         dropLastSlot();
+         continue;
+      }
+      dropStaleSlots();
+      if (freeSlots.empty())
+      {
+         break;
+      }
+      int hole { freeSlots.removeAt(freeSlots.size() - 1) };
+      int key { slotKeys[last] };
+      for (int t {}; t < tables; t++)
+      {
+         uint64_t bucket { bucketKeys[last * tables + t] };
+         ArrayList<int> &slots { buckets[t].find(bucket)->second };
+         slots[slots.indexOf(last)] = hole;
+         bucketKeys[hole * tables + t] = bucket;
+      }
+      for (int w {}; w < SIGNATURE_WORDS; w++)
+      {
+         signatures[hole * SIGNATURE_WORDS + w] = signatures[last * SIGNATURE_WORDS + w];
+      }
+      slotKeys[hole] = key;
+      slotOf[key] = hole;
+      dropLastSlot();
+   }
+   dropStaleSlots();
+   return moved;
+}
+
+// free slots past the end, left behind by compact
+void LshIndex::dropStaleSlots()
+{
+   while (!freeSlots.empty() && freeSlots[freeSlots.size() - 1] >= slotKeys.size())
+   {
+      freeSlots.removeAt(freeSlots.size() - 1);
+   }
+}
+
+void LshIndex::dropLastSlot()
+{
+   slotKeys.removeAt(slotKeys.size() - 1);
+   for (int t {}; t < tables; t++)
+   {
+      bucketKeys.removeAt(bucketKeys.size() - 1);
+   }
+   for (int w {}; w < SIGNATURE_WORDS; w++)
+   {
+      signatures.removeAt(signatures.size() - 1);
+   }
+}
+
+int LshIndex::candidates(const float *query, int probes, int limit, int *keys) const
+{
+   if (limit <= 0 || slotOf.empty())
+   {
+      return 0;
+   }
+   thread_local ArrayList<float> projected;
+   thread_local ArrayList<Probe> nearby;
+   thread_local ArrayList<int> found;
+   projected.resize(projections);
+   project(query, projected.rawData(), 0.0f);
+   const float *p { projected.rawData() };
+
+   found.clear();
+   auto collect { [&](int t, uint64_t key) {
+      auto bucket { buckets[t].find(key) };
+      if (bucket != buckets[t].end())
+      {
+         const ArrayList<int> &slots { bucket->second };
+         for (int i {}; i < slots.size(); i++)
+         {
+            found.add(slots[i]);
+         }
+      }
+   } };
+   for (int t {}; t < tables; t++)
+   {
+      collect(t, tableKey(t, p, -1, 0));
+      if (probes <= 0)
+      {
+         continue;
+      }
+      // a SimHash bit is close to flipping when its projection is near zero; a p-stable hash is close to its
+      // neighbour on either side by how far into its bucket the query falls
+      nearby.clear();
+      const float *h { p + t * bits };
+      for (int i {}; i < bits; i++)
+      {
+         if (signHashes())
+         {
+            nearby.add(Probe { std::fabs(h[i]), i, 0 });
+            continue;
+         }
+         double scaled { (h[i] + offsets[t * bits + i]) / width };
+         float into { static_cast<float>(scaled - std::floor(scaled)) };
+         nearby.add(Probe { into, i, -1 });
+         nearby.add(Probe { 1 - into, i, 1 });
+      }
+      int take { std::min(probes, nearby.size()) };
+      std::partial_sort(nearby.rawData(), nearby.rawData() + take, nearby.rawData() + nearby.size(),
+                        [](const Probe &a, const Probe &b) { return a.cost < b.cost; });
+      for (int i {}; i < take; i++)
+      {
+         collect(t, tableKey(t, p, nearby[i].hash, nearby[i].step));
+      }
+   }
+   if (found.empty())
+   {
+      return 0;
+   }
+   found.sort();
+   int unique { static_cast<int>(std::unique(found.rawData(), found.rawData() + found.size()) - found.rawData()) };
+
+   // Hamming filter: a counting sort by signature distance, of which only the first limit places are written
+   uint64_t signature[SIGNATURE_WORDS] {};
+   const float *signPlanes { p + tables * bits };
+   for (int w {}; w < SIGNATURE_WORDS; w++)
+   {
+      for (int i {}; i < 64; i++)
+      {
+         signature[w] |= static_cast<uint64_t>(signPlanes[w * 64 + i] >= 0) << i;
+      }
+   }
+   auto distance { [&](int slot) {
+      int d {};
+      for (int w {}; w < SIGNATURE_WORDS; w++)
+      {
+         d += __builtin_popcountll(signature[w] ^ signatures[slot * SIGNATURE_WORDS + w]);
+      }
+      return d;
+   } };
+   int start[SIGNATURE_WORDS * 64 + 2] {};
+   for (int i {}; i < unique; i++)
+   {
+      start[distance(found[i]) + 1]++;
+   }
+   for (int d {}; d <= SIGNATURE_WORDS * 64; d++)
+   {
+      start[d + 1] += start[d];
+   }
+   for (int i {}; i < unique; i++)
+   {
+      int at { start[distance(found[i])]++ };
+      if (at < limit)
+      {
+         keys[at] = slotKeys[found[i]];
+      }
+   }
+   return std::min(unique, limit);
+}
+
+int64_t LshIndex::bytes() const noexcept
+{
+   int64_t total { static_cast<int64_t>(dimension + 1) * projections * static_cast<int64_t>(sizeof(float)) };
+   total += (slotKeys.getCapacity() + freeSlots.getCapacity()) * static_cast<int64_t>(sizeof(int));
+   total += (bucketKeys.getCapacity() + signatures.getCapacity()) * static_cast<int64_t>(sizeof(uint64_t));
+   for (int t {}; t < tables; t++)
+   {
+      for (const auto &bucket : buckets[t])
+      {
+         total += sizeof(bucket) + sizeof(void *) + bucket.second.getCapacity() * static_cast<int64_t>(sizeof(int));
+      }
+   }
+   return total + slotOf.size() * static_cast<int64_t>(sizeof(std::pair<const int, int>) + sizeof(void *));
+}
+
+// ----------------- LatencyHistogram Implementation -----------------
+
+LatencyHistogram::LatencyHistogram() noexcept { reset(); }
+
+int LatencyHistogram::bucketOf(uint64_t ns) noexcept
+{
+   if (ns < LINEAR)
+   {
+      return static_cast<int>(ns);
+   }
+   int msb { 63 - __builtin_clzll(ns) };
+   int shift { msb - SUB_BITS };
+   return LINEAR + (shift - 1) * SUB + static_cast<int>((ns >> shift) - SUB);
+}
+
+uint64_t LatencyHistogram::lowerBound(int bucket) noexcept
+{
+   if (bucket < LINEAR)
+   {
+      return static_cast<uint64_t>(bucket);
+   }
+   int shift { (bucket - LINEAR) / SUB + 1 };
+   uint64_t sub { static_cast<uint64_t>((bucket - LINEAR) % SUB + SUB) };
+   return sub << shift;
+}
+
+void LatencyHistogram::record(uint64_t ns) noexcept
+{
+   counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+   total.fetch_add(1, std::memory_order_relaxed);
+   sum.fetch_add(ns, std::memory_order_relaxed);
+
+   uint64_t seen { minimum.load(std::memory_order_relaxed) };
+   while (ns < seen && !minimum.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+   {
+   }
+   seen = maximum.load(std::memory_order_relaxed);
+   while (ns > seen && !maximum.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+   {
+   }
+}
+
+void LatencyHistogram::reset() noexcept
+{
+   for (std::atomic<uint64_t> &c : counts)
+   {
+      c.store(0, std::memory_order_relaxed);
+   }
+   total.store(0, std::memory_order_relaxed);
+   sum.store(0, std::memory_order_relaxed);
+   minimum.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+   maximum.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::minNs() const noexcept { return count() == 0 ? 0 : minimum.load(std::memory_order_relaxed); }
+
+double LatencyHistogram::meanNs() const noexcept
+{
+   uint64_t n { count() };
+   return n == 0 ? 0 : static_cast<double>(sumNs()) / n;
+}
+
+// reports the highest value that falls in the percentile's bucket, never above the recorded max
+uint64_t LatencyHistogram::percentileNs(double p) const noexcept
+{
+   uint64_t n { count() };
+   if (n == 0)
+   {
+      return 0;
+   }
+   p = std::min(1.0, std::max(0.0, p));
+   uint64_t rank { std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * n))) };
+
+   uint64_t seen {};
+   for (int b {}; b < BUCKETS; b++)
+   {
+      seen += counts[b].load(std::memory_order_relaxed);
+      if (seen >= rank)
+      {
+         uint64_t highest { b + 1 < BUCKETS ? lowerBound(b + 1) - 1 : std::numeric_limits<uint64_t>::max() };
+         return std::max(minNs(), std::min(highest, maxNs()));
+      }
+   }
+   return maxNs();
+}
+
+// ----------------- VectorStoreMetrics Implementation -----------------
+
+VectorStoreMetrics::VectorStoreMetrics() noexcept : latency {}, queries {}, vectorsScanned {}, distancesComputed {} {}
+
+const char *VectorStoreMetrics::stageName(Stage stage) noexcept
+{
+   switch (stage)
+   {
+   case AddText:
+      return "add_text";
+   case Preprocessing:
+      return "preprocessing";
+   case Embedding:
+      return "embedding";
+   case FindNearest:
+      return "find_nearest";
+   case TopKNearest:
+      return "top_k_nearest";
+   default:
+      return "unknown";
+   }
+}
+
+void VectorStoreMetrics::reset() noexcept
+{
+   for (LatencyHistogram &h : latency)
+   {
+      h.reset();
+   }
+   queries.store(0, std::memory_order_relaxed);
+   vectorsScanned.store(0, std::memory_order_relaxed);
+   distancesComputed.store(0, std::memory_order_relaxed);
+}
+
+namespace
+{
+const double quantiles[] { 0.5, 0.9, 0.99, 0.999 };
+}
+
+string VectorStoreMetrics::toPrometheus() const
+{
+   std::ostringstream os;
+   os << "# HELP vectorstore_latency_seconds Latency of VectorStore operations.\n";
+   os << "# TYPE vectorstore_latency_seconds summary\n";
+   for (int s {}; s < StageCount; s++)
+   {
+      const LatencyHistogram &h { latency[s] };
+      const char *name { stageName(static_cast<Stage>(s)) };
+      for (double q : quantiles)
+      {
+         os << "vectorstore_latency_seconds{op=\"" << name << "\",quantile=\"" << q << "\"} "
+            << h.percentileNs(q) * 1e-9 << '\n';
+      }
+      os << "vectorstore_latency_seconds_sum{op=\"" << name << "\"} " << h.sumNs() * 1e-9 << '\n';
+      os << "vectorstore_latency_seconds_count{op=\"" << name << "\"} " << h.count() << '\n';
+   }
+
+   auto counter { [&os](const char *name, const char *help, const std::atomic<uint64_t> &value) {
+      os << "# HELP " << name << ' ' << help << '\n';
+      os << "# TYPE " << name << " counter\n";
+      os << name << ' ' << value.load(std::memory_order_relaxed) << '\n';
+   } };
+   counter("vectorstore_queries_total", "findNearest and topKNearest calls.", queries);
+   counter("vectorstore_vectors_scanned_total", "Stored vectors visited by queries.", vectorsScanned);
+   counter("vectorstore_distances_computed_total", "Metric evaluations done by queries.", distancesComputed);
+   return os.str();
+}
+
+string VectorStoreMetrics::toJson() const
+{
+   std::ostringstream os;
+   os << "{\"latency_ns\":{";
+   for (int s {}; s < StageCount; s++)
+   {
+      const LatencyHistogram &h { latency[s] };
+      os << (s ? "," : "") << '"' << stageName(static_cast<Stage>(s)) << "\":{";
+      os << "\"count\":" << h.count() << ",\"sum\":" << h.sumNs() << ",\"min\":" << h.minNs()
+         << ",\"max\":" << h.maxNs() << ",\"mean\":" << h.meanNs();
+      os << ",\"p50\":" << h.percentileNs(0.5) << ",\"p90\":" << h.percentileNs(0.9)
+         << ",\"p99\":" << h.percentileNs(0.99) << ",\"p999\":" << h.percentileNs(0.999) << '}';
+   }
+   os << "},\"counters\":{";
+   os << "\"queries\":" << queries.load(std::memory_order_relaxed);
+   os << ",\"vectors_scanned\":" << vectorsScanned.load(std::memory_order_relaxed);
+   os << ",\"distances_computed\":" << distancesComputed.load(std::memory_order_relaxed);
+   os << "}}";
+   return os.str();
+}
+
+// ----------------- QueryExecutor Implementation -----------------
+
+QueryExecutor::QueryExecutor(int threads, int queueCapacity)
+    : lock {}, ready {}, queue { std::max(queueCapacity, 1) }, queueCapacity { std::max(queueCapacity, 1) },
+      nextSequence {}, stopping {}, workers {}, workerCount {}
+{
+   if (threads <= 0)
+   {
+      threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+   }
+   workers = new std::thread[threads];
+   for (; workerCount < threads; workerCount++)
+   {
+      workers[workerCount] = std::thread { &QueryExecutor::work, this };
+   }
+}
+
+// lets the workers drain whatever is already queued before joining them
+QueryExecutor::~QueryExecutor()
+{
+   {
+      std::lock_guard<std::mutex> guard { lock };
+      stopping = true;
+   }
+   ready.notify_all();
+   for (int i {}; i < workerCount; i++)
+   {
+      workers[i].join();
+   }
+   delete[] workers;
+}
+
+bool QueryExecutor::submit(Task task, int priority, Clock::time_point deadline)
+{
+   {
+      std::lock_guard<std::mutex> guard { lock };
+      if (stopping || queue.size() >= queueCapacity)
+      {
+         return false;
+      }
+      queue.push(Entry { priority, nextSequence++, deadline, std::move(task) });
+   }
+   ready.notify_one();
+   return true;
+}
+
+int QueryExecutor::pending()
+{
+   std::lock_guard<std::mutex> guard { lock };
+   return queue.size();
+}
+
+void QueryExecutor::work()
+{
+   while (true)
+   {
+      Entry entry {};
+      {
+         std::unique_lock<std::mutex> guard { lock };
+         ready.wait(guard, [this] { return stopping || !queue.empty(); });
+         if (queue.empty())
+         {
+            return;
+         }
+         entry = queue.pop();
+      }
+      // tasks report their own failures, an escaping exception would take the whole process down
+      try
+      {
+         entry.task(Clock::now() > entry.deadline);
+      }
+      catch (...)
+      {
+      }
+   }
+}
+
+// ----------------- VectorStore Implementation -----------------
+
+namespace
+{
+enum class Metric
+{
+   Cosine,
+   Euclidean,
+   Manhattan,
+   Dot,
+   Hamming,
+   Chebyshev
+};
+
+Metric parseMetric(const string &metric)
+{
+   if (metric == "cosine")
+   {
+      return Metric::Cosine;
+   }
+   if (metric == "euclidean")
+   {
+      return Metric::Euclidean;
+   }
+   if (metric == "manhattan")
+   {
+      return Metric::Manhattan;
+   }
+   if (metric == "dot")
+   {
+      return Metric::Dot;
+   }
+   if (metric == "hamming")
+   {
+      return Metric::Hamming;
+   }
+   if (metric == "chebyshev")
+   {
+      return Metric::Chebyshev;
+   }
+   throw invalid_metric();
+}
+
+// similarities rank highest first, distances lowest first
+inline bool higherWins(Metric metric) noexcept { return metric == Metric::Cosine || metric == Metric::Dot; }
+
+// Distance kernels. Eight independent double accumulators let the compiler vectorize without reassociating a
+// single sum. Dim > 0 fixes the trip count at compile time so the loop unrolls completely; Dim == 0 reads the
+// width at runtime and handles a tail
+constexpr int LANES { 8 };
+
+template <int Dim> struct Kernels
+{
+   static_assert(Dim % LANES == 0, "fixed widths must be a multiple of the lane count");
+
+   static double reduce(const double (&acc)[LANES]) noexcept
+   {
+      return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+   }
+
+   static double dot(const float *__restrict a, const float *__restrict b, int n) noexcept
+   {
+      const int len { Dim > 0 ? Dim : n };
+      double acc[LANES] {};
+      int i {};
+      for (; i + LANES <= len; i += LANES)
+      {
+         for (int l {}; l < LANES; l++)
+         {
+            acc[l] += static_cast<double>(a[i + l]) * b[i + l];
+         }
+      }
+      for (; i < len; i++)
+      {
+         acc[0] += static_cast<double>(a[i]) * b[i];
+      }
+      return reduce(acc);
+   }
+
+   static double l1(const float *__restrict a, const float *__restrict b, int n) noexcept
+   {
+      const int len { Dim > 0 ? Dim : n };
+      double acc[LANES] {};
+      int i {};
+      for (; i + LANES <= len; i += LANES)
+      {
+         for (int l {}; l < LANES; l++)
+         {
+            acc[l] += std::fabs(static_cast<double>(a[i + l]) - b[i + l]);
+         }
+      }
+      for (; i < len; i++)
+      {
+         acc[0] += std::fabs(static_cast<double>(a[i]) - b[i]);
+      }
+      return reduce(acc);
+   }
+
+   // squared, the ranking is the same and the sqrt is only paid for reported scores
+   static double l2sq(const float *__restrict a, const float *__restrict b, int n) noexcept
+   {
+      const int len { Dim > 0 ? Dim : n };
+      double acc[LANES] {};
+      int i {};
+      for (; i + LANES <= len; i += LANES)
+      {
+         for (int l {}; l < LANES; l++)
+         {
+            double d { static_cast<double>(a[i + l]) - b[i + l] };
+            acc[l] += d * d;
+         }
+      }
+      for (; i < len; i++)
+      {
+         double d { static_cast<double>(a[i]) - b[i] };
+         acc[0] += d * d;
+      }
+      return reduce(acc);
+   }
+
+   // L-infinity, the lanes keep running maxima instead of sums
+   static double linf(const float *__restrict a, const float *__restrict b, int n) noexcept
+   {
+      const int len { Dim > 0 ? Dim : n };
+      float acc[LANES] {};
+      int i {};
+      for (; i + LANES <= len; i += LANES)
+      {
+         for (int l {}; l < LANES; l++)
+         {
+            float d { std::fabs(a[i + l] - b[i + l]) };
+            acc[l] = acc[l] > d ? acc[l] : d;
+         }
+      }
+      for (; i < len; i++)
+      {
+         acc[0] = std::max(acc[0], std::fabs(a[i] - b[i]));
+      }
+      return std::max(std::max(std::max(acc[0], acc[1]), std::max(acc[2], acc[3])),
+                      std::max(std::max(acc[4], acc[5]), std::max(acc[6], acc[7])));
+   }
+};
+
+using Generic = Kernels<0>;
+
+double cosine(const float *a, const float *b, int n) noexcept
+{
+   double normA { std::sqrt(Generic::dot(a, a, n)) };
+   double normB { std::sqrt(Generic::dot(b, b, n)) };
+   if (normA == 0 || normB == 0)
+   {
+      return 0;
+   }
+   return Generic::dot(a, b, n) / (normA * normB);
+}
+
+double l1(const float *a, const float *b, int n) noexcept { return Generic::l1(a, b, n); }
+
+double l2(const float *a, const float *b, int n) noexcept { return std::sqrt(Generic::l2sq(a, b, n)); }
+
+double dot(const float *a, const float *b, int n) noexcept { return Generic::dot(a, b, n); }
+
+double linf(const float *a, const float *b, int n) noexcept { return Generic::linf(a, b, n); }
+
+// Hamming works on sign bits: bit i of a code is set when component i is positive, 64 components a word
+int codeWords(int n) noexcept { return (n + 63) / 64; }
+
+void binarize(const float *v, int n, uint64_t *code) noexcept
+{
+   for (int w {}; w < codeWords(n); w++)
+   {
+      int first { w * 64 };
+      int last { std::min(n, first + 64) };
+      uint64_t word {};
+      for (int i { first }; i < last; i++)
+      {
+         word |= static_cast<uint64_t>(v[i] > 0) << (i - first);
+      }
+      code[w] = word;
+   }
+}
+
+int hammingCodes(const uint64_t *a, const uint64_t *b, int words) noexcept
+{
+   int d {};
+   for (int w {}; w < words; w++)
+   {
+      d += __builtin_popcountll(a[w] ^ b[w]);
+   }
+   return d;
+}
+
+double hamming(const float *a, const float *b, int n) noexcept
+{
+   int d {};
+   for (int i {}; i < n; i++)
+   {
+      d += (a[i] > 0) != (b[i] > 0);
+   }
+   return d;
+}
+
+// Rows as the scan sees them: count rows of stride floats, zero padded past the dimension, plus cached norms and
+// sign codes
+struct RowView
+{
+   const float *rows;
+   const double *norms;
+   const uint64_t *codes;
+   int stride;
+   int words; // per code
+   int count;
+};
+
+// Pushes every row into best, returns how many the heap admitted. Euclidean is ranked by squared distance;
+// Hamming compares qCode with the row codes and never touches the floats
+template <int Dim, typename TopK>
+int scanRows(Metric metric, const float *q, double qNorm, const uint64_t *qCode, const RowView &view, TopK &best)
+{
+   using K = Kernels<Dim>;
+   int kept {};
+   const float *row { view.rows };
+   switch (metric)
+   {
+   case Metric::Cosine:
+      for (int i {}; i < view.count; i++, row += view.stride)
+      {
+         double denom { qNorm * view.norms[i] };
+         kept += best.push(denom == 0 ? 0.0 : K::dot(q, row, view.stride) / denom, i);
+      }
+      break;
+   case Metric::Euclidean:
+      for (int i {}; i < view.count; i++, row += view.stride)
+      {
+         kept += best.push(K::l2sq(q, row, view.stride), i);
+      }
+      break;
+   case Metric::Dot:
+      for (int i {}; i < view.count; i++, row += view.stride)
+      {
+         kept += best.push(K::dot(q, row, view.stride), i);
+      }
+      break;
+   case Metric::Chebyshev:
+      for (int i {}; i < view.count; i++, row += view.stride)
+      {
+         kept += best.push(K::linf(q, row, view.stride), i);
+      }
+      break;
+   case Metric::Hamming:
+   {
+      const uint64_t *code { view.codes };
+      for (int i {}; i < view.count; i++, code += view.words)
+      {
+         kept += best.push(hammingCodes(qCode, code, view.words), i);
+      }
+      break;
+   }
+   default:
+      for (int i {}; i < view.count; i++, row += view.stride)
+      {
+         kept += best.push(K::l1(q, row, view.stride), i);
+      }
+      break;
+   }
+   return kept;
+}
+
+// common embedding widths get an unrolled kernel, anything else runs the generic one
+constexpr int FIXED_DIMS[] { 128, 256, 384, 512, 768, 1024 };
+
+template <typename TopK>
+int scanAll(Metric metric, const float *q, double qNorm, const uint64_t *qCode, const RowView &view, TopK &best)
+{
+   switch (view.stride)
+   {
+   case 128:
+      return scanRows<128>(metric, q, qNorm, qCode, view, best);
+   case 256:
+      return scanRows<256>(metric, q, qNorm, qCode, view, best);
+   case 384:
+      return scanRows<384>(metric, q, qNorm, qCode, view, best);
+   case 512:
+      return scanRows<512>(metric, q, qNorm, qCode, view, best);
+   case 768:
+      return scanRows<768>(metric, q, qNorm, qCode, view, best);
+   case 1024:
+      return scanRows<1024>(metric, q, qNorm, qCode, view, best);
+   default:
+      return scanRows<0>(metric, q, qNorm, qCode, view, best);
+   }
+}
+
+// Every pair among n rows through pair(i, j), in TILE x TILE tiles so both sets of rows stay in cache while the
+// tile is scored. Only j >= i is visited
+template <typename Pair> void tiles(int n, Pair pair)
+{
+   constexpr int TILE { 16 };
+   for (int bi {}; bi < n; bi += TILE)
+   {
+      for (int bj { bi }; bj < n; bj += TILE)
+      {
+         for (int i { bi }; i < std::min(bi + TILE, n); i++)
+         {
+            for (int j { std::max(bj, i) }; j < std::min(bj + TILE, n); j++)
+            {
+               pair(i, j);
+            }
+         }
+      }
+   }
+}
+
+// The view.count x view.count scores among the rows into out, row-major and symmetric. Scores are what a query
+// would report: the similarity for cosine and dot, the distance otherwise
+template <int Dim> void pairRows(Metric metric, const RowView &view, double *out)
+{
+   using K = Kernels<Dim>;
+   const int n { view.count };
+   auto fill { [&](auto score) {
+      tiles(n, [&](int i, int j) {
+         out[static_cast<size_t>(i) * n + j] = out[static_cast<size_t>(j) * n + i] = score(i, j);
+      });
+   } };
+   auto row { [&](int i) { return view.rows + static_cast<size_t>(i) * view.stride; } };
+   switch (metric)
+   {
+   case Metric::Cosine:
+      fill([&](int i, int j) {
+         double denom { view.norms[i] * view.norms[j] };
+         return denom == 0 ? 0.0 : K::dot(row(i), row(j), view.stride) / denom;
+      });
+      break;
+   case Metric::Dot:
+      fill([&](int i, int j) { return K::dot(row(i), row(j), view.stride); });
+      break;
+   case Metric::Euclidean:
+      fill([&](int i, int j) { return std::sqrt(K::l2sq(row(i), row(j), view.stride)); });
+      break;
+   case Metric::Manhattan:
+      fill([&](int i, int j) { return K::l1(row(i), row(j), view.stride); });
+      break;
+   case Metric::Chebyshev:
+      fill([&](int i, int j) { return K::linf(row(i), row(j), view.stride); });
+      break;
+   case Metric::Hamming:
+      fill([&](int i, int j) {
+         return static_cast<double>(hammingCodes(view.codes + static_cast<size_t>(i) * view.words,
+                                                 view.codes + static_cast<size_t>(j) * view.words, view.words));
+      });
+      break;
+   }
+}
+
+void pairAll(Metric metric, const RowView &view, double *out)
+{
+   switch (view.stride)
+   {
+   case 128:
+      return pairRows<128>(metric, view, out);
+   case 256:
+      return pairRows<256>(metric, view, out);
+   case 384:
+      return pairRows<384>(metric, view, out);
+   case 512:
+      return pairRows<512>(metric, view, out);
+   case 768:
+      return pairRows<768>(metric, view, out);
+   case 1024:
+      return pairRows<1024>(metric, view, out);
+   default:
+      return pairRows<0>(metric, view, out);
+   }
+}
+
+bool fixedKernel(int stride) noexcept
+{
+   for (int d : FIXED_DIMS)
+   {
+      if (d == stride)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+// rows start 64-byte aligned, so the stride is rounded up to 16 floats
+int rowStride(int dimension) noexcept { return (std::max(dimension, 1) + 15) / 16 * 16; }
+
+float *allocateRows(int rows, int stride)
+{
+   return static_cast<float *>(
+       ::operator new(static_cast<size_t>(std::max(rows, 1)) * stride * sizeof(float), std::align_val_t { 64 }));
+}
+
+void freeRows(float *p) noexcept { ::operator delete(p, std::align_val_t { 64 }); }
+
+using RowsPtr = std::unique_ptr<float, decltype(&freeRows)>;
+
+// Times a scope into one of the metrics histograms. The disabled version is empty, so it costs nothing
+template <bool Enabled> class StageTimer
+{
+ private:
+   LatencyHistogram *histogram;
+   std::chrono::steady_clock::time_point start;
+
+ public:
+   StageTimer(VectorStoreMetrics *metrics, VectorStoreMetrics::Stage stage) noexcept
+       : histogram { metrics ? &metrics->latency[stage] : nullptr }, start { std::chrono::steady_clock::now() }
+   {
+   }
+
+   StageTimer(const StageTimer &) = delete;
+   StageTimer &operator=(const StageTimer &) = delete;
+
+   ~StageTimer()
+   {
+      if (histogram)
+      {
+         auto ns { std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start) };
+         histogram->record(static_cast<uint64_t>(ns.count()));
+      }
+   }
+};
+
+template <> class StageTimer<false>
+{
+ public:
+   constexpr StageTimer(VectorStoreMetrics *, VectorStoreMetrics::Stage) noexcept {}
+};
+
+using ScopedTimer = StageTimer<vectorStoreMetrics>;
+
+inline void countQuery(VectorStoreMetrics *metrics, int scanned, int distances) noexcept
+{
+   if constexpr (vectorStoreMetrics)
+   {
+      metrics->queries.fetch_add(1, std::memory_order_relaxed);
+      metrics->vectorsScanned.fetch_add(scanned, std::memory_order_relaxed);
+      metrics->distancesComputed.fetch_add(distances, std::memory_order_relaxed);
+   }
+}
+
+const char *metricName(Metric metric) noexcept
+{
+   switch (metric)
+   {
+   case Metric::Cosine:
+      return "cosine";
+   case Metric::Euclidean:
+      return "euclidean";
+   case Metric::Dot:
+      return "dot";
+   case Metric::Hamming:
+      return "hamming";
+   case Metric::Chebyshev:
+      return "chebyshev";
+   default:
+      return "manhattan";
+   }
+}
+
+// the kernels are plain loops, so this is whatever the compiler was allowed to vectorize them with
+constexpr const char *simdLevel() noexcept
+{
+#if defined(__AVX512F__)
+   return "avx512";
+#elif defined(__AVX2__)
+   return "avx2";
+#elif defined(__AVX__)
+   return "avx";
+#elif defined(__SSE2__)
+   return "sse2";
+#elif defined(__ARM_NEON)
+   return "neon";
+#else
+   return "scalar";
+#endif
+}
+
+uint64_t elapsedNs(std::chrono::steady_clock::time_point since) noexcept
+{
+   return static_cast<uint64_t>(
+       std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count());
+}
+
+// flattens a list into buf, throwing when its length is not n
+void flatten(const SinglyLinkedList<float> &v, ArrayList<float> &buf, int n)
+{
+   if (v.size() != n)
+   {
+      throw std::invalid_argument("Vector dimensions do not match!");
+   }
+   buf.resize(n);
+   v.copyTo(buf.rawData(), n);
+}
+
+// both lists flattened, for the public pairwise metric helpers
+template <typename Fn> double pairwise(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2, Fn fn)
+{
+   ArrayList<float> a(v1.size());
+   ArrayList<float> b(v2.size());
+   flatten(v1, a, v1.size());
+   flatten(v2, b, v1.size());
+   return fn(a.rawData(), b.rawData(), v1.size());
+}
+} // namespace
+
+VectorStore::VectorRecord::VectorRecord(int id, string rawText, SinglyLinkedList<float> *vector)
+    : id { id }, rawText { std::move(rawText) }, rawLength { static_cast<int>(this->rawText.size()) }, vector { vector },
+      text { -1, 0, 0 }
+{
+}
+
+VectorStore::QueryTrace::QueryTrace()
+    : path {}, metric {}, simd {}, threads {}, k {}, prepareNs {}, scanNs {}, selectNs {}, totalNs {},
+      candidatesConsidered {}, candidatesPruned {}, threshold {}
+{
+}
+
+string VectorStore::QueryTrace::toString() const
+{
+   std::ostringstream os;
+   os << "TopK(k=" << k << ", metric=" << metric << ")  " << totalNs / 1000.0 << " us\n";
+   os << "  -> " << path << " scan  simd=" << simd << " threads=" << threads << '\n';
+   os << "     prepare " << prepareNs / 1000.0 << " us, scan " << scanNs / 1000.0 << " us, select "
+      << selectNs / 1000.0 << " us\n";
+   os << "     candidates " << candidatesConsidered << ", pruned " << candidatesPruned << ", admitted "
+      << candidatesConsidered - candidatesPruned << ", final threshold " << threshold << '\n';
+   return os.str();
+}
+
+string VectorStore::QueryTrace::toJson() const
+{
+   std::ostringstream os;
+   os << "{\"path\":\"" << path << "\",\"metric\":\"" << metric << "\",\"simd\":\"" << simd
+      << "\",\"threads\":" << threads << ",\"k\":" << k;
+   os << ",\"stages_ns\":{\"prepare\":" << prepareNs << ",\"scan\":" << scanNs << ",\"select\":" << selectNs
+      << ",\"total\":" << totalNs << '}';
+   os << ",\"candidates_considered\":" << candidatesConsidered << ",\"candidates_pruned\":" << candidatesPruned
+      << ",\"threshold\":" << threshold << '}';
+   return os.str();
+}
+
+VectorStore::VectorStore(int dimension, EmbedFn embeddingFunction)
+    : records {}, dimension { dimension }, count {}, embeddingFunction { embeddingFunction }, nextId {},
+      normalizeText {}, texts {}, lexical {}, lsh {}, lshOptions {}, stats {}, compactStep { CompactStep::Lists },
+      compactCursor {}, compactLastId { -1 }, shrinking {}, rebuiltLexical {}, rows { nullptr }, norms { nullptr },
+      codes { nullptr }, stride { rowStride(dimension) }, rowCapacity {}, pinnedIds {}, storeLock {},
+      executorLock {}, executor {}
+{
+   if constexpr (vectorStoreMetrics)
+   {
+      stats = std::make_unique<VectorStoreMetrics>();
+   }
+   ensureRows(16);
+}
+
+VectorStore::~VectorStore()
+{
+   // queued async queries still point at this store
+   executor.reset();
+   clear();
+   freeRows(rows);
+   freeCoords(norms);
+   delete[] codes;
+}
+
+VectorStore::RowCopy::RowCopy(int capacity, int stride, int words)
+    : rows { nullptr }, norms { nullptr }, codes { nullptr }, capacity { capacity }, copied {}
+{
+   RowsPtr newRows { allocateRows(capacity, stride), freeRows };
+   CoordsPtr newNorms { allocateCoords(capacity), freeCoords };
+   codes = new uint64_t[static_cast<size_t>(capacity) * words];
+   rows = newRows.release();
+   norms = newNorms.release();
+}
+
+VectorStore::RowCopy::~RowCopy()
+{
+   freeRows(rows);
+   freeCoords(norms);
+   delete[] codes;
+}
+
+void VectorStore::ensureRows(int cap)
+{
+   if (shrinking && cap > shrinking->capacity)
+   {
+      // the store outgrew the arrays compact was copying into, its rows step starts over
+      shrinking.reset();
+   }
+   if (cap <= rowCapacity)
+   {
+      return;
+   }
+   reallocateRows(std::max(cap, rowCapacity * 2));
+}
+
+// moves the packed rows, norms and codes into arrays for newCapacity rows, which must hold count
+void VectorStore::reallocateRows(int newCapacity)
+{
+   int words { codeWords(dimension) };
+   // a throw on a later allocation frees the earlier ones and leaves the store as it was
+   RowsPtr newRows { allocateRows(newCapacity, stride), freeRows };
+   CoordsPtr newNorms { allocateCoords(newCapacity), freeCoords };
+   std::unique_ptr<uint64_t[]> newCodes { new uint64_t[static_cast<size_t>(newCapacity) * words] };
+   if (rows)
+   {
+      std::memcpy(newRows.get(), rows, static_cast<size_t>(count) * stride * sizeof(float));
+      std::memcpy(newNorms.get(), norms, count * sizeof(double));
+      std::memcpy(newCodes.get(), codes, static_cast<size_t>(count) * words * sizeof(uint64_t));
+   }
+   freeRows(rows);
+   freeCoords(norms);
+   delete[] codes;
+   rows = newRows.release();
+   norms = newNorms.release();
+   codes = newCodes.release();
+   rowCapacity = newCapacity;
+}
+
+// copies the record's list into its row and refreshes the norm and the sign code
+void VectorStore::packRow(int index) const
+{
+   float *row { rows + static_cast<size_t>(index) * stride };
+   int n { records[index]->vector->copyTo(row, dimension) };
+   std::fill(row + n, row + stride, 0.0f);
+   norms[index] = std::sqrt(Generic::dot(row, row, stride));
+   binarize(row, dimension, codes + static_cast<size_t>(index) * codeWords(dimension));
+   mirrorRow(index);
+   if (lsh)
+   {
+      if (lsh->hashFamily() == LshIndex::Mips && norms[index] > lsh->maxNorm())
+      {
+         // every stored vector's appended component depends on the bound; headroom keeps these rehashes rare
+         lsh->setMaxNorm(norms[index] * 1.25);
+         for (int i {}; i < count; i++)
+         {
+            lsh->add(records[i]->id, rows + static_cast<size_t>(i) * stride);
+         }
+      }
+      lsh->add(records[index]->id, row);
+   }
+}
+
+// the reverse of packRow, after a visitor edited the row in place
+void VectorStore::writeBack(int index)
+{
+   float *row { rows + static_cast<size_t>(index) * stride };
+   records[index]->vector->copyFrom(row, dimension);
+   norms[index] = std::sqrt(Generic::dot(row, row, stride));
+   binarize(row, dimension, codes + static_cast<size_t>(index) * codeWords(dimension));
+   mirrorRow(index);
+}
+
+// a row compact already copied is copied again after every change
+void VectorStore::mirrorRow(int index) const
+{
+   if (!shrinking || index >= shrinking->copied)
+   {
+      return;
+   }
+   int words { codeWords(dimension) };
+   std::memcpy(shrinking->rows + static_cast<size_t>(index) * stride, rows + static_cast<size_t>(index) * stride,
+               stride * sizeof(float));
+   shrinking->norms[index] = norms[index];
+   std::memcpy(shrinking->codes + static_cast<size_t>(index) * words, codes + static_cast<size_t>(index) * words,
+               words * sizeof(uint64_t));
+}
+
+// Lists handed out by getVector may have been written since the last scan, so their rows are re-packed before
+// every one until commitVector, removeAt or updateText ends the hand-out. The list is checked under the lock so a
+// getVector between the check and the scan is not missed, and the repack runs exclusively. shared_mutex cannot
+// downgrade: a list written between the repack and the shared lock is a write during a query, which getVector
+// rules out
+std::shared_lock<std::shared_mutex> VectorStore::scanLock() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   if (!pinnedIds.empty())
+   {
+      guard.unlock();
+      {
+         std::unique_lock<std::shared_mutex> exclusive { storeLock };
+         repackPinned();
+      }
+      guard.lock();
+   }
+   return guard;
+}
+
+// caller holds the lock exclusively
+void VectorStore::repackPinned() const
+{
+   for (int i {}; i < pinnedIds.size(); i++)
+   {
+      packRow(positionOf(pinnedIds[i]));
+   }
+}
+
+// caller holds the lock exclusively
+void VectorStore::unpin(int id)
+{
+   int at { pinnedIds.indexOf(id) };
+   if (at >= 0)
+   {
+      pinnedIds[at] = pinnedIds[pinnedIds.size() - 1];
+      pinnedIds.removeAt(pinnedIds.size() - 1);
+   }
+}
+
+// caller holds the lock exclusively. After rows were edited in place every vector may have moved buckets
+void VectorStore::rehashRows() const
+{
+   if (!lsh)
+   {
+      return;
+   }
+   if (lsh->hashFamily() == LshIndex::Mips)
+   {
+      double largest {};
+      for (int i {}; i < count; i++)
+      {
+         largest = std::max(largest, norms[i]);
+      }
+      lsh->setMaxNorm(largest);
+   }
+   for (int i {}; i < count; i++)
+   {
+      lsh->add(records[i]->id, rows + static_cast<size_t>(i) * stride);
+   }
+}
+
+int VectorStore::size() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return count;
+}
+
+bool VectorStore::empty() const { return size() == 0; }
+
+void VectorStore::clear()
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   for (int i {}; i < records.size(); i++)
+   {
+      delete records[i]->vector;
+      delete records[i];
+   }
+   records.clear();
+   count = 0;
+   compactStep = CompactStep::Lists;
+   compactCursor = 0;
+   compactLastId = -1;
+   shrinking.reset();
+   rebuiltLexical.reset();
+   pinnedIds.clear();
+   if (texts)
+   {
+      texts->clear();
+   }
+   if (lexical)
+   {
+      lexical->clear();
+   }
+   if (lsh)
+   {
+      lsh->clear();
+   }
+}
+
+VectorStore::VectorRecord &VectorStore::recordAt(int index) const
+{
+   if (index < 0 || index >= count)
+   {
+      throw std::out_of_range("Index is invalid!");
+   }
+   return *records[index];
+}
+
+namespace
+{
+string &textScratch()
+{
+   thread_local string local;
+   return local;
+}
+} // namespace
+
+// caller holds the lock
+void VectorStore::storeText(VectorRecord &record, string text)
+{
+   if (lexical)
+   {
+      lexical->add(record.id, text);
+   }
+   if (rebuiltLexical && record.id <= compactLastId)
+   {
+      rebuiltLexical->add(record.id, text);
+   }
+   record.rawLength = static_cast<int>(text.size());
+   if (texts)
+   {
+      if (record.text.block >= 0)
+      {
+         texts->discard(record.text);
+      }
+      record.text = texts->append(text);
+      string().swap(record.rawText);
+   }
+   else
+   {
+      record.text = TextArena::Ref { -1, 0, 0 };
+      record.rawText = std::move(text);
+   }
+}
+
+// caller holds the lock. A compressed text lands in a per-thread string, valid until the next call. A cursor takes
+// the read off the arena's shared cache
+const string &VectorStore::rawTextOf(const VectorRecord &record, TextArena::Cursor *cursor) const
+{
+   if (record.text.block < 0)
+   {
+      return record.rawText;
+   }
+   thread_local string local;
+   if (cursor)
+   {
+      texts->get(record.text, local, *cursor);
+   }
+   else
+   {
+      texts->get(record.text, local);
+   }
+   return local;
+}
+
+void VectorStore::setTextCompression(bool enabled)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   if (enabled == (texts != nullptr))
+   {
+      return;
+   }
+   if (enabled)
+   {
+      texts = std::make_unique<TextArena>();
+      for (int i {}; i < count; i++)
+      {
+         records[i]->text = texts->append(records[i]->rawText);
+         string().swap(records[i]->rawText);
+      }
+      return;
+   }
+   for (int i {}; i < count; i++)
+   {
+      string text;
+      texts->get(records[i]->text, text);
+      records[i]->text = TextArena::Ref { -1, 0, 0 };
+      records[i]->rawText = std::move(text);
+   }
+   texts.reset();
+}
+
+bool VectorStore::textCompression() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return texts != nullptr;
+}
+
+void VectorStore::setLexicalIndex(bool enabled)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   if (!enabled)
+   {
+      lexical.reset();
+      rebuiltLexical.reset();
+      return;
+   }
+   if (lexical)
+   {
+      return;
+   }
+   lexical = std::make_unique<InvertedIndex>();
+   for (int i {}; i < count; i++)
+   {
+      lexical->add(records[i]->id, rawTextOf(*records[i]));
+   }
+}
+
+bool VectorStore::lexicalIndex() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return lexical != nullptr;
+}
+
+void VectorStore::setLshIndex(bool enabled, const LshOptions &options)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   if (!enabled)
+   {
+      lsh.reset();
+      return;
+   }
+   Metric m { parseMetric(options.metric) };
+   // chebyshev is searched through L2, which bounds it, and rescored exactly
+   LshIndex::Family family { LshIndex::Gaussian };
+   switch (m)
+   {
+   case Metric::Cosine:
+      family = LshIndex::SimHash;
+      break;
+   case Metric::Dot:
+      family = LshIndex::Mips;
+      break;
+   case Metric::Hamming:
+      family = LshIndex::BitSampling;
+      break;
+   case Metric::Manhattan:
+      family = LshIndex::Cauchy;
+      break;
+   default:
+      break;
+   }
+   lsh.reset();
+   repackPinned();
+   // the reduced dot angles all sit near 90 degrees, so those keys take fewer bits to collide often enough
+   bool narrow { family == LshIndex::SimHash || family == LshIndex::BitSampling };
+   int bits { options.bits > 0 ? options.bits : narrow ? 14 : 6 };
+   double width { options.width > 0 ? options.width : 1.0 }; // sign hashes have no width
+   if (options.width <= 0 && count > 0 && (family == LshIndex::Gaussian || family == LshIndex::Cauchy))
+   {
+      // Scaled from the distance between a stored vector and its 10th neighbour (the first is the row itself), so
+      // true neighbours keep colliding once `bits` hashes make up a key. Cauchy projections spread much wider than
+      // Gaussian ones for the same distance and take a wider bucket
+      const string metric { family == LshIndex::Cauchy ? "manhattan" : "euclidean" };
+      int samples { std::min(count, 32) };
+      int k { std::min(count, 11) };
+      ArrayList<int> ids;
+      ArrayList<double> scores;
+      ids.resize(k);
+      scores.resize(k);
+      double sum {};
+      for (int i {}; i < samples; i++)
+      {
+         int row { static_cast<int>(static_cast<int64_t>(i) * count / samples) };
+         nearest(rows + static_cast<size_t>(row) * stride, k, metric, ids.rawData(), scores.rawData());
+         sum += scores[k - 1];
+      }
+      width = std::max((family == LshIndex::Cauchy ? 3.0 : 1.5) * sum / samples, 1e-3);
+   }
+   lsh = std::make_unique<LshIndex>(dimension, family, options.tables, bits, width, options.seed);
+   lshOptions = options;
+   rehashRows();
+}
+
+bool VectorStore::lshIndex() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return lsh != nullptr;
+}
+
+// caller holds the lock. Ids only grow and removals keep the order, so the records stay sorted by id
+int VectorStore::positionOf(int id) const
+{
+   int lo {};
+   int hi { count };
+   while (lo < hi)
+   {
+      int mid { lo + (hi - lo) / 2 };
+      if (records[mid]->id < id)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   return lo < count && records[lo]->id == id ? lo : -1;
+}
+
+// longer vectors are cut, shorter ones zero-padded
+SinglyLinkedList<float> *VectorStore::embedText(const string &text)
+{
+   EmbedFn embed {};
+   {
+      std::shared_lock<std::shared_mutex> guard { storeLock };
+      embed = embeddingFunction;
+   }
+   if (embed == nullptr)
+   {
+      throw std::runtime_error("Embedding function is not set!");
+   }
+
+   // the embedding runs outside the lock, it is usually the slowest part of an insert
+   SinglyLinkedList<float> *vector {};
+   {
+      ScopedTimer embedTimer { stats.get(), VectorStoreMetrics::Embedding };
+      vector = embed(text);
+   }
+   if (vector == nullptr)
+   {
+      vector = new SinglyLinkedList<float>();
+   }
+   vector->resize(dimension, 0.0f);
+   return vector;
+}
+
+SinglyLinkedList<float> *VectorStore::preprocessing(std::string_view rawText)
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::Preprocessing };
+   // the embedding takes a const string&, the scratch string keeps its capacity between calls
+   string &text { textScratch() };
+   text.assign(normalizeText ? normalizer().normalize(rawText) : rawText);
+   return embedText(text);
+}
+
+void VectorStore::setTextNormalization(bool enabled) { normalizeText = enabled; }
+
+void VectorStore::addText(string rawText)
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::AddText };
+   std::unique_ptr<SinglyLinkedList<float>> vector { preprocessing(rawText) };
+   addRecord(std::move(rawText), vector.release());
+}
+
+// takes ownership of vector, which already has the store's dimension
+void VectorStore::addRecord(string rawText, SinglyLinkedList<float> *vector)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   ensureRows(count + 1);
+   records.add(new VectorRecord(nextId++, {}, vector));
+   storeText(*records[count], std::move(rawText));
+   packRow(count);
+   count++;
+}
+
+SinglyLinkedList<float> &VectorStore::getVector(int index)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   VectorRecord &record { recordAt(index) };
+   if (pinnedIds.indexOf(record.id) < 0)
+   {
+      pinnedIds.add(record.id);
+   }
+   return *record.vector;
+}
+
+void VectorStore::commitVector(int index)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   unpin(recordAt(index).id);
+   packRow(index);
+}
+
+string VectorStore::getRawText(int index) const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return rawTextOf(recordAt(index));
+}
+
+int VectorStore::getId(int index) const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   return recordAt(index).id;
+}
+
+bool VectorStore::removeAt(int index)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   VectorRecord *record { &recordAt(index) };
+   if (lexical)
+   {
+      lexical->remove(record->id);
+   }
+   if (rebuiltLexical)
+   {
+      rebuiltLexical->remove(record->id);
+   }
+   if (lsh)
+   {
+      lsh->remove(record->id);
+   }
+   if (texts && record->text.block >= 0)
+   {
+      texts->discard(record->text);
+   }
+   records.removeAt(index);
+   unpin(record->id);
+   delete record->vector;
+   delete record;
+   count--;
+
+   float *row { rows + static_cast<size_t>(index) * stride };
+   std::memmove(row, row + stride, static_cast<size_t>(count - index) * stride * sizeof(float));
+   std::memmove(norms + index, norms + index + 1, (count - index) * sizeof(double));
+   int words { codeWords(dimension) };
+   uint64_t *code { codes + static_cast<size_t>(index) * words };
+   std::memmove(code, code + words, static_cast<size_t>(count - index) * words * sizeof(uint64_t));
+   if (shrinking && index < shrinking->copied)
+   {
+      int moved { --shrinking->copied - index };
+      row = shrinking->rows + static_cast<size_t>(index) * stride;
+      std::memmove(row, row + stride, static_cast<size_t>(moved) * stride * sizeof(float));
+      std::memmove(shrinking->norms + index, shrinking->norms + index + 1, moved * sizeof(double));
+      code = shrinking->codes + static_cast<size_t>(index) * words;
+      std::memmove(code, code + words, static_cast<size_t>(moved) * words * sizeof(uint64_t));
+   }
+   return true;
+}
+
+bool VectorStore::updateText(int index, string newRawText)
+{
+   std::unique_ptr<SinglyLinkedList<float>> vector { preprocessing(newRawText) };
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   VectorRecord &record { recordAt(index) };
+   delete record.vector;
+   record.vector = vector.release();
+   unpin(record.id);
+   storeText(record, std::move(newRawText));
+   packRow(index);
+   return true;
+}
+
+void VectorStore::setEmbeddingFunction(EmbedFn newEmbeddingFunction)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   embeddingFunction = newEmbeddingFunction;
+}
+
+// the store is locked for the whole walk, action must not call back into it
+void VectorStore::forEach(void (*action)(SinglyLinkedList<float> &, int, string &))
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   TextArena::Cursor cursor;
+   for (int i {}; i < count; i++)
+   {
+      VectorRecord &record { *records[i] };
+      if (!texts && !lexical)
+      {
+         action(*record.vector, record.id, record.rawText);
+         packRow(i);
+         continue;
+      }
+      string original { rawTextOf(record, &cursor) };
+      string text { original };
+      action(*record.vector, record.id, text);
+      if (text != original)
+      {
+         storeText(record, std::move(text));
+      }
+      packRow(i);
+   }
+}
+
+double VectorStore::cosineSimilarity(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return pairwise(v1, v2, cosine);
+}
+
+double VectorStore::l1Distance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return pairwise(v1, v2, l1);
+}
+
+double VectorStore::l2Distance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return pairwise(v1, v2, l2);
+}
+
+double VectorStore::dotProduct(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return pairwise(v1, v2, dot);
+}
+
+double VectorStore::chebyshevDistance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return pairwise(v1, v2, linf);
+}
+
+int VectorStore::hammingDistance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const
+{
+   return static_cast<int>(pairwise(v1, v2, hamming));
+}
+
+namespace
+{
+// Per-thread buffers reused by every query on that thread, so steady-state queries do not allocate
+class QueryScratch
+{
+ private:
+   float *listBuffer;
+   int listCapacity;
+   float *padBuffer;
+   int padCapacity;
+
+   static float *grow(float *&buffer, int &capacity, int n)
+   {
+      if (n > capacity)
+      {
+         freeRows(buffer);
+         buffer = nullptr;
+         buffer = allocateRows(1, n);
+         capacity = n;
+      }
+      return buffer;
+   }
+
+ public:
+   algorithms::top_k<double, int, std::greater<double>> similar;
+   algorithms::top_k<double> close;
+   ArrayList<uint64_t> queryCode;
+
+   QueryScratch()
+       : listBuffer {}, listCapacity {}, padBuffer {}, padCapacity {}, similar { 0 }, close { 0 }, queryCode {}
+   {
+   }
+
+   QueryScratch(const QueryScratch &) = delete;
+   QueryScratch &operator=(const QueryScratch &) = delete;
+
+   ~QueryScratch()
+   {
+      freeRows(listBuffer);
+      freeRows(padBuffer);
+   }
+
+   float *list(int n) { return grow(listBuffer, listCapacity, n); }
+   float *padded(int n) { return grow(padBuffer, padCapacity, n); }
+
+   // the query's sign code, for hamming
+   uint64_t *code(const float *query, int n)
+   {
+      queryCode.resize(codeWords(n));
+      binarize(query, n, queryCode.rawData());
+      return queryCode.rawData();
+   }
+};
+
+QueryScratch &scratch()
+{
+   thread_local QueryScratch local;
+   return local;
+}
+
+Metric checkQuery(const string &metric, int k, int count)
+{
+   Metric m { parseMetric(metric) };
+   if (k <= 0 || k > count)
+   {
+      throw invalid_k_value();
+   }
+   return m;
+}
+} // namespace
+
+// copies a list query into this thread's scratch buffer
+const float *VectorStore::flattenQuery(const SinglyLinkedList<float> &query) const
+{
+   if (query.size() != dimension)
+   {
+      throw std::invalid_argument("Vector dimensions do not match!");
+   }
+   float *q { scratch().list(dimension) };
+   query.copyTo(q, dimension);
+   return q;
+}
+
+int VectorStore::findNearest(const SinglyLinkedList<float> &query, const string &metric) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::FindNearest };
+   parseMetric(metric);
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   if (count == 0)
+   {
+      return -1;
+   }
+   int index {};
+   nearest(flattenQuery(query), 1, metric, &index, nullptr);
+   return index;
+}
+
+int *VectorStore::topKNearest(const SinglyLinkedList<float> &query, int k, const string &metric) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::TopKNearest };
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   checkQuery(metric, k, count);
+   std::unique_ptr<int[]> result { new int[k] };
+   nearest(flattenQuery(query), k, metric, result.get(), nullptr);
+   return result.release();
+}
+
+int *VectorStore::topKNearest(const SinglyLinkedList<float> &query, int k, const string &metric,
+                              QueryTrace &trace) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::TopKNearest };
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   checkQuery(metric, k, count);
+   std::unique_ptr<int[]> result { new int[k] };
+   nearest(flattenQuery(query), k, metric, result.get(), nullptr, &trace);
+   return result.release();
+}
+
+int VectorStore::findNearest(const float *query, const string &metric) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::FindNearest };
+   parseMetric(metric);
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   if (count == 0)
+   {
+      return -1;
+   }
+   int index {};
+   nearest(query, 1, metric, &index, nullptr);
+   return index;
+}
+
+void VectorStore::topKNearest(const float *query, int k, int *ids, double *scores, const string &metric) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::TopKNearest };
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   nearest(query, k, metric, ids, scores);
+}
+
+// Brute-force scan behind every query, the caller holds storeLock. query holds dimension floats; it is only copied
+// when rows are padded past the dimension. Timestamps are only taken when tracing
+void VectorStore::nearest(const float *query, int k, const string &metric, int *ids, double *scores,
+                          QueryTrace *trace) const
+{
+   using Clock = std::chrono::steady_clock;
+   Clock::time_point start {};
+   Clock::time_point stage {};
+   if (trace)
+   {
+      start = stage = Clock::now();
+   }
+
+   Metric m { checkQuery(metric, k, count) };
+   QueryScratch &local { scratch() };
+
+   const float *q { query };
+   if (stride != dimension)
+   {
+      float *padded { local.padded(stride) };
+      std::copy(query, query + dimension, padded);
+      std::fill(padded + dimension, padded + stride, 0.0f);
+      q = padded;
+   }
+   double qNorm { m == Metric::Cosine ? std::sqrt(Generic::dot(q, q, stride)) : 0.0 };
+   const uint64_t *qCode { m == Metric::Hamming ? local.code(query, dimension) : nullptr };
+
+   int kept {};
+   double threshold {};
+   if (trace)
+   {
+      trace->prepareNs = elapsedNs(stage);
+      stage = Clock::now();
+   }
+
+   RowView view { rows, norms, codes, stride, codeWords(dimension), count };
+   auto scan { [&](auto &best) {
+      best.reset(k);
+      kept = scanAll(m, q, qNorm, qCode, view, best);
+      if (trace)
+      {
+         threshold = m == Metric::Euclidean ? std::sqrt(best.threshold()) : best.threshold();
+         trace->scanNs = elapsedNs(stage);
+         stage = Clock::now();
+      }
+      best.drain(ids, scores);
+   } };
+
+   if (higherWins(m))
+   {
+      scan(local.similar);
+   }
+   else
+   {
+      scan(local.close);
+   }
+   if (scores && m == Metric::Euclidean)
+   {
+      for (int i {}; i < k; i++)
+      {
+         scores[i] = std::sqrt(scores[i]);
+      }
+   }
+   countQuery(stats.get(), count, count);
+
+   if (trace)
+   {
+      trace->selectNs = elapsedNs(stage);
+      trace->totalNs = elapsedNs(start);
+      trace->path = "brute_force";
+      trace->metric = string { metricName(m) } + (fixedKernel(stride) ? "<" + std::to_string(stride) + ">" : "<n>");
+      trace->simd = simdLevel();
+      trace->threads = 1;
+      trace->k = k;
+      trace->candidatesConsidered = count;
+      trace->candidatesPruned = count - kept;
+      trace->threshold = threshold;
+   }
+}
+
+int VectorStore::approximateTopK(const float *query, int k, int *ids, double *scores) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::TopKNearest };
+   if (k <= 0)
+   {
+      throw invalid_k_value();
+   }
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   if (!lsh)
+   {
+      throw index_not_enabled("LSH index is not enabled!");
+   }
+   Metric m { parseMetric(lshOptions.metric) };
+   // the heap and the candidate buffer are sized by k, which can be far past the records there are
+   k = std::min(k, count);
+   int limit { std::max(lshOptions.candidates > 0 ? lshOptions.candidates : std::max(10 * k, 100), k) };
+   limit = std::min(limit, count);
+   thread_local ArrayList<int> candidates;
+   candidates.resize(limit);
+   const int *keys { candidates.rawData() };
+   int found { lsh->candidates(query, lshOptions.probes, limit, candidates.rawData()) };
+
+   QueryScratch &local { scratch() };
+   const float *q { query };
+   if (stride != dimension)
+   {
+      float *padded { local.padded(stride) };
+      std::copy(query, query + dimension, padded);
+      std::fill(padded + dimension, padded + stride, 0.0f);
+      q = padded;
+   }
+   double qNorm { m == Metric::Cosine ? std::sqrt(Generic::dot(q, q, stride)) : 0.0 };
+
+   // only the candidates are scored, exactly as the brute-force scan would
+   auto rescore { [&](auto &best, auto distance) {
+      best.reset(k);
+      for (int i {}; i < found; i++)
+      {
+         int index { positionOf(keys[i]) };
+         best.push(distance(rows + static_cast<size_t>(index) * stride, index), index);
+      }
+      return best.drain(ids, scores);
+   } };
+   int written {};
+   switch (m)
+   {
+   case Metric::Cosine:
+      written = rescore(local.similar, [&](const float *row, int index) {
+         double denom { qNorm * norms[index] };
+         return denom == 0 ? 0.0 : Generic::dot(q, row, stride) / denom;
+      });
+      break;
+   case Metric::Euclidean:
+      written = rescore(local.close, [&](const float *row, int) { return Generic::l2sq(q, row, stride); });
+      if (scores)
+      {
+         for (int i {}; i < written; i++)
+         {
+            scores[i] = std::sqrt(scores[i]);
+         }
+      }
+      break;
+   case Metric::Manhattan:
+      written = rescore(local.close, [&](const float *row, int) { return Generic::l1(q, row, stride); });
+      break;
+   case Metric::Dot:
+      written = rescore(local.similar, [&](const float *row, int) { return Generic::dot(q, row, stride); });
+      break;
+   case Metric::Chebyshev:
+      written = rescore(local.close, [&](const float *row, int) { return Generic::linf(q, row, stride); });
+      break;
+   case Metric::Hamming:
+   {
+      int words { codeWords(dimension) };
+      const uint64_t *qCode { local.code(query, dimension) };
+      written = rescore(local.close, [&](const float *, int index) {
+         return static_cast<double>(hammingCodes(qCode, codes + static_cast<size_t>(index) * words, words));
+      });
+      break;
+   }
+   }
+   countQuery(stats.get(), found, found);
+   return written;
+}
+
+int VectorStore::mmrTopK(const float *query, int k, int *ids, double *scores, const MmrOptions &options) const
+{
+   ScopedTimer timer { stats.get(), VectorStoreMetrics::TopKNearest };
+   if (k <= 0)
+   {
+      throw invalid_k_value();
+   }
+   if (!(options.lambda >= 0 && options.lambda <= 1))
+   {
+      throw std::invalid_argument("MMR lambda must be between 0 and 1!");
+   }
+   Metric m { parseMetric(options.metric) };
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   if (count == 0)
+   {
+      return 0;
+   }
+   int n { std::min(std::max(options.candidates > 0 ? options.candidates : std::max(4 * k, 100), k), count) };
+   k = std::min(k, n);
+   std::unique_ptr<int[]> candidateIds { new int[n] };
+   std::unique_ptr<double[]> relevance { new double[n] };
+   nearest(query, n, options.metric, candidateIds.get(), relevance.get());
+
+   // the candidates' rows side by side, so the matrix pass reads contiguous memory
+   int words { codeWords(dimension) };
+   std::unique_ptr<float, void (*)(float *) noexcept> block { allocateRows(n, stride), freeRows };
+   std::unique_ptr<double[]> blockNorms { new double[n] };
+   std::unique_ptr<uint64_t[]> blockCodes { new uint64_t[static_cast<size_t>(n) * words] };
+   for (int i {}; i < n; i++)
+   {
+      int index { candidateIds[i] };
+      std::memcpy(block.get() + static_cast<size_t>(i) * stride, rows + static_cast<size_t>(index) * stride,
+                  stride * sizeof(float));
+      blockNorms[i] = norms[index];
+      std::memcpy(blockCodes.get() + static_cast<size_t>(i) * words, codes + static_cast<size_t>(index) * words,
+                  words * sizeof(uint64_t));
+   }
+   std::unique_ptr<double[]> similarity { new double[static_cast<size_t>(n) * n] };
+   pairAll(m, RowView { block.get(), blockNorms.get(), blockCodes.get(), stride, words, n }, similarity.get());
+
+   // distances are negated so that larger always means closer; redundancy[i] is how close candidate i is to the
+   // nearest one picked so far
+   double sign { higherWins(m) ? 1.0 : -1.0 };
+   std::unique_ptr<double[]> redundancy { new double[n] };
+   std::unique_ptr<bool[]> taken { new bool[n] {} };
+   for (int pick {}; pick < k; pick++)
+   {
+      int best { -1 };
+      double bestValue {};
+      for (int i {}; i < n; i++)
+      {
+         if (taken[i])
+         {
+            continue;
+         }
+         double penalty { pick == 0 ? 0 : (1 - options.lambda) * redundancy[i] };
+         double value { options.lambda * sign * relevance[i] - penalty };
+         if (best < 0 || value > bestValue)
+         {
+            best = i;
+            bestValue = value;
+         }
+      }
+      taken[best] = true;
+      ids[pick] = candidateIds[best];
+      if (scores)
+      {
+         scores[pick] = relevance[best];
+      }
+      const double *picked { similarity.get() + static_cast<size_t>(best) * n };
+      for (int i {}; i < n; i++)
+      {
+         redundancy[i] = pick == 0 ? sign * picked[i] : std::max(redundancy[i], sign * picked[i]);
+      }
+   }
+   return k;
+}
+
+namespace
+{
+// Nearest of k padded centroids to a row: squared euclidean, or 1 - cosine against unit centroids
+template <int Dim>
+int nearestCentroid(bool cosine, const float *row, double norm, const float *centroids, int k, int stride,
+                    double &distance)
+{
+   using K = Kernels<Dim>;
+   int best {};
+   double bestDistance { std::numeric_limits<double>::infinity() };
+   const float *centroid { centroids };
+   for (int c {}; c < k; c++, centroid += stride)
+   {
+      double d { cosine ? 1 - (norm == 0 ? 0 : K::dot(row, centroid, stride) / norm) : K::l2sq(row, centroid, stride) };
+      if (d < bestDistance)
+      {
+         best = c;
+         bestDistance = d;
+      }
+   }
+   distance = bestDistance;
+   return best;
+}
+
+using CentroidFn = int (*)(bool, const float *, double, const float *, int, int, double &);
+
+CentroidFn centroidKernel(int stride) noexcept
+{
+   switch (stride)
+   {
+   case 128:
+      return nearestCentroid<128>;
+   case 256:
+      return nearestCentroid<256>;
+   case 384:
+      return nearestCentroid<384>;
+   case 512:
+      return nearestCentroid<512>;
+   case 768:
+      return nearestCentroid<768>;
+   case 1024:
+      return nearestCentroid<1024>;
+   default:
+      return nearestCentroid<0>;
+   }
+}
+} // namespace
+
+// Only short steps hold the read lock: copying the seed sample, copying each mini-batch, and each slice of the final
+// pass, so writers get in between and the records may change while clustering runs. The final pass walks them by
+// id, which additions and removals leave in ascending order, and its labels are matched back to the records that
+// are left at the end
+Clustering VectorStore::cluster(int k, const ClusterOptions &options) const
+{
+   Metric m { parseMetric(options.metric) };
+   if (m != Metric::Euclidean && m != Metric::Cosine)
+   {
+      throw invalid_metric("Clustering supports the euclidean and cosine metrics!");
+   }
+   if (k <= 0)
+   {
+      throw invalid_k_value();
+   }
+   const bool cosine { m == Metric::Cosine };
+   const int threads { options.threads };
+   const CentroidFn closest { centroidKernel(stride) };
+   SplitMix rng { options.seed };
+   auto pick { [&rng](int n) { return static_cast<int>(rng.next() % static_cast<uint64_t>(n)); } };
+   auto row { [this](int i) { return rows + static_cast<size_t>(i) * stride; } };
+
+   std::unique_ptr<float, void (*)(float *) noexcept> centroids { allocateRows(k, stride), freeRows };
+   // x becomes centroid c, scaled to unit length for cosine
+   auto place { [&](int c, const float *x, double norm) {
+      float *centroid { centroids.get() + static_cast<size_t>(c) * stride };
+      double scale { cosine && norm > 0 ? 1 / norm : 1.0 };
+      for (int d {}; d < stride; d++)
+      {
+         centroid[d] = static_cast<float>(x[d] * scale);
+      }
+   } };
+
+   // k-means++ over a copied sample: each next seed is drawn with probability proportional to its distance from
+   // the seeds so far
+   int sampleSize {};
+   std::unique_ptr<float, void (*)(float *) noexcept> sampleRows { nullptr, freeRows };
+   std::unique_ptr<double[]> sampleNorms;
+   {
+      std::shared_lock<std::shared_mutex> guard { scanLock() };
+      if (k > count)
+      {
+         throw invalid_k_value();
+      }
+      sampleSize = std::min(count, options.seedSample > 0 ? options.seedSample : 32 * k + 1024);
+      sampleRows.reset(allocateRows(sampleSize, stride));
+      sampleNorms.reset(new double[sampleSize]);
+      for (int i {}; i < sampleSize; i++)
+      {
+         int from { sampleSize == count ? i : pick(count) };
+         std::memcpy(sampleRows.get() + static_cast<size_t>(i) * stride, row(from), stride * sizeof(float));
+         sampleNorms[i] = norms[from];
+      }
+   }
+   auto sampled { [&](int i) { return sampleRows.get() + static_cast<size_t>(i) * stride; } };
+   std::unique_ptr<double[]> seedDistance { new double[sampleSize] };
+   auto nearSeed { [&](int c) {
+      const float *centroid { centroids.get() + static_cast<size_t>(c) * stride };
+      algorithms::parallel_for(sampleSize, threads, 4096, [&](int first, int last) {
+         for (int i { first }; i < last; i++)
+         {
+            double d {};
+            closest(cosine, sampled(i), sampleNorms[i], centroid, 1, stride, d);
+            seedDistance[i] = c == 0 ? d : std::min(seedDistance[i], d);
+         }
+      });
+   } };
+   int first { pick(sampleSize) };
+   place(0, sampled(first), sampleNorms[first]);
+   nearSeed(0);
+   for (int c { 1 }; c < k; c++)
+   {
+      double total {};
+      for (int i {}; i < sampleSize; i++)
+      {
+         total += seedDistance[i];
+      }
+      int chosen { sampleSize - 1 };
+      if (total > 0)
+      {
+         double target { rng.uniform() * total };
+         for (int i {}; i < sampleSize; i++)
+         {
+            target -= seedDistance[i];
+            if (target < 0)
+            {
+               chosen = i;
+               break;
+            }
+         }
+      }
+      else
+      {
+         chosen = pick(sampleSize);
+      }
+      place(c, sampled(chosen), sampleNorms[chosen]);
+      nearSeed(c);
+   }
+   sampleRows.reset();
+   sampleNorms.reset();
+   seedDistance.reset();
+
+   // mini-batches: every centre moves towards the records assigned to it with a rate of 1 / (records seen). Each
+   // batch is copied out under the lock and worked on after it is released
+   int batchSize { std::max(options.batchSize, 1) };
+   std::unique_ptr<float, void (*)(float *) noexcept> batchRows { allocateRows(batchSize, stride), freeRows };
+   std::unique_ptr<double[]> batchNorms { new double[batchSize] };
+   std::unique_ptr<int[]> labels { new int[batchSize] };
+   std::unique_ptr<int64_t[]> seen { new int64_t[k] {} };
+   auto batched { [&](int j) { return batchRows.get() + static_cast<size_t>(j) * stride; } };
+   for (int iteration {}; iteration < options.iterations; iteration++)
+   {
+      int n {};
+      {
+         std::shared_lock<std::shared_mutex> guard { scanLock() };
+         n = std::min(batchSize, count);
+         for (int j {}; j < n; j++)
+         {
+            int from { pick(count) };
+            std::memcpy(batched(j), row(from), stride * sizeof(float));
+            batchNorms[j] = norms[from];
+         }
+      }
+      algorithms::parallel_for(n, threads, 256, [&](int from, int to) {
+         for (int j { from }; j < to; j++)
+         {
+            double d {};
+            labels[j] = closest(cosine, batched(j), batchNorms[j], centroids.get(), k, stride, d);
+         }
+      });
+      for (int j {}; j < n; j++)
+      {
+         int c { labels[j] };
+         float *centroid { centroids.get() + static_cast<size_t>(c) * stride };
+         const float *x { batched(j) };
+         double eta { 1.0 / static_cast<double>(++seen[c]) };
+         double scale { cosine && batchNorms[j] > 0 ? 1 / batchNorms[j] : 1.0 };
+         for (int d {}; d < dimension; d++)
+         {
+            centroid[d] = static_cast<float>(centroid[d] + eta * (x[d] * scale - centroid[d]));
+         }
+      }
+      if (cosine)
+      {
+         for (int c {}; c < k; c++)
+         {
+            float *centroid { centroids.get() + static_cast<size_t>(c) * stride };
+            double length { std::sqrt(Generic::dot(centroid, centroid, stride)) };
+            for (int d {}; length > 0 && d < dimension; d++)
+            {
+               centroid[d] = static_cast<float>(centroid[d] / length);
+            }
+         }
+      }
+   }
+   batchRows.reset();
+   batchNorms.reset();
+   labels.reset();
+
+   // every record to its nearest centre, a slice of records per lock; empty clusters take the records farthest
+   // from their centres, then the pass runs again
+   constexpr int SLICE { 1 << 16 };
+   ArrayList<int> ids;
+   ArrayList<int> assigned;
+   ArrayList<double> distance;
+   std::unique_ptr<int[]> sizes { new int[k] };
+   auto after { [this](int id) {
+      VectorRecord *const *all { records.rawData() };
+      return static_cast<int>(
+          std::upper_bound(all, all + count, id, [](int key, const VectorRecord *r) { return key < r->id; }) - all);
+   } };
+   constexpr int REPAIR_ROUNDS { 4 };
+   for (int round {}; round < REPAIR_ROUNDS; round++)
+   {
+      ids.clear();
+      assigned.clear();
+      distance.clear();
+      // records added after the pass starts are left to the matching at the end, so a busy writer cannot keep it going
+      for (int lastId { -1 }, endId { INT_MAX };;)
+      {
+         std::shared_lock<std::shared_mutex> guard { scanLock() };
+         if (endId == INT_MAX)
+         {
+            endId = count > 0 ? records[count - 1]->id : -1;
+         }
+         int from { after(lastId) };
+         int end { after(endId) };
+         if (from >= end)
+         {
+            break;
+         }
+         int n { std::min(SLICE, end - from) };
+         int base { ids.size() };
+         ids.resize(base + n);
+         assigned.resize(base + n);
+         distance.resize(base + n);
+         int *id { ids.rawData() + base };
+         int *label { assigned.rawData() + base };
+         double *d { distance.rawData() + base };
+         algorithms::parallel_for(n, threads, 4096, [&](int lo, int hi) {
+            for (int i { lo }; i < hi; i++)
+            {
+               id[i] = records[from + i]->id;
+               label[i] = closest(cosine, row(from + i), norms[from + i], centroids.get(), k, stride, d[i]);
+            }
+         });
+         lastId = id[n - 1];
+      }
+
+      std::fill(sizes.get(), sizes.get() + k, 0);
+      for (int i {}; i < assigned.size(); i++)
+      {
+         sizes[assigned[i]]++;
+      }
+      int empty {};
+      for (int c {}; c < k; c++)
+      {
+         empty += sizes[c] == 0;
+      }
+      if (empty == 0 || round + 1 == REPAIR_ROUNDS)
+      {
+         break;
+      }
+      algorithms::top_k<double, int, std::greater<double>> farthest { empty };
+      for (int i {}; i < assigned.size(); i++)
+      {
+         if (sizes[assigned[i]] > 1)
+         {
+            farthest.push(distance[i], ids[i]);
+         }
+      }
+      std::unique_ptr<int[]> donors { new int[empty] };
+      int donated { farthest.drain(donors.get(), nullptr) };
+      std::shared_lock<std::shared_mutex> guard { scanLock() };
+      for (int c {}, next {}; c < k && next < donated; c++)
+      {
+         if (sizes[c] == 0)
+         {
+            // a donor removed meanwhile leaves its cluster empty for the next round
+            int at { positionOf(donors[next++]) };
+            if (at >= 0)
+            {
+               place(c, row(at), norms[at]);
+            }
+         }
+      }
+   }
+
+   // both sides are in id order: records removed since their slice drop out, records added since get a label here
+   Clustering result { ArrayList<int>(), ArrayList<int>(k), nullptr, 0 };
+   result.sizes.resize(k);
+   EmbedFn embed {};
+   {
+      std::shared_lock<std::shared_mutex> guard { scanLock() };
+      embed = embeddingFunction;
+      result.assignments.resize(count);
+      for (int i {}, j {}; i < count; i++)
+      {
+         int id { records[i]->id };
+         while (j < ids.size() && ids[j] < id)
+         {
+            j++;
+         }
+         double d {};
+         int c {};
+         if (j < ids.size() && ids[j] == id)
+         {
+            c = assigned[j];
+            d = distance[j];
+         }
+         else
+         {
+            c = closest(cosine, row(i), norms[i], centroids.get(), k, stride, d);
+         }
+         result.assignments[i] = c;
+         result.sizes[c]++;
+         result.inertia += d;
+      }
+   }
+   result.centroids = std::make_unique<VectorStore>(dimension, embed);
+   for (int c {}; c < k; c++)
+   {
+      SinglyLinkedList<float> *vector { new SinglyLinkedList<float>() };
+      vector->resize(dimension);
+      vector->copyFrom(centroids.get() + static_cast<size_t>(c) * stride, dimension);
+      result.centroids->addRecord("cluster " + std::to_string(c), vector);
+   }
+   return result;
+}
+
+namespace
+{
+// what malloc takes for a request of n bytes: an 8-byte header, rounded up to 16, never under 32
+int64_t heapBytes(size_t n) noexcept
+{
+   return n == 0 ? 0 : std::max<int64_t>(32, (static_cast<int64_t>(n) + 8 + 15) / 16 * 16);
+}
+
+string mebibytes(int64_t bytes)
+{
+   std::ostringstream out;
+   out.setf(std::ios::fixed);
+   out.precision(2);
+   out << bytes / (1024.0 * 1024.0) << " MiB";
+   return out.str();
+}
+} // namespace
+
+int64_t MemoryUsage::total() const noexcept
+{
+   return vectorData + nodeOverhead + packedRows + slack + rawText + records + indexes + caches;
+}
+
+string MemoryUsage::toString() const
+{
+   return "vectors " + mebibytes(vectorData) + ", list overhead " + mebibytes(nodeOverhead) + ", packed rows " +
+          mebibytes(packedRows) + ", slack " + mebibytes(slack) + ", raw text " + mebibytes(rawText) + ", records " +
+          mebibytes(records) + ", indexes " + mebibytes(indexes) + ", caches " + mebibytes(caches) + ", total " +
+          mebibytes(total());
+}
+
+MemoryUsage VectorStore::memoryUsage() const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   MemoryUsage usage {};
+   const int64_t node { heapBytes(SinglyLinkedList<float>::NODE_BYTES) };
+   const size_t inlineText { string {}.capacity() }; // short strings live inside the object
+   for (int i {}; i < count; i++)
+   {
+      const VectorRecord &record { *records[i] };
+      int64_t n { record.vector->size() };
+      usage.vectorData += n * static_cast<int64_t>(sizeof(float));
+      usage.nodeOverhead += n * (node - static_cast<int64_t>(sizeof(float))) +
+                            heapBytes(sizeof(SinglyLinkedList<float>));
+      usage.records += heapBytes(sizeof(VectorRecord));
+      if (!texts && record.rawText.capacity() > inlineText)
+      {
+         usage.rawText += record.rawText.size();
+         usage.slack += heapBytes(record.rawText.capacity() + 1) - static_cast<int64_t>(record.rawText.size());
+      }
+   }
+   usage.records += count * static_cast<int64_t>(sizeof(VectorRecord *));
+   usage.slack += (records.getCapacity() - count) * static_cast<int64_t>(sizeof(VectorRecord *));
+
+   int64_t rowBytes { static_cast<int64_t>(stride * sizeof(float) + sizeof(double) +
+                                           codeWords(dimension) * sizeof(uint64_t)) };
+   usage.packedRows = count * rowBytes;
+   usage.slack += (rowCapacity - count) * rowBytes;
+   if (shrinking)
+   {
+      usage.slack += shrinking->capacity * rowBytes;
+   }
+
+   if (texts)
+   {
+      int64_t cached { texts->cacheBytes() };
+      usage.caches += cached;
+      usage.rawText += texts->residentBytes() - cached;
+   }
+   if (lexical)
+   {
+      usage.indexes += lexical->bytes();
+   }
+   if (rebuiltLexical)
+   {
+      usage.indexes += rebuiltLexical->bytes();
+   }
+   if (lsh)
+   {
+      usage.indexes += lsh->bytes();
+   }
+   if (stats)
+   {
+      usage.caches += sizeof(VectorStoreMetrics);
+   }
+   return usage;
+}
+
+// Budget is spent across the steps in order, and a step only hands over to the next one once it is done
+bool VectorStore::compact(int maxRecords)
+{
+   std::unique_lock<std::shared_mutex> guard { storeLock };
+   int budget { std::max(maxRecords, 0) };
+   int words { codeWords(dimension) };
+   // the texts and lexical steps walk by id, records keep their id order through every removal
+   auto after { [&](int id) {
+      auto first { records.rawData() };
+      return static_cast<int>(std::upper_bound(first, first + count, id, [](int key, const VectorRecord *record) {
+                                 return key < record->id;
+                              }) -
+                              first);
+   } };
+
+   if (compactStep == CompactStep::Lists)
+   {
+      int end { compactCursor + std::min(budget, count - compactCursor) };
+      thread_local ArrayList<float> values;
+      for (int i { compactCursor }; i < end; i++)
+      {
+         // fresh nodes, allocated one after another, replace the ones scattered by earlier edits. A handed out list
+         // is the caller's and stays where it is
+         VectorRecord &record { *records[i] };
+         if (!pinnedIds.empty() && pinnedIds.indexOf(record.id) >= 0)
+         {
+            continue;
+         }
+         int n { record.vector->size() };
+         values.resize(n);
+         record.vector->copyTo(values.rawData(), n);
+         std::unique_ptr<SinglyLinkedList<float>> fresh { new SinglyLinkedList<float>() };
+         fresh->resize(n);
+         fresh->copyFrom(values.rawData(), n);
+         delete record.vector;
+         record.vector = fresh.release();
+         if (!texts)
+         {
+            record.rawText.shrink_to_fit();
+         }
+      }
+      budget -= std::max(end - compactCursor, 0);
+      compactCursor = end;
+      if (compactCursor < count)
+      {
+         return false;
+      }
+      compactCursor = 0;
+      compactStep = CompactStep::Rows;
+   }
+
+   if (compactStep == CompactStep::Rows)
+   {
+      // some headroom, so a few adds meanwhile do not throw the copy away
+      int target { std::max(count + count / 8, 16) };
+      if (!shrinking && target < rowCapacity)
+      {
+         shrinking = std::make_unique<RowCopy>(target, stride, words);
+      }
+      if (shrinking)
+      {
+         int from { shrinking->copied };
+         int n { std::min(budget, count - from) };
+         std::memcpy(shrinking->rows + static_cast<size_t>(from) * stride, rows + static_cast<size_t>(from) * stride,
+                     static_cast<size_t>(n) * stride * sizeof(float));
+         std::memcpy(shrinking->norms + from, norms + from, n * sizeof(double));
+         std::memcpy(shrinking->codes + static_cast<size_t>(from) * words, codes + static_cast<size_t>(from) * words,
+                     static_cast<size_t>(n) * words * sizeof(uint64_t));
+         shrinking->copied += n;
+         budget -= n;
+         if (shrinking->copied < count)
+         {
+            return false;
+         }
+         std::swap(rows, shrinking->rows);
+         std::swap(norms, shrinking->norms);
+         std::swap(codes, shrinking->codes);
+         rowCapacity = shrinking->capacity;
+         shrinking.reset();
+      }
+      // a copy of the pointers, cheap next to the rows
+      records.shrink_to_fit();
+      compactStep = CompactStep::Lsh;
+   }
+
+   if (compactStep == CompactStep::Lsh)
+   {
+      if (lsh)
+      {
+         budget -= lsh->compact(budget);
+         if (lsh->freeSlotCount() > 0)
+         {
+            return false;
+         }
+      }
+      compactStep = CompactStep::Texts;
+      compactLastId = -1;
+      if (!texts || texts->condemn() == 0)
+      {
+         compactLastId = INT_MAX;
+      }
+   }
+
+   // texts still in a condemned block are appended again, which leaves nothing live in it
+   if (compactStep == CompactStep::Texts)
+   {
+      if (texts && compactLastId < INT_MAX)
+      {
+         int from { after(compactLastId) };
+         int end { from + std::min(budget, count - from) };
+         string &text { textScratch() };
+         for (int i { from }; i < end; i++)
+         {
+            VectorRecord &record { *records[i] };
+            if (record.text.block >= 0 && texts->condemned(record.text.block))
+            {
+               texts->get(record.text, text);
+               texts->discard(record.text);
+               record.text = texts->append(text);
+            }
+         }
+         budget -= end - from;
+         if (end < count)
+         {
+            compactLastId = end > 0 ? records[end - 1]->id : compactLastId;
+            return false;
+         }
+         texts->releaseCondemned();
+      }
+      if (texts)
+      {
+         texts->trimCache();
+      }
+      compactStep = CompactStep::Lexical;
+      compactLastId = -1;
+      // removed documents stay in the postings until the index is rebuilt
+      if (lexical && lexical->deadDocuments() > lexical->documents() / 4)
+      {
+         rebuiltLexical = std::make_unique<InvertedIndex>();
+      }
+   }
+
+   // writes meanwhile reach the new index through storeText and removeAt once the walk has passed their record
+   if (rebuiltLexical)
+   {
+      int from { after(compactLastId) };
+      int end { from + std::min(budget, count - from) };
+      TextArena::Cursor cursor;
+      for (int i { from }; i < end; i++)
+      {
+         rebuiltLexical->add(records[i]->id, rawTextOf(*records[i], &cursor));
+      }
+      if (end < count)
+      {
+         compactLastId = end > 0 ? records[end - 1]->id : compactLastId;
+         return false;
+      }
+      lexical = std::move(rebuiltLexical);
+   }
+   compactStep = CompactStep::Lists;
+   compactLastId = -1;
+   return true;
+}
+
+bool VectorStore::submitQuery(QueryExecutor::Task task, const QueryOptions &options) const
+{
+   std::lock_guard<std::mutex> guard { executorLock };
+   if (!executor)
+   {
+      executor = std::make_unique<QueryExecutor>();
+   }
+   return executor->submit(std::move(task), options.priority, options.deadline);
+}
+
+namespace
+{
+// wraps fn so its result or exception lands in promise, and an expired deadline skips it
+template <typename R, typename Fn> QueryExecutor::Task settle(std::shared_ptr<std::promise<R>> promise, Fn fn)
+{
+   return [promise, fn](bool expired) {
+      if (expired)
+      {
+         promise->set_exception(std::make_exception_ptr(deadline_exceeded()));
+         return;
+      }
+      try
+      {
+         promise->set_value(fn());
+      }
+      catch (...)
+      {
+         promise->set_exception(std::current_exception());
+      }
+   };
+}
+} // namespace
+
+int VectorStore::lexicalTopK(std::string_view query, int k, int *ids, double *scores) const
+{
+   std::shared_lock<std::shared_mutex> guard { storeLock };
+   if (!lexical)
+   {
+      throw index_not_enabled("Lexical index is not enabled!");
+   }
+   int found { lexical->search(query, k, ids, scores) };
+   for (int i {}; i < found; i++)
+   {
+      ids[i] = positionOf(ids[i]);
+   }
+   return found;
+}
+
+int VectorStore::hybridTopK(const string &query, int k, int *ids, double *scores, const HybridOptions &options)
+{
+   if (k <= 0)
+   {
+      throw invalid_k_value();
+   }
+   Metric m { parseMetric(options.metric) };
+   std::unique_ptr<SinglyLinkedList<float>> vector { preprocessing(query) };
+   std::shared_lock<std::shared_mutex> guard { scanLock() };
+   if (!lexical)
+   {
+      throw index_not_enabled("Lexical index is not enabled!");
+   }
+   if (count == 0)
+   {
+      return 0;
+   }
+
+   int candidates { options.candidates > 0 ? options.candidates : std::max(4 * k, 50) };
+   int vectorCount { std::min(candidates, count) };
+   std::unique_ptr<int[]> candidateIds { new int[vectorCount + candidates] };
+   std::unique_ptr<double[]> candidateScores { new double[vectorCount + candidates] };
+   int *vectorIds { candidateIds.get() };
+   double *vectorScores { candidateScores.get() };
+   int *lexicalIds { vectorIds + vectorCount };
+   double *lexicalScores { vectorScores + vectorCount };
+   nearest(flattenQuery(*vector), vectorCount, options.metric, vectorIds, vectorScores);
+   int lexicalCount { lexical->search(query, candidates, lexicalIds, lexicalScores) };
+   for (int i {}; i < lexicalCount; i++)
+   {
+      lexicalIds[i] = positionOf(lexicalIds[i]);
+   }
+
+   // each candidate's share of the fused score, both lists are best first
+   struct Share
+   {
+      int index;
+      double score;
+   };
+   int shares { vectorCount + lexicalCount };
+   std::unique_ptr<Share[]> merged { new Share[shares] };
+   auto contribute { [&options](const double *raw, int n, bool higherIsBetter, double weight, Share *out,
+                                const int *index) {
+      double best { n > 0 ? raw[0] : 0 };
+      double worst { n > 0 ? raw[n - 1] : 0 };
+      for (int i {}; i < n; i++)
+      {
+         double share {};
+         if (options.fusion == HybridOptions::ReciprocalRank)
+         {
+            share = 1.0 / (options.rrfK + i + 1);
+         }
+         else
+         {
+            double spread { higherIsBetter ? best - worst : worst - best };
+            share = spread > 0 ? weight * (higherIsBetter ? raw[i] - worst : worst - raw[i]) / spread : weight;
+         }
+         out[i] = Share { index[i], share };
+      }
+   } };
+   contribute(vectorScores, vectorCount, higherWins(m), 1 - options.lexicalWeight, merged.get(), vectorIds);
+   contribute(lexicalScores, lexicalCount, true, options.lexicalWeight, merged.get() + vectorCount, lexicalIds);
+
+   // records found by both sides add up
+   algorithms::sort(merged.get(), merged.get() + shares,
+                    [](const Share &a, const Share &b) { return a.index < b.index; });
+   algorithms::top_k<double, int, std::greater<double>> best { k };
+   for (int i {}; i < shares;)
+   {
+      double score { merged[i].score };
+      int j { i + 1 };
+      for (; j < shares && merged[j].index == merged[i].index; j++)
+      {
+         score += merged[j].score;
+      }
+      best.push(score, merged[i].index);
+      i = j;
+   }
+   return best.drain(ids, scores);
+}
+
+std::future<int> VectorStore::findNearestAsync(const SinglyLinkedList<float> &query, const string &metric,
+                                               QueryOptions options) const
+{
+   auto promise { std::make_shared<std::promise<int>>() };
+   std::future<int> result { promise->get_future() };
+   auto q { std::make_shared<ArrayList<float>>(dimension) };
+   const float *flat { flattenQuery(query) };
+   for (int i {}; i < dimension; i++)
+   {
+      q->add(flat[i]);
+   }
+
+   if (!submitQuery(settle(promise, [this, q, metric] { return findNearest(q->rawData(), metric); }), options))
+   {
+      promise->set_exception(std::make_exception_ptr(query_rejected()));
+   }
+   return result;
+}
+
+std::future<ArrayList<int>> VectorStore::topKNearestAsync(const SinglyLinkedList<float> &query, int k,
+                                                          const string &metric, QueryOptions options) const
+{
+   auto promise { std::make_shared<std::promise<ArrayList<int>>>() };
+   std::future<ArrayList<int>> result { promise->get_future() };
+   auto q { std::make_shared<ArrayList<float>>(dimension) };
+   const float *flat { flattenQuery(query) };
+   for (int i {}; i < dimension; i++)
+   {
+      q->add(flat[i]);
+   }
+
+   auto run { [this, q, k, metric] {
+      ArrayList<int> out(std::max(k, 1));
+      for (int i {}; i < k; i++)
+      {
+         out.add(0);
+      }
+      topKNearest(q->rawData(), k, out.rawData(), nullptr, metric);
+      return out;
+   } };
+   if (!submitQuery(settle(promise, run), options))
+   {
+      promise->set_exception(std::make_exception_ptr(query_rejected()));
+   }
+   return result;
+}
+
+void VectorStore::configureExecutor(int threads, int queueCapacity)
+{
+   std::unique_ptr<QueryExecutor> old {};
+   {
+      std::lock_guard<std::mutex> guard { executorLock };
+      old = std::move(executor);
+      executor = std::make_unique<QueryExecutor>(threads, queueCapacity);
+   }
+}
+
+const VectorStoreMetrics &VectorStore::metrics() const
+{
+   static const VectorStoreMetrics disabled {};
+   return stats ? *stats : disabled;
+}
+
+void VectorStore::resetMetrics()
+{
+   if (stats)
+   {
+      stats->reset();
+   }
 }
 
-// TODO: implement other methods of VectorStore
 
 // Explicit template instantiation for char, string, int, double, float, and
 // Point
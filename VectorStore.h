@@ -10,9 +10,13 @@
 namespace algorithms
 {
 // Insertion sort
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
 void insertion_sort(Iterator first, Iterator last, Compare comp = Compare())
 {
+   if (first == last)
+   {
+      return;
+   }
    for (Iterator i { first + 1 }; i != last; i++)
    {
       auto key { std::move(*i) };
@@ -26,445 +30,2383 @@ void insertion_sort(Iterator first, Iterator last, Compare comp = Compare())
    }
 }
 
-// Heapify for heap sort
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
-void heapify(Iterator first, Iterator last, Iterator root, int len, Compare comp = Compare())
-{
-   int largest { root - first };
-   int l { 2 * largest + 1 };
-   int r { 2 * largest + 2 };
+// d-ary heap helpers. The heap is a max-heap with respect to comp (comp(a, b) means a sits below b) and the
+// children of i are Arity * i + 1 ... Arity * i + Arity
 
-   if (l < len && comp(*(first + largest), *(first + l)))
-   {
-      largest = l;
-   }
-   if (r < len && comp(*(first + largest), *(first + r)))
+// Of the (up to Arity) children starting at child, the one that should move up
+template <int Arity, typename Iterator, typename Compare> int best_child(Iterator first, int child, int len, Compare &comp)
+{
+   int best { child };
+   int end { child + Arity < len ? child + Arity : len };
+   for (int c { child + 1 }; c < end; ++c)
    {
-      largest = r;
+      if (comp(*(first + best), *(first + c)))
+      {
+         best = c;
+      }
    }
+   return best;
+}
 
-   if (largest != root - first)
+// Moves the element at hole toward the root until its parent ranks at least as high
+template <int Arity = 2, typename Iterator, typename Compare> void sift_up(Iterator first, int hole, Compare &comp)
+{
+   auto value { std::move(*(first + hole)) };
+   while (hole > 0)
    {
-      std::iter_swap(first + largest, root);
-      heapify(first, last, first + largest, len, comp);
+      int parent { (hole - 1) / Arity };
+      if (!comp(*(first + parent), value))
+      {
+         break;
+      }
+      *(first + hole) = std::move(*(first + parent));
+      hole = parent;
    }
+   *(first + hole) = std::move(value);
 }
 
-// Heap sort
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
-void heap_sort(Iterator first, Iterator last, Compare comp = Compare())
+// Floyd's bottom-up sift: the hole walks down to a leaf along the best children without looking at the sifted
+// value, then the value climbs back up from there. A value taken from the bottom of the heap nearly always belongs
+// near the bottom again, so this does about half the comparisons of the textbook sift and never recurses
+template <int Arity = 2, typename Iterator, typename Compare>
+void sift_down(Iterator first, int len, int hole, Compare &comp)
 {
-   int len { last - first };
-   for (int i { len / 2 - 1 }; i >= 0; --i)
+   int top { hole };
+   auto value { std::move(*(first + hole)) };
+
+   for (int child { Arity * hole + 1 }; child < len; child = Arity * hole + 1)
    {
-      heapify(first, last, first + i, len, comp);
+      int best { algorithms::best_child<Arity>(first, child, len, comp) };
+      *(first + hole) = std::move(*(first + best));
+      hole = best;
    }
-   for (int i { len - 1 }; i > 0; --i)
+
+   while (hole > top)
    {
-      std::iter_swap(first, first + i);
-      heapify(first, first + i, first, i, comp);
+      int parent { (hole - 1) / Arity };
+      if (!comp(*(first + parent), value))
+      {
+         break;
+      }
+      *(first + hole) = std::move(*(first + parent));
+      hole = parent;
    }
+   *(first + hole) = std::move(value);
 }
 
-// Partition for quicksort
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
-Iterator partition(Iterator first, Iterator last, Compare comp = Compare())
+template <int Arity = 2, typename Iterator, typename Compare> void make_heap(Iterator first, Iterator last, Compare &comp)
 {
-   Iterator pivot { last - 1 };
-   Iterator i { first };
-   for (Iterator j = first; j != last - 1; ++j)
+   int len { static_cast<int>(last - first) };
+   for (int i { (len - 2) / Arity }; i >= 0; --i)
    {
-      if (comp(*j, *pivot))
-      {
-         std::iter_swap(i, j);
-         ++i;
-      }
+      algorithms::sift_down<Arity>(first, len, i, comp);
    }
-   std::iter_swap(i, pivot);
-   return i;
 }
 
-// Introsort implementation
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
-void introsort_impl(Iterator first, Iterator last, int depth_limit, Compare comp = Compare())
+// [first, last - 1) is a heap, *(last - 1) joins it
+template <int Arity = 2, typename Iterator, typename Compare> void push_heap(Iterator first, Iterator last, Compare &comp)
 {
-   while (last - first > 16)
+   algorithms::sift_up<Arity>(first, static_cast<int>(last - first) - 1, comp);
+}
+
+// Moves the top to *(last - 1) and restores the heap on [first, last - 1)
+template <int Arity = 2, typename Iterator, typename Compare> void pop_heap(Iterator first, Iterator last, Compare &comp)
+{
+   int len { static_cast<int>(last - first) };
+   if (len < 2)
    {
-      if (depth_limit == 0)
-      {
-         heap_sort(first, last, comp);
-         return;
-      }
-      depth_limit--;
-      Iterator pivot { partition(first, last, comp) };
-      introsort_impl(pivot + 1, last, depth_limit, comp);
-      last = pivot;
+      return;
    }
-   insertion_sort(first, last, comp);
+   std::iter_swap(first, last - 1);
+   algorithms::sift_down<Arity>(first, len - 1, 0, comp);
 }
 
-// Public sort function
-template <typename Iterator, typename Compare = std::less<typename Iterator::value_type>>
-void sort(Iterator first, Iterator last, Compare comp = Compare())
+// Heapify for heap sort, kept for callers that sift a single root
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
+void heapify(Iterator first, Iterator last, Iterator root, int len, Compare comp = Compare())
 {
-   int depth_limit { 2 * static_cast<int>(std::log(last - first)) };
-   introsort_impl(first, last, depth_limit, comp);
+   algorithms::sift_down<2>(first, len, static_cast<int>(root - first), comp);
 }
-// this is clangd doings
-} // namespace algorithms
 
-template <class T> class ArrayList
+// Heap sort
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
+void heap_sort(Iterator first, Iterator last, Compare comp = Compare())
 {
-#ifdef TESTING
-   friend class TestHelper;
-#endif
+   int len { static_cast<int>(last - first) };
+   algorithms::make_heap<2>(first, last, comp);
+   for (int i { len - 1 }; i > 0; --i)
+   {
+      std::iter_swap(first, first + i);
+      algorithms::sift_down<2>(first, i, 0, comp);
+   }
+}
+
+// Priority queue on a d-ary heap. top() is the element comp ranks highest, so std::less gives a max-heap like
+// std::priority_queue. Storage is cache-line aligned and shifted by Arity - 1 slots so that every group of siblings
+// starts on an Arity-slot boundary: with Arity = 4 and 16-byte elements each sift step touches one cache line
+template <typename T, typename Compare = std::less<T>, int Arity = 2> class heap
+{
+   static_assert(Arity >= 2, "a heap needs at least two children per node");
+
  private:
-   T *data;
+   static constexpr int pad { Arity - 1 };
+   static constexpr std::size_t align { alignof(T) > 64 ? alignof(T) : 64 };
+
+   T *storage;
    int capacity;
    int count;
+   Compare comp;
 
-   void ensureCapacity(int cap);
+   T *base() const noexcept { return storage ? storage + pad : nullptr; }
 
- public:
-   class Iterator;
-   friend class Iterator;
+   static T *allocate(int cap)
+   {
+      return static_cast<T *>(::operator new((cap + pad) * sizeof(T), std::align_val_t { align }));
+   }
+
+   static void deallocate(T *p) noexcept { ::operator delete(p, std::align_val_t { align }); }
+
+   void grow(int cap)
+   {
+      T *fresh { allocate(cap) };
+      for (int i {}; i < count; ++i)
+      {
+         new (fresh + pad + i) T { std::move(base()[i]) };
+         base()[i].~T();
+      }
+      deallocate(storage);
+      storage = fresh;
+      capacity = cap;
+   }
 
  public:
-   explicit ArrayList(int initCapacity = 10);
-   ArrayList(const ArrayList<T> &other) noexcept(std::is_nothrow_copy_constructible_v<T>);
-   ~ArrayList() noexcept;
+   explicit heap(int initCapacity = 16, Compare comp = Compare())
+       : storage { allocate(initCapacity) }, capacity { initCapacity }, count {}, comp { comp }
+   {
+   }
+
+   heap(const heap &other) : storage { allocate(other.capacity) }, capacity { other.capacity }, count {}, comp { other.comp }
+   {
+      for (; count < other.count; ++count)
+      {
+         new (base() + count) T { other.base()[count] };
+      }
+   }
+
+   heap(heap &&other) noexcept
+       : storage { other.storage }, capacity { other.capacity }, count { other.count }, comp { other.comp }
+   {
+      other.storage = nullptr;
+      other.capacity = 0;
+      other.count = 0;
+   }
+
+   heap &operator=(heap other) noexcept
+   {
+      std::swap(storage, other.storage);
+      std::swap(capacity, other.capacity);
+      std::swap(count, other.count);
+      std::swap(comp, other.comp);
+      return *this;
+   }
+
+   ~heap() noexcept
+   {
+      clear();
+      deallocate(storage);
+   }
 
  public:
-   ArrayList<T> &operator=(const ArrayList<T> &other)
+   [[nodiscard]] inline int size() const noexcept { return count; }
+   [[nodiscard]] inline bool empty() const noexcept { return count == 0; }
 
-       noexcept(std::is_nothrow_copy_constructible_v<T> && std::is_nothrow_copy_assignable_v<T>);
+   // elements in heap order, not sorted
+   [[nodiscard]] inline const T *data() const noexcept { return base(); }
+
+   [[nodiscard]] const T &top() const
+   {
+      if (count == 0)
+      {
+         throw std::out_of_range("Heap is empty!");
+      }
+      return base()[0];
+   }
 
  public:
-   // bad habit, this could serve as watermark tho
-   ArrayList(const std::initializer_list<T> &init) noexcept(std::is_nothrow_copy_constructible_v<T>)
+   void reserve(int cap)
+   {
+      if (cap > capacity)
+      {
+         grow(cap);
+      }
+   }
 
-       : count { static_cast<int>(init.size()) }
+   template <typename... Args> void emplace(Args &&...args)
    {
-      this->capacity = ((this->count + 1) * 1.5);
-      this->data = (T *)::operator new(this->capacity * sizeof(T));
+      if (count == capacity)
+      {
+         T tmp(std::forward<Args>(args)...);
+         grow(capacity + capacity / 2 + 1);
+         new (base() + count) T(std::move(tmp));
+      }
+      else
+      {
+         new (base() + count) T(std::forward<Args>(args)...);
+      }
+      ++count;
+      algorithms::sift_up<Arity>(base(), count - 1, comp);
+   }
 
-      T *p { this->data };
-      for (const T &v : init)
+   void push(const T &e) { emplace(e); }
+   void push(T &&e) { emplace(std::move(e)); }
+
+   T pop()
+   {
+      if (count == 0)
       {
-         new (p++) T { v };
+         throw std::out_of_range("Heap is empty!");
       }
+      algorithms::pop_heap<Arity>(base(), base() + count, comp);
+      T out { std::move(base()[count - 1]) };
+      base()[--count].~T();
+      return out;
    }
 
-   ArrayList<T> &operator=(const std::initializer_list<T> &init)
+   // pop followed by push, with a single sift. This is the bounded top-k step: when a candidate beats the current
+   // worst kept one it takes its place
+   void replace_top(T e)
+   {
+      if (count == 0)
+      {
+         throw std::out_of_range("Heap is empty!");
+      }
+      base()[0] = std::move(e);
+      algorithms::sift_down<Arity>(base(), count, 0, comp);
+   }
 
-       noexcept(std::is_nothrow_copy_constructible_v<T>)
+   void clear() noexcept
    {
-      for (int i = 0; i < count; ++i)
+      for (int i {}; i < count; ++i)
       {
-         data[i].~T();
+         base()[i].~T();
       }
-      ::operator delete(data, capacity * sizeof(T));
+      count = 0;
+   }
+};
 
-      this->count = static_cast<int>(init.size());
-      this->capacity = (count + 1) * 1.5;
-      this->data = (T *)::operator new(capacity * sizeof(T));
+// Bounded top-k selection shared by the point indexes and the vector search. Keeps the k best (score, id) pairs
+// seen so far in a heap whose top is the worst kept one, so rejecting a candidate costs one comparison. Better
+// decides which score wins (std::less keeps the smallest distances), ties go to the smaller id
+template <typename Score, typename Id = int, typename Better = std::less<Score>> class top_k
+{
+ public:
+   struct Entry
+   {
+      Score score;
+      Id id;
+   };
 
-      T *p { this->data };
-      for (const T &v : init)
+ private:
+   // a sits below b in the heap when a is the better entry, so the worst entry ends up on top
+   struct WorseOnTop
+   {
+      Better better;
+      bool operator()(const Entry &a, const Entry &b) const
       {
-         new (p++) T { v };
+         if (better(a.score, b.score))
+         {
+            return true;
+         }
+         if (better(b.score, a.score))
+         {
+            return false;
+         }
+         return a.id < b.id;
       }
+   };
 
-      return *this;
-   }
+   int k;
+   heap<Entry, WorseOnTop, 4> entries;
 
  public:
-   // quality of life stuff
-   friend std::ostream &operator<<(std::ostream &os, const ArrayList<T> &list) noexcept
+   explicit top_k(int k) : k { k }, entries { k > 0 ? k : 0 } {}
+
+   [[nodiscard]] inline int size() const noexcept { return entries.size(); }
+   [[nodiscard]] inline int capacity() const noexcept { return k; }
+   [[nodiscard]] inline bool full() const noexcept { return entries.size() >= k; }
+
+   // worst score still kept, anything not better than this once full() is rejected
+   [[nodiscard]] inline const Score &threshold() const { return entries.top().score; }
+
+   // whether score would make it in right now
+   [[nodiscard]] inline bool accepts(const Score &score) const
    {
-      os << list.toString();
-      return os;
+      return !full() || Better {}(score, entries.top().score);
    }
 
- public:
-   [[nodiscard]] friend bool operator==(const ArrayList<T> &lhs, const ArrayList<T> &rhs) noexcept
+   // returns whether the candidate was kept
+   bool push(const Score &score, const Id &id)
    {
-      if (&rhs == &lhs)
+      if (k <= 0)
       {
+         return false;
+      }
+      if (!full())
+      {
+         entries.push(Entry { score, id });
          return true;
       }
-      if (lhs.count != rhs.count)
+      Entry candidate { score, id };
+      if (WorseOnTop {}(candidate, entries.top()))
       {
-         return false;
+         entries.replace_top(candidate);
+         return true;
       }
-      for (int i {}; i < lhs.count; i++)
+      return false;
+   }
+
+   // best first; either output may be null. Empties the selection, returns how many were written
+   int drain(Id *ids, Score *scores)
+   {
+      int n { entries.size() };
+      for (int i { n - 1 }; i >= 0; --i)
       {
-         if (!(lhs.data[i] == rhs.data[i]))
+         Entry e { entries.pop() };
+         if (ids)
          {
-            return false;
+            ids[i] = e.id;
+         }
+         if (scores)
+         {
+            scores[i] = e.score;
          }
       }
-      return true;
+      return n;
    }
 
-   [[nodiscard]] friend bool operator!=(const ArrayList<T> &lhs, const ArrayList<T> &rhs) noexcept
+   void clear() noexcept { entries.clear(); }
+
+   // empties the selection for another query, keeping the heap storage
+   void reset(int newK)
    {
-      return !(lhs == rhs);
+      entries.clear();
+      k = newK;
+      entries.reserve(k > 0 ? k : 0);
    }
+};
 
- public:
-   void add(T e);
-   void add(int index, T e);
-   T removeAt(int index);
+// Sorts *a, *b, *c in place so that *b ends up holding the median
+template <typename Iterator, typename Compare> void sort3(Iterator a, Iterator b, Iterator c, Compare &comp)
+{
+   if (comp(*b, *a))
+   {
+      std::iter_swap(a, b);
+   }
+   if (comp(*c, *b))
+   {
+      std::iter_swap(b, c);
+      if (comp(*b, *a))
+      {
+         std::iter_swap(a, b);
+      }
+   }
+}
 
- public:
-   // most definitely wants these to not be discarded
-   [[nodiscard]] inline constexpr bool empty() const noexcept { return count == 0; };
-   [[nodiscard]] inline constexpr int size() const noexcept { return count; };
-   [[nodiscard]] int indexOf(T item) const;
-   [[nodiscard]] bool contains(T item) const;
+// Moves the pivot to *first: median of 3 for small ranges, Tukey's ninther above 128 elements. Both leave an
+// element >= pivot near the end so the partition scans below can run unguarded
+template <typename Iterator, typename Compare> void choose_pivot(Iterator first, Iterator last, Compare &comp)
+{
+   int len { static_cast<int>(last - first) };
+   int half { len / 2 };
+   if (len > 128)
+   {
+      algorithms::sort3(first, first + half, last - 1, comp);
+      algorithms::sort3(first + 1, first + (half - 1), last - 2, comp);
+      algorithms::sort3(first + 2, first + (half + 1), last - 3, comp);
+      algorithms::sort3(first + (half - 1), first + half, first + (half + 1), comp);
+      std::iter_swap(first, first + half);
+   }
+   else
+   {
+      algorithms::sort3(first + half, first, last - 1, comp);
+   }
+}
 
- public:
-   string toString(string (*item2str)(T &) = 0) const;
+// Hoare partition around *first. Returns the final pivot position and whether the range was already
+// partitioned (no swaps were needed), which hints that the input is (nearly) sorted
+template <typename Iterator, typename Compare>
+std::pair<Iterator, bool> partition_right(Iterator first, Iterator last, Compare &comp)
+{
+   auto pivot { std::move(*first) };
+   Iterator l { first };
+   Iterator r { last };
 
- public:
-   T &get(int index);
-   void clear() noexcept(std::is_nothrow_destructible_v<T>);
-   void set(int index, T e);
+   while (comp(*++l, pivot))
+   {
+   }
+   if (l - 1 == first)
+   {
+      while (l < r && !comp(*--r, pivot))
+      {
+      }
+   }
+   else
+   {
+      while (!comp(*--r, pivot))
+      {
+      }
+   }
 
- public:
-   Iterator begin() noexcept;
-   Iterator end() noexcept;
+   bool already_partitioned { l >= r };
+   while (l < r)
+   {
+      std::iter_swap(l, r);
+      while (comp(*++l, pivot))
+      {
+      }
+      while (!comp(*--r, pivot))
+      {
+      }
+   }
 
- public:
-   T &operator[](int index);
-   const T &operator[](int index) const;
+   Iterator pivot_pos { l - 1 };
+   *first = std::move(*pivot_pos);
+   *pivot_pos = std::move(pivot);
+   return { pivot_pos, already_partitioned };
+}
 
- public:
-   // watermark my code again
-   template <typename U = T>
-   std::enable_if_t<std::is_arithmetic<U>::value || std::is_same<U, std::string>::value, void> sort()
+// Block partition (Edelkamp & Weiss, BlockQuicksort). Comparison results are written into offset buffers
+// instead of being branched on, then misplaced pairs are swapped in bulk. Only worth it when comparing is
+// cheap and branch misses dominate, i.e. arithmetic keys with the stock comparators
+template <typename Iterator, typename Compare>
+std::pair<Iterator, bool> partition_right_branchless(Iterator first, Iterator last, Compare &comp)
+{
+   constexpr int block { 64 };
+
+   auto pivot { std::move(*first) };
+   Iterator l { first };
+   Iterator r { last };
+
+   while (comp(*++l, pivot))
    {
-      algorithms::sort(this->begin(), this->end());
    }
-   // and again
-   template <typename U = T>
-   std::enable_if_t<!(std::is_arithmetic<U>::value || std::is_same<U, std::string>::value), void> sort()
+   if (l - 1 == first)
+   {
+      while (l < r && !comp(*--r, pivot))
+      {
+      }
+   }
+   else
    {
+      while (!comp(*--r, pivot))
+      {
+      }
    }
 
+   bool already_partitioned { l >= r };
+   if (!already_partitioned)
+   {
+      std::iter_swap(l, r);
+      ++l;
+
+      alignas(64) unsigned char offsets_l[block];
+      alignas(64) unsigned char offsets_r[block];
+      Iterator base_l { l };
+      Iterator base_r { r };
+      int num_l {}, num_r {}, start_l {}, start_r {};
+
+      while (l < r)
+      {
+         int unknown { static_cast<int>(r - l) };
+         int left_split { num_l == 0 ? (num_r == 0 ? unknown / 2 : unknown) : 0 };
+         int right_split { num_r == 0 ? (unknown - left_split) : 0 };
+
+         int n_left { left_split < block ? left_split : block };
+         for (int i {}; i < n_left; ++i)
+         {
+            offsets_l[num_l] = static_cast<unsigned char>(i);
+            num_l += !comp(*l, pivot);
+            ++l;
+         }
+
+         int n_right { right_split < block ? right_split : block };
+         for (int i {}; i < n_right;)
+         {
+            offsets_r[num_r] = static_cast<unsigned char>(++i);
+            num_r += comp(*--r, pivot);
+         }
+
+         int num { num_l < num_r ? num_l : num_r };
+         if (num > 0)
+         {
+            // cyclic permutation instead of swaps, one move less per pair
+            Iterator a { base_l + offsets_l[start_l] };
+            Iterator b { base_r - offsets_r[start_r] };
+            auto tmp { std::move(*a) };
+            *a = std::move(*b);
+            for (int i { 1 }; i < num; ++i)
+            {
+               a = base_l + offsets_l[start_l + i];
+               *b = std::move(*a);
+               b = base_r - offsets_r[start_r + i];
+               *a = std::move(*b);
+            }
+            *b = std::move(tmp);
+         }
+
+         num_l -= num;
+         num_r -= num;
+         start_l += num;
+         start_r += num;
+         if (num_l == 0)
+         {
+            start_l = 0;
+            base_l = l;
+         }
+         if (num_r == 0)
+         {
+            start_r = 0;
+            base_r = r;
+         }
+      }
+
+      // whatever is left over in one buffer goes to the boundary one by one
+      if (num_l)
+      {
+         while (num_l--)
+         {
+            std::iter_swap(base_l + offsets_l[start_l + num_l], --r);
+         }
+         l = r;
+      }
+      if (num_r)
+      {
+         while (num_r--)
+         {
+            std::iter_swap(base_r - offsets_r[start_r + num_r], l);
+            ++l;
+         }
+         r = l;
+      }
+   }
+
+   Iterator pivot_pos { l - 1 };
+   *first = std::move(*pivot_pos);
+   *pivot_pos = std::move(pivot);
+   return { pivot_pos, already_partitioned };
+}
+
+// Dijkstra three-way partition around *first: [first, lt) < pivot, [lt, gt) == pivot, [gt, last) > pivot. The
+// pivot stays at first until the end, so nothing is copied and move-only types sort too
+template <typename Iterator, typename Compare>
+std::pair<Iterator, Iterator> partition3(Iterator first, Iterator last, Compare &comp)
+{
+   Iterator lt { first + 1 };
+   Iterator i { first + 1 };
+   Iterator gt { last };
+
+   while (i < gt)
+   {
+      if (comp(*i, *first))
+      {
+         std::iter_swap(lt++, i++);
+      }
+      else if (comp(*first, *i))
+      {
+         std::iter_swap(i, --gt);
+      }
+      else
+      {
+         ++i;
+      }
+   }
+   std::iter_swap(first, --lt);
+   return { lt, gt };
+}
+
+// Quickselect: afterwards *nth is what a full sort would put there, nothing before it ranks higher and nothing
+// after it lower. Three-way partitioning keeps duplicate-heavy ranges linear
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
+void nth_element(Iterator first, Iterator nth, Iterator last, Compare comp = Compare())
+{
+   while (last - first > 24)
+   {
+      algorithms::choose_pivot(first, last, comp);
+      std::pair<Iterator, Iterator> eq { algorithms::partition3(first, last, comp) };
+      if (nth < eq.first)
+      {
+         last = eq.first;
+      }
+      else if (nth >= eq.second)
+      {
+         first = eq.second;
+      }
+      else
+      {
+         return;
+      }
+   }
+   algorithms::insertion_sort(first, last, comp);
+}
+
+// Insertion sort that gives up after moving more than a handful of elements. Returns whether it finished
+template <typename Iterator, typename Compare> bool partial_insertion_sort(Iterator first, Iterator last, Compare &comp)
+{
+   if (first == last)
+   {
+      return true;
+   }
+
+   int moved {};
+   for (Iterator cur { first + 1 }; cur != last; ++cur)
+   {
+      Iterator sift { cur };
+      Iterator sift_1 { cur - 1 };
+      if (comp(*sift, *sift_1))
+      {
+         auto tmp { std::move(*sift) };
+         do
+         {
+            *sift-- = std::move(*sift_1);
+         } while (sift != first && comp(tmp, *--sift_1));
+         *sift = std::move(tmp);
+         moved += static_cast<int>(cur - sift);
+      }
+      if (moved > 8)
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Ranges at least this long are split across threads
+constexpr int parallel_sort_threshold { 1 << 15 };
+
+// Pattern-defeating quicksort (Peters). bad_allowed counts how many badly unbalanced partitions are tolerated
+// before falling back to heap sort, leftmost says whether *(first - 1) is a previous pivot. threads > 1 lets the
+// left half of a large partition run on its own thread
+template <typename Iterator, typename Compare>
+void pdqsort_loop(Iterator first, Iterator last, Compare comp, int bad_allowed, bool leftmost, int threads)
+{
+   using T = typename std::iterator_traits<Iterator>::value_type;
+   constexpr bool branchless { std::is_arithmetic_v<T> &&
+                               (std::is_same_v<Compare, std::less<T>> || std::is_same_v<Compare, std::greater<T>>) };
+
+   while (true)
+   {
+      int len { static_cast<int>(last - first) };
+      if (len < 24)
+      {
+         algorithms::insertion_sort(first, last, comp);
+         return;
+      }
+
+      algorithms::choose_pivot(first, last, comp);
+
+      // the pivot equals the previous one, so this range is full of duplicates of it: split them off once
+      // instead of partitioning them over and over
+      if (!leftmost && !comp(*(first - 1), *first))
+      {
+         std::pair<Iterator, Iterator> eq { algorithms::partition3(first, last, comp) };
+         if (eq.first - first > 1)
+         {
+            algorithms::pdqsort_loop(first, eq.first, comp, bad_allowed, leftmost, 1);
+         }
+         first = eq.second;
+         continue;
+      }
+
+      std::pair<Iterator, bool> part { [&]() {
+         if constexpr (branchless)
+         {
+            return algorithms::partition_right_branchless(first, last, comp);
+         }
+         else
+         {
+            return algorithms::partition_right(first, last, comp);
+         }
+      }() };
+      Iterator pivot_pos { part.first };
+
+      int l_len { static_cast<int>(pivot_pos - first) };
+      int r_len { static_cast<int>(last - (pivot_pos + 1)) };
+
+      if (l_len < len / 8 || r_len < len / 8)
+      {
+         if (--bad_allowed == 0)
+         {
+            algorithms::heap_sort(first, last, comp);
+            return;
+         }
+
+         // shuffle a few elements around to break up whatever pattern produced the bad split
+         if (l_len >= 24)
+         {
+            std::iter_swap(first, first + l_len / 4);
+            std::iter_swap(pivot_pos - 1, pivot_pos - l_len / 4);
+         }
+         if (r_len >= 24)
+         {
+            std::iter_swap(pivot_pos + 1, pivot_pos + (1 + r_len / 4));
+            std::iter_swap(last - 1, last - r_len / 4);
+         }
+      }
+      else if (part.second && algorithms::partial_insertion_sort(first, pivot_pos, comp) &&
+               algorithms::partial_insertion_sort(pivot_pos + 1, last, comp))
+      {
+         // no swaps and both halves nearly sorted, the input was already in order
+         return;
+      }
+
+      if (threads > 1 && len >= parallel_sort_threshold)
+      {
+         // the comparator is copied into the worker, so it must be safe to call concurrently
+         std::future<void> left { std::async(std::launch::async, [=]() {
+            algorithms::pdqsort_loop(first, pivot_pos, comp, bad_allowed, leftmost, threads / 2);
+         }) };
+         algorithms::pdqsort_loop(pivot_pos + 1, last, comp, bad_allowed, false, threads - threads / 2);
+         left.get();
+         return;
+      }
+
+      algorithms::pdqsort_loop(first, pivot_pos, comp, bad_allowed, leftmost, 1);
+      first = pivot_pos + 1;
+      leftmost = false;
+   }
+}
+
+// Sort with an explicit thread budget, threads <= 1 stays on the calling thread
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
+void parallel_sort(Iterator first, Iterator last, int threads, Compare comp = Compare())
+{
+   int len { static_cast<int>(last - first) };
+   if (len < 2)
+   {
+      return;
+   }
+   int bad_allowed {};
+   for (int n { len }; n > 0; n >>= 1)
+   {
+      bad_allowed++;
+   }
+   algorithms::pdqsort_loop(first, last, comp, bad_allowed, true, threads);
+}
+
+// Public sort function, large ranges are spread over every hardware thread
+template <typename Iterator, typename Compare = std::less<typename std::iterator_traits<Iterator>::value_type>>
+void sort(Iterator first, Iterator last, Compare comp = Compare())
+{
+   int threads { 1 };
+   if (last - first >= parallel_sort_threshold)
+   {
+      threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+   }
+   algorithms::parallel_sort(first, last, threads, comp);
+}
+// Integer keys and IEEE-754 floats can be sorted by their bytes instead of by comparisons
+template <typename T>
+constexpr bool radix_sortable { (std::is_integral_v<T> && !std::is_same_v<T, bool>) || std::is_same_v<T, float> ||
+                                std::is_same_v<T, double> };
+
+// Below this many elements the histogram passes cost more than a comparison sort
+constexpr int radix_sort_threshold { 512 };
+
+// Maps a key to an unsigned integer with the same ordering: signed integers get the sign bit flipped, floats get
+// every bit flipped when negative and just the sign bit flipped otherwise. -0.0 ends up before +0.0
+template <typename T> auto radix_key(T v) noexcept
+{
+   using U = std::conditional_t<sizeof(T) == 1, uint8_t,
+                                std::conditional_t<sizeof(T) == 2, uint16_t,
+                                                   std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>>;
+   constexpr U sign { static_cast<U>(U { 1 } << (sizeof(T) * 8 - 1)) };
+
+   U bits;
+   std::memcpy(&bits, &v, sizeof(T));
+   if constexpr (std::is_floating_point_v<T>)
+   {
+      return static_cast<U>((bits & sign) ? ~bits : (bits | sign));
+   }
+   else if constexpr (std::is_signed_v<T>)
+   {
+      return static_cast<U>(bits ^ sign);
+   }
+   else
+   {
+      return bits;
+   }
+}
+
+// LSD radix sort on 8-bit digits. All histograms come out of a single pass, and digits every key shares are
+// skipped, so small integers in a wide type only pay for the bytes that differ
+template <typename T> void radix_sort(T *first, T *last)
+{
+   static_assert(radix_sortable<T>, "radix_sort needs an integer, float or double key");
+   constexpr int bytes { static_cast<int>(sizeof(T)) };
+
+   int len { static_cast<int>(last - first) };
+   if (len < 2)
+   {
+      return;
+   }
+
+   int counts[bytes][256] {};
+   for (T *p { first }; p != last; ++p)
+   {
+      auto key { algorithms::radix_key(*p) };
+      for (int b {}; b < bytes; ++b)
+      {
+         counts[b][(key >> (b * 8)) & 0xFF]++;
+      }
+   }
+
+   std::unique_ptr<T[]> scratch { new T[len] };
+   T *src { first };
+   T *dst { scratch.get() };
+
+   for (int b {}; b < bytes; ++b)
+   {
+      int *count { counts[b] };
+      if (count[(algorithms::radix_key(*first) >> (b * 8)) & 0xFF] == len)
+      {
+         continue;
+      }
+
+      int offset {};
+      for (int d {}; d < 256; ++d)
+      {
+         int c { count[d] };
+         count[d] = offset;
+         offset += c;
+      }
+      for (int i {}; i < len; ++i)
+      {
+         dst[count[(algorithms::radix_key(src[i]) >> (b * 8)) & 0xFF]++] = src[i];
+      }
+      std::swap(src, dst);
+   }
+
+   if (src != first)
+   {
+      std::memcpy(first, src, len * sizeof(T));
+   }
+}
+
+// Character of s at depth as an unsigned value, -1 past the end so shorter strings sort first
+inline int string_char_at(const std::string &s, std::size_t depth) noexcept
+{
+   return depth < s.size() ? static_cast<unsigned char>(s[depth]) : -1;
+}
+
+// Multikey quicksort (Bentley & Sedgewick): three-way partition on one character at a time, so shared prefixes
+// are looked at once per level instead of once per comparison
+inline void multikey_quicksort(std::string *first, std::string *last, std::size_t depth = 0)
+{
+   while (last - first > 16)
+   {
+      std::string *mid { first + (last - first) / 2 };
+      int a { algorithms::string_char_at(*first, depth) };
+      int b { algorithms::string_char_at(*mid, depth) };
+      int c { algorithms::string_char_at(*(last - 1), depth) };
+      int pivot { std::max(std::min(a, b), std::min(std::max(a, b), c)) };
+
+      std::string *lt { first };
+      std::string *i { first };
+      std::string *gt { last };
+      while (i < gt)
+      {
+         int ch { algorithms::string_char_at(*i, depth) };
+         if (ch < pivot)
+         {
+            std::swap(*lt++, *i++);
+         }
+         else if (ch > pivot)
+         {
+            std::swap(*i, *--gt);
+         }
+         else
+         {
+            ++i;
+         }
+      }
+
+      algorithms::multikey_quicksort(first, lt, depth);
+      if (pivot >= 0)
+      {
+         algorithms::multikey_quicksort(lt, gt, depth + 1);
+      }
+      first = gt;
+   }
+
+   algorithms::insertion_sort(first, last, [depth](const std::string &x, const std::string &y) {
+      return x.compare(std::min(depth, x.size()), std::string::npos, y, std::min(depth, y.size()), std::string::npos) < 0;
+   });
+}
+// this is clangd doings
+// Non-owning view of count contiguous elements (std::span is C++20). span<T> converts to span<const T>
+template <typename T> class span
+{
+ private:
+   T *ptr;
+   int count;
+
+ public:
+   constexpr span() noexcept : ptr { nullptr }, count {} {}
+   constexpr span(T *ptr, int count) noexcept : ptr { ptr }, count { count } {}
+
+   template <typename U, typename = std::enable_if_t<std::is_same_v<const U, T>>>
+   constexpr span(const span<U> &other) noexcept : ptr { other.data() }, count { other.size() }
+   {
+   }
+
+   [[nodiscard]] constexpr T *data() const noexcept { return ptr; }
+   [[nodiscard]] constexpr int size() const noexcept { return count; }
+   [[nodiscard]] constexpr bool empty() const noexcept { return count == 0; }
+   constexpr T &operator[](int i) const noexcept { return ptr[i]; }
+   constexpr T *begin() const noexcept { return ptr; }
+   constexpr T *end() const noexcept { return ptr + count; }
+};
+
+// Calls body(begin, end) over [0, n) in chunks of `chunk`, handed out dynamically to `threads` workers (the calling
+// thread is one of them) so uneven chunks balance out. The first exception thrown by a body is rethrown here
+template <typename Body> void parallel_for(int n, int threads, int chunk, Body body)
+{
+   chunk = std::max(chunk, 1);
+   int chunks { n / chunk + (n % chunk != 0) };
+   threads = std::min(threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency())),
+                      chunks);
+   if (threads <= 1)
+   {
+      for (int c {}; c < chunks; c++)
+      {
+         body(c * chunk, c + 1 == chunks ? n : (c + 1) * chunk);
+      }
+      return;
+   }
+
+   std::atomic<int> next { 0 };
+   std::atomic<bool> failed { false };
+   auto worker { [&]() {
+      for (int c { next++ }; c < chunks && !failed; c = next++)
+      {
+         try
+         {
+            body(c * chunk, c + 1 == chunks ? n : (c + 1) * chunk);
+         }
+         catch (...)
+         {
+            failed = true;
+            throw;
+         }
+      }
+   } };
+
+   std::future<void> *helpers { new std::future<void>[threads - 1] };
+   for (int t {}; t < threads - 1; t++)
+   {
+      helpers[t] = std::async(std::launch::async, worker);
+   }
+   std::exception_ptr error {};
+   try
+   {
+      worker();
+   }
+   catch (...)
+   {
+      error = std::current_exception();
+   }
+   for (int t {}; t < threads - 1; t++)
+   {
+      try
+      {
+         helpers[t].get();
+      }
+      catch (...)
+      {
+         if (!error)
+         {
+            error = std::current_exception();
+         }
+      }
+   }
+   delete[] helpers;
+   if (error)
+   {
+      std::rethrow_exception(error);
+   }
+}
+} // namespace algorithms
+
+// Growth curve for ArrayList, specialize it for an element type that wants a different one. required is the
+// capacity the caller needs right now, the result must be at least that
+template <class T> struct ArrayListGrowth
+{
+   static int next(int capacity, int required) noexcept
+   {
+      long long grown { capacity + capacity / 2LL };
+      if (grown > INT_MAX)
+      {
+         grown = INT_MAX;
+      }
+      return grown > required ? static_cast<int>(grown) : required;
+   }
+};
+
+// ArrayList iterators walk a raw pointer by default so range-for and algorithms::sort compile down to plain
+// array loops, define ARRAYLIST_CHECKED_ITERATOR to get the bounds-checked cursor iterator back for debugging
+#if defined(TESTING) && !defined(ARRAYLIST_CHECKED_ITERATOR)
+#define ARRAYLIST_CHECKED_ITERATOR
+#endif
+
+template <class T> class ArrayList
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   T *data;
+   int capacity;
+   int count;
+
+   void ensureCapacity(int cap);
+   void reallocate(int newCapacity);
+
+   // trivially copyable elements live in malloc memory so growing can realloc (which mremaps huge buffers)
+   // instead of moving element by element
+   static constexpr bool relocatable { std::is_trivially_copyable_v<T> };
+
+   static T *allocate(int cap)
+   {
+      if constexpr (relocatable)
+      {
+         void *p { std::malloc(std::max(cap, 1) * sizeof(T)) };
+         if (p == nullptr)
+         {
+            throw std::bad_alloc();
+         }
+         return static_cast<T *>(p);
+      }
+      else
+      {
+         return static_cast<T *>(::operator new(cap * sizeof(T)));
+      }
+   }
+
+   static void deallocate(T *p, int cap) noexcept
+   {
+      if constexpr (relocatable)
+      {
+         std::free(p);
+      }
+      else
+      {
+         ::operator delete(p, cap * sizeof(T));
+      }
+   }
+
+ public:
+   class Iterator;
+   friend class Iterator;
+
+ public:
+   explicit ArrayList(int initCapacity = 10);
+   ArrayList(const ArrayList<T> &other) noexcept(std::is_nothrow_copy_constructible_v<T>);
+   ArrayList(ArrayList<T> &&other) noexcept;
+   ~ArrayList() noexcept;
+
+ public:
+   ArrayList<T> &operator=(const ArrayList<T> &other)
+
+       noexcept(std::is_nothrow_copy_constructible_v<T> && std::is_nothrow_copy_assignable_v<T>);
+
+   ArrayList<T> &operator=(ArrayList<T> &&other) noexcept;
+
+ public:
+   // bad habit, this could serve as watermark tho
+   ArrayList(const std::initializer_list<T> &init) noexcept(std::is_nothrow_copy_constructible_v<T>)
+
+       : count { static_cast<int>(init.size()) }
+   {
+      this->capacity = ((this->count + 1) * 1.5);
+      this->data = allocate(this->capacity);
+
+      T *p { this->data };
+      for (const T &v : init)
+      {
+         new (p++) T { v };
+      }
+   }
+
+   ArrayList<T> &operator=(const std::initializer_list<T> &init)
+
+       noexcept(std::is_nothrow_copy_constructible_v<T>)
+   {
+      for (int i = 0; i < count; ++i)
+      {
+         data[i].~T();
+      }
+      deallocate(data, capacity);
+
+      this->count = static_cast<int>(init.size());
+      this->capacity = (count + 1) * 1.5;
+      this->data = allocate(capacity);
+
+      T *p { this->data };
+      for (const T &v : init)
+      {
+         new (p++) T { v };
+      }
+
+      return *this;
+   }
+
+ public:
+   // quality of life stuff
+   friend std::ostream &operator<<(std::ostream &os, const ArrayList<T> &list) noexcept
+   {
+      os << list.toString();
+      return os;
+   }
+
+ public:
+   [[nodiscard]] friend bool operator==(const ArrayList<T> &lhs, const ArrayList<T> &rhs) noexcept
+   {
+      if (&rhs == &lhs)
+      {
+         return true;
+      }
+      if (lhs.count != rhs.count)
+      {
+         return false;
+      }
+      for (int i {}; i < lhs.count; i++)
+      {
+         if (!(lhs.data[i] == rhs.data[i]))
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   [[nodiscard]] friend bool operator!=(const ArrayList<T> &lhs, const ArrayList<T> &rhs) noexcept
+   {
+      return !(lhs == rhs);
+   }
+
+ public:
+   void add(const T &e);
+   void add(T &&e);
+   void add(int index, const T &e);
+   void add(int index, T &&e);
+   T removeAt(int index);
+
+   // construct in place, args may alias an element of this list
+   template <typename... Args> T &emplace_back(Args &&...args)
+   {
+      if (this->count >= this->capacity)
+      {
+         T tmp(std::forward<Args>(args)...);
+         ensureCapacity(this->count + 1);
+         new (&this->data[this->count]) T(std::move(tmp));
+      }
+      else
+      {
+         new (&this->data[this->count]) T(std::forward<Args>(args)...);
+      }
+      return this->data[this->count++];
+   }
+
+   template <typename... Args> T &emplace(int index, Args &&...args)
+   {
+      if (index > count || index < 0)
+      {
+         throw std::out_of_range("Index is invalid!");
+      }
+      if (index == count)
+      {
+         return emplace_back(std::forward<Args>(args)...);
+      }
+
+      T tmp(std::forward<Args>(args)...);
+      ensureCapacity(this->count + 1);
+
+      // the slot past the end is raw storage, so it gets constructed rather than assigned
+      new (&this->data[this->count]) T(std::move(this->data[this->count - 1]));
+      std::move_backward(&this->data[index], &this->data[this->count - 1], &this->data[this->count]);
+      this->data[index] = std::move(tmp);
+
+      this->count++;
+      return this->data[index];
+   }
+
+ public:
+   // grows straight to cap in one reallocation, ahead of a known number of adds
+   void reserve(int cap);
+   void shrink_to_fit();
+   // cuts the list to n elements or appends copies of fill until it has n
+   void resize(int n, const T &fill = T());
+   [[nodiscard]] inline constexpr int getCapacity() const noexcept { return capacity; };
+
+ public:
+   // most definitely wants these to not be discarded
+   [[nodiscard]] inline constexpr bool empty() const noexcept { return count == 0; };
+   [[nodiscard]] inline constexpr int size() const noexcept { return count; };
+   [[nodiscard]] int indexOf(const T &item) const;
+   [[nodiscard]] bool contains(const T &item) const;
+
+ public:
+   string toString(string (*item2str)(T &) = 0) const;
+
+ public:
+   T &get(int index);
+   void clear() noexcept(std::is_nothrow_destructible_v<T>);
+   void set(int index, T e);
+
+ public:
+#ifdef ARRAYLIST_CHECKED_ITERATOR
+   Iterator begin() noexcept;
+   Iterator end() noexcept;
+#else
+   Iterator begin() noexcept { return Iterator { this->data }; }
+   Iterator end() noexcept { return Iterator { this->data + this->count }; }
+#endif
+
+ public:
+   T &operator[](int index);
+   const T &operator[](int index) const;
+
+ public:
+   // contiguous storage for kernels that want a plain pointer, valid until the next insert or clear
+   [[nodiscard]] inline T *rawData() noexcept { return this->data; }
+   [[nodiscard]] inline const T *rawData() const noexcept { return this->data; }
+
+ public:
+   // watermark my code again
+   template <typename U = T>
+   std::enable_if_t<std::is_arithmetic<U>::value || std::is_same<U, std::string>::value, void> sort()
+   {
+      if constexpr (algorithms::radix_sortable<U>)
+      {
+         if (this->count >= algorithms::radix_sort_threshold)
+         {
+            algorithms::radix_sort(this->data, this->data + this->count);
+            return;
+         }
+      }
+      else if constexpr (std::is_same<U, std::string>::value)
+      {
+         algorithms::multikey_quicksort(this->data, this->data + this->count);
+         return;
+      }
+      algorithms::sort(this->begin(), this->end());
+   }
+   // and again
+   template <typename U = T>
+   std::enable_if_t<!(std::is_arithmetic<U>::value || std::is_same<U, std::string>::value), void> sort()
+   {
+   }
+
+ public:
+#ifdef ARRAYLIST_CHECKED_ITERATOR
+   // Inner class Iterator
+   class Iterator
+   {
+#ifdef TESTING
+      friend class TestHelper;
+#endif
+    private:
+      int cursor;
+      ArrayList<T> *pList;
+
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = T *;
+      using reference = T &;
+
+    public:
+      Iterator(ArrayList<T> *pList = nullptr, int index = 0);
+      Iterator(const Iterator &other) noexcept = default;
+      Iterator &operator=(const Iterator &other) noexcept; // Deep Copy
+    public:
+      Iterator &operator++();
+      Iterator operator++(int);
+      Iterator &operator--();
+      Iterator operator--(int);
+
+      [[nodiscard]] T &operator*();
+
+    public:
+      Iterator &operator+=(int n);
+      Iterator &operator-=(int n);
+      [[nodiscard]] Iterator operator+(int n) const;
+      [[nodiscard]] Iterator operator-(int n) const;
+
+    public:
+      [[nodiscard]] int operator-(const Iterator &other) const;
+      [[nodiscard]] bool operator==(const Iterator &other) const noexcept;
+      [[nodiscard]] bool operator!=(const Iterator &other) const noexcept;
+
+    public:
+      [[nodiscard]] bool operator<(const Iterator &other) const noexcept;
+      [[nodiscard]] bool operator<=(const Iterator &other) const noexcept;
+      [[nodiscard]] bool operator>(const Iterator &other) const noexcept;
+      [[nodiscard]] bool operator>=(const Iterator &other) const noexcept;
+
+    public:
+      [[nodiscard]] T &operator[](int n) const;
+   };
+#else
+   // Inner class Iterator, unchecked
+   class Iterator
+   {
+    private:
+      T *ptr;
+
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = T *;
+      using reference = T &;
+
+    public:
+      explicit Iterator(T *ptr = nullptr) noexcept : ptr { ptr } {}
+      Iterator(ArrayList<T> *pList, int index) noexcept : ptr { pList->data + index } {}
+
+    public:
+      Iterator &operator++() noexcept { ++ptr; return *this; }
+      Iterator operator++(int) noexcept { return Iterator { ptr++ }; }
+      Iterator &operator--() noexcept { --ptr; return *this; }
+      Iterator operator--(int) noexcept { return Iterator { ptr-- }; }
+
+      [[nodiscard]] T &operator*() const noexcept { return *ptr; }
+      [[nodiscard]] T *operator->() const noexcept { return ptr; }
+
+    public:
+      Iterator &operator+=(int n) noexcept { ptr += n; return *this; }
+      Iterator &operator-=(int n) noexcept { ptr -= n; return *this; }
+      [[nodiscard]] Iterator operator+(int n) const noexcept { return Iterator { ptr + n }; }
+      [[nodiscard]] Iterator operator-(int n) const noexcept { return Iterator { ptr - n }; }
+
+    public:
+      [[nodiscard]] int operator-(const Iterator &other) const noexcept { return static_cast<int>(ptr - other.ptr); }
+      [[nodiscard]] bool operator==(const Iterator &other) const noexcept { return ptr == other.ptr; }
+      [[nodiscard]] bool operator!=(const Iterator &other) const noexcept { return ptr != other.ptr; }
+
+    public:
+      [[nodiscard]] bool operator<(const Iterator &other) const noexcept { return ptr < other.ptr; }
+      [[nodiscard]] bool operator<=(const Iterator &other) const noexcept { return ptr <= other.ptr; }
+      [[nodiscard]] bool operator>(const Iterator &other) const noexcept { return ptr > other.ptr; }
+      [[nodiscard]] bool operator>=(const Iterator &other) const noexcept { return ptr >= other.ptr; }
+
+    public:
+      [[nodiscard]] T &operator[](int n) const noexcept { return ptr[n]; }
+   };
+#endif
+};
+
+// =====================================
+// Class SinglyLinkedList
+// =====================================
+template <class T> class SinglyLinkedList
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   class Node
+   {
+    public:
+      T data;
+      Node *next;
+
+      Node() : data(), next(nullptr) {}
+      Node(const T &data, Node *next = nullptr) : data(data), next(next) {}
+      Node(T &&data, Node *next = nullptr) : data(std::move(data)), next(next) {}
+
+      template <typename... Args>
+      Node(std::in_place_t, Node *next, Args &&...args) : data(std::forward<Args>(args)...), next(next)
+      {
+      }
+   };
+
+   Node **linkAt(int index) noexcept;
+   void linkNode(Node **prev, Node *node) noexcept;
+
+   Node *head;
+   Node *tail;
+   int count;
+
+ public:
+   // every element sits in its own allocation of this size
+   static constexpr std::size_t NODE_BYTES { sizeof(Node) };
+
+   class Iterator;
+   friend class Iterator;
+
+   using SList = SinglyLinkedList;
+
+ public:
+   SinglyLinkedList() noexcept;
+   ~SinglyLinkedList() noexcept;
+
+   SinglyLinkedList(const SinglyLinkedList<T> &other)
+
+       noexcept(std::is_nothrow_copy_constructible_v<T> && std::is_nothrow_copy_assignable_v<T>)
+       : head { nullptr }, tail { nullptr }, count {}
+   {
+      Node *current { other.head };
+      while (current)
+      {
+         add(current->data);
+         current = current->next;
+      }
+   }
+
+   SinglyLinkedList(SinglyLinkedList<T> &&other) noexcept
+       : head { other.head }, tail { other.tail }, count { other.count }
+   {
+      other.head = other.tail = nullptr;
+      other.count = 0;
+   }
+
+   SinglyLinkedList &operator=(const SinglyLinkedList<T> &other)
+   {
+      if (this != &other)
+      {
+         SinglyLinkedList<T> tmp { other };
+         *this = std::move(tmp);
+      }
+      return *this;
+   }
+
+   SinglyLinkedList &operator=(SinglyLinkedList<T> &&other) noexcept
+   {
+      if (this != &other)
+      {
+         clear();
+         this->head = other.head;
+         this->tail = other.tail;
+         this->count = other.count;
+         other.head = other.tail = nullptr;
+         other.count = 0;
+      }
+      return *this;
+   }
+
+ public:
+   SinglyLinkedList(const std::initializer_list<T> &init) noexcept(std::is_nothrow_copy_constructible_v<T>)
+
+       : head { nullptr }, tail { nullptr }, count {}
+   {
+      for (const T &v : init)
+      {
+         add(v);
+      }
+   }
+
+   SinglyLinkedList &operator=(const std::initializer_list<T> &init)
+
+       noexcept(std::is_nothrow_copy_constructible_v<T>)
+   {
+      clear();
+
+      for (const T &v : init)
+      {
+         add(v);
+      }
+
+      return *this;
+   }
+
+   [[nodiscard]] friend bool operator==(const SinglyLinkedList<T> &lhs, const SinglyLinkedList<T> &rhs)
+
+       noexcept
+   {
+      if (&lhs == &rhs)
+      {
+         return true;
+      }
+
+      if (lhs.count != rhs.count)
+      {
+         return false;
+      }
+
+      Node *n1 { lhs.head };
+      Node *n2 { rhs.head };
+
+      while (n1 != nullptr && n2 != nullptr)
+      {
+         if (!(n1->data == n2->data))
+         {
+            return false;
+         }
+
+         n1 = n1->next;
+         n2 = n2->next;
+      }
+
+      return true;
+   }
+
+   [[nodiscard]] friend bool operator!=(const SinglyLinkedList<T> &lhs, const SinglyLinkedList<T> &rhs)
+
+       noexcept
+   {
+      return !(lhs == rhs);
+   }
+
+ public:
+   friend std::ostream &operator<<(std::ostream &os, const SinglyLinkedList<T> &list) noexcept
+   {
+      os << list.toString();
+      return os;
+   }
+
+ public:
+   [[nodiscard]] constexpr inline bool empty() const noexcept { return this->count == 0; }
+   [[nodiscard]] constexpr inline int size() const noexcept { return this->count; }
+   [[nodiscard]] int indexOf(const T &item) const;
+   [[nodiscard]] bool contains(const T &item) const;
+
+ public:
+   void add(const T &e);
+   void add(T &&e);
+   void add(int index, const T &e);
+   void add(int index, T &&e);
+
+   template <typename... Args> T &emplace_back(Args &&...args)
+   {
+      Node *node { new Node { std::in_place, nullptr, std::forward<Args>(args)... } };
+      linkNode(this->tail ? &this->tail->next : &this->head, node);
+      return node->data;
+   }
+
+   template <typename... Args> T &emplace(int index, Args &&...args)
+   {
+      if (index < 0 || index > count)
+      {
+         throw std::out_of_range("Index is invalid!");
+      }
+      Node **prev { linkAt(index) };
+      Node *node { new Node { std::in_place, *prev, std::forward<Args>(args)... } };
+      linkNode(prev, node);
+      return node->data;
+   }
+
+ public:
+   T removeAt(int index);
+   bool removeItem(const T &item);
+   void clear() noexcept(std::is_nothrow_destructible_v<T>);
+
+   // cuts the list to n elements or appends copies of fill until it has n, one walk either way
+   void resize(int n, const T &fill = T());
+
+ public:
+   T &get(int index);
+
+   // copies up to n leading elements into out, returns how many were copied
+   int copyTo(T *out, int n) const;
+
+   // overwrites up to n leading elements from in, returns how many were written
+   int copyFrom(const T *in, int n);
+
+ public:
+   string toString(string (*item2str)(T &) = 0) const;
+
+ public:
+   Iterator begin() noexcept;
+   Iterator end() noexcept;
+
+   // Inner class Iterator
+   class Iterator
+   {
+#ifdef TESTING
+      friend class TestHelper;
+#endif
+    private:
+      Node *current;
+
+    public:
+      Iterator(Node *node = nullptr) noexcept;
+      Iterator &operator=(const Iterator &other) noexcept; // Deep Copy
+
+      [[nodiscard]] T &operator*();
+      [[nodiscard]] bool operator!=(const Iterator &other) const noexcept;
+
+      Iterator &operator++();
+      Iterator operator++(int);
+   };
+};
+
+// =====================================
+// Class PointCloud
+// =====================================
+
+// Structure-of-arrays Point storage: x, y and z live in separate 64-byte aligned arrays so bulk geometry runs as
+// straight loops over doubles the compiler can vectorize, instead of one Point call at a time
+class PointCloud
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   double *xs;
+   double *ys;
+   double *zs;
+   int capacity;
+   int count;
+
+   void ensureCapacity(int cap);
+
+ public:
+   explicit PointCloud(int initCapacity = 16);
+   explicit PointCloud(const ArrayList<Point> &points);
+   PointCloud(const PointCloud &other);
+   PointCloud(PointCloud &&other) noexcept;
+   ~PointCloud() noexcept;
+
+   PointCloud &operator=(const PointCloud &other);
+   PointCloud &operator=(PointCloud &&other) noexcept;
+
+ public:
+   [[nodiscard]] inline int size() const noexcept { return count; }
+   [[nodiscard]] inline bool empty() const noexcept { return count == 0; }
+
+   [[nodiscard]] inline const double *xData() const noexcept { return xs; }
+   [[nodiscard]] inline const double *yData() const noexcept { return ys; }
+   [[nodiscard]] inline const double *zData() const noexcept { return zs; }
+
+ public:
+   void add(const Point &p);
+   [[nodiscard]] Point get(int index) const;
+   void set(int index, const Point &p);
+   void clear() noexcept;
+   void reserve(int cap);
+
+   [[nodiscard]] ArrayList<Point> toList() const;
+
+ public:
+   void translate(double dx, double dy, double dz) noexcept;
+   void scale(double factor) noexcept;
+   void scale(double factor, const Point &origin) noexcept;
+
+   // out needs size() slots
+   void distancesTo(const Point &p, double *out) const noexcept;
+   void squaredDistancesTo(const Point &p, double *out) const noexcept;
+
+   // out needs size() * size() slots, row-major and symmetric
+   void pairwiseDistances(double *out) const noexcept;
+
+   [[nodiscard]] int nearestTo(const Point &p) const;
+};
+
+// =====================================
+// Class KDTree
+// =====================================
+
+// Static spatial index over a Point collection, split at the median of the widest axis. Queries answer with indices
+// into the collection it was built from
+class KDTree
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   // nodes are laid out in preorder: a node's left child is the next node, right holds the index of the right one
+   // and is -1 for a leaf. Each node covers order[begin, end)
+   struct Node
+   {
+      int begin;
+      int end;
+      int axis;
+      int right;
+      double split;
+   };
+
+   PointCloud points;
+   ArrayList<int> order;
+   ArrayList<Node> nodes;
+   int leafSize;
+
+   static int nodesFor(int n, int leafSize) noexcept;
+   const double *axisData(int axis) const noexcept;
+
+   void build(int node, int begin, int end, int threads);
+   void nearest(int node, const double *q, algorithms::top_k<double> &best) const;
+   void withinRadius(int node, const double *q, double r, ArrayList<int> &out) const;
+   void inBox(int node, const double *lo, const double *hi, ArrayList<int> &out) const;
+
+ public:
+   // threads <= 0 uses every hardware thread for the build
+   explicit KDTree(const ArrayList<Point> &points, int leafSize = 16, int threads = 0);
+   explicit KDTree(const PointCloud &points, int leafSize = 16, int threads = 0);
+   KDTree(const KDTree &other);
+   KDTree(KDTree &&other) noexcept;
+   ~KDTree() noexcept;
+
+   KDTree &operator=(const KDTree &other);
+   KDTree &operator=(KDTree &&other) noexcept;
+
+ public:
+   [[nodiscard]] inline int size() const noexcept { return points.size(); }
+
+   // k nearest, closest first. Ties go to the smaller index
+   [[nodiscard]] ArrayList<int> nearest(const Point &query, int k) const;
+   [[nodiscard]] int nearest(const Point &query) const;
+
+   // ascending index order, the radius is inclusive
+   [[nodiscard]] ArrayList<int> withinRadius(const Point &center, double radius) const;
+
+   // ascending index order, points on the box boundary are inside
+   [[nodiscard]] ArrayList<int> inBox(const Point &low, const Point &high) const;
+};
+
+// =====================================
+// Class Octree
+// =====================================
+
+// Dynamic counterpart of KDTree: points can be inserted one at a time. Leaves hold up to bucketSize points before
+// they split, and the root cube doubles (rebuilding the tree) when a point lands outside it
+class Octree
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   struct Node
+   {
+      double cx, cy, cz, half;
+      int depth;
+      int child; // first of 8 consecutive children, -1 for a leaf
+      ArrayList<int> items;
+   };
+
+   PointCloud points;
+   ArrayList<Node> nodes;
+   int bucketSize;
+
+   void reset(double cx, double cy, double cz, double half);
+   void insertInto(int index);
+   void subdivide(int node);
+   bool rootContains(const Point &p) const noexcept;
+
+ public:
+   explicit Octree(int bucketSize = 16);
+   explicit Octree(const ArrayList<Point> &points, int bucketSize = 16);
+   Octree(const Octree &other);
+   Octree(Octree &&other) noexcept;
+   ~Octree() noexcept;
+
+   Octree &operator=(const Octree &other);
+   Octree &operator=(Octree &&other) noexcept;
+
+ public:
+   [[nodiscard]] inline int size() const noexcept { return points.size(); }
+
+   // returns the index of the new point
+   int insert(const Point &p);
+
+   [[nodiscard]] ArrayList<int> nearest(const Point &query, int k) const;
+   [[nodiscard]] int nearest(const Point &query) const;
+   [[nodiscard]] ArrayList<int> withinRadius(const Point &center, double radius) const;
+   [[nodiscard]] ArrayList<int> inBox(const Point &low, const Point &high) const;
+};
+
+// =====================================
+// Class PointIndex
+// =====================================
+
+// Hashed Point lookup with the same epsilon semantics as Point::operator==. Points are bucketed on a grid of
+// 2 * EPSILON cells, so anything equal to a query sits in its cell or in the neighbour on the near side of each axis.
+// An axis within rounding of a cell centre takes both neighbours, so up to 27 buckets are probed (usually 8) no
+// matter how many points are stored
+class PointIndex
+{
+#ifdef TESTING
+   friend class TestHelper;
+#endif
+ private:
+   struct Cell
+   {
+      long long kx, ky, kz;
+      int head; // first point in the cell, -1 for an empty slot
+      int tail;
+   };
+
+   ArrayList<Point> points;
+   ArrayList<int> next; // chains the points of a cell in insertion order
+   Cell *table;
+   int tableSize; // power of two
+   int cells;
+
+   static long long cellKey(double v) noexcept;
+   static int cellCandidates(double v, long long *keys) noexcept;
+   static std::size_t hashCell(long long kx, long long ky, long long kz) noexcept;
+
+   int findSlot(long long kx, long long ky, long long kz) const noexcept;
+   void link(int index);
+   void rehash(int newSize);
+
+ public:
+   explicit PointIndex(int initCapacity = 16);
+   explicit PointIndex(const ArrayList<Point> &points);
+   PointIndex(const PointIndex &other);
+   PointIndex(PointIndex &&other) noexcept;
+   ~PointIndex() noexcept;
+
+   PointIndex &operator=(PointIndex other) noexcept;
+
+ public:
+   [[nodiscard]] inline int size() const noexcept { return points.size(); }
+   [[nodiscard]] inline bool empty() const noexcept { return points.empty(); }
+   [[nodiscard]] const Point &get(int index) const { return points[index]; }
+
+   // returns the index of the new point
+   int add(const Point &p);
+
+   // index of the equal point already stored, or of p after adding it
+   int addUnique(const Point &p);
+
+   // same answer as ArrayList<Point>::indexOf over the points in insertion order
+   [[nodiscard]] int indexOf(const Point &p) const;
+   [[nodiscard]] bool contains(const Point &p) const;
+
+   // first occurrence of every point, in order
+   [[nodiscard]] static ArrayList<Point> dedup(const ArrayList<Point> &points);
+};
+
+// =====================================
+// Class TextNormalizer
+// =====================================
+
+// Text cleanup ahead of the embedding: ASCII letters are lowercased, runs of ASCII whitespace and punctuation
+// collapse to one space, and everything else (digits, UTF-8 sequences) is kept as is. Invalid UTF-8 becomes
+// U+FFFD. Input is scanned 8 bytes at a time with SWAR tricks while it stays plain ASCII; the output buffer is
+// kept between calls, so the returned view is only good until the next normalize()
+class TextNormalizer
+{
+ private:
+   std::unique_ptr<char[]> buffer;
+   size_t capacity;
+
+ public:
+   TextNormalizer() : buffer {}, capacity {} {}
+
+   std::string_view normalize(std::string_view text);
+
+   // well-formed UTF-8: no overlongs, surrogates or code points past U+10FFFF
+   [[nodiscard]] static bool validUtf8(std::string_view text) noexcept;
+
+   // in place, bytes >= 0x80 are left alone
+   static void toLowerAscii(char *text, size_t length) noexcept;
+
+   // calls fn(token) for each space separated token of normalize()'s output
+   template <typename Fn> static void forEachToken(std::string_view normalized, Fn fn)
+   {
+      size_t start {};
+      while (start < normalized.size())
+      {
+         size_t end { normalized.find(' ', start) };
+         if (end == std::string_view::npos)
+         {
+            end = normalized.size();
+         }
+         fn(normalized.substr(start, end - start));
+         start = end + 1;
+      }
+   }
+};
+
+// =====================================
+// Class TextArena
+// =====================================
+
+// Append-only store for raw texts. Texts are packed into blocks of about 32 KiB; once a block fills up it is
+// compressed with an LZ4-style codec (greedy hash matching, LZ4 block layout) and only the compressed bytes are
+// kept. Reads decode the block up to the wanted text into a small LRU cache, so neighbouring texts come back cheaply.
+// A pass reading many texts from several threads gives each thread a Cursor instead, which skips the shared cache.
+// Texts are never rewritten in place. The owner reports the ones it drops through discard, which keeps the live bytes
+// of every block, and moves the survivors out of condemned blocks before releaseCondemned frees them
+class TextArena
+{
+ public:
+   struct Ref
+   {
+      int block;
+      int offset;
+      int length;
+   };
+
+   // One decoded block owned by a reader. Consecutive reads from the same block decode it once, without the cache
+   // lock. Only valid until the arena is cleared
+   class Cursor
+   {
+      friend class TextArena;
+      int block { -1 };
+      std::unique_ptr<char[]> data;
+      int capacity {};
+      int filled {};   // decoded prefix of the block
+      int consumed {}; // compressed bytes read for it
+   };
+
+ private:
+   struct Block
+   {
+      char *data;
+      int size;    // bytes kept
+      int rawSize; // bytes once decompressed
+      bool compressed;
+      int live; // raw bytes of the texts still in use
+      bool condemned;
+   };
+
+   struct CacheSlot
+   {
+      Cursor decoded;
+      uint64_t lastUse {};
+   };
+
+   static constexpr int BLOCK_SIZE { 1 << 15 };
+   static constexpr int CACHE_SLOTS { 4 };
+
+   ArrayList<Block> blocks;
+   char *open; // block being filled, not compressed yet
+   int openSize;
+   int openCapacity;
+   int openLive;
+
+   mutable std::mutex cacheLock;
+   CacheSlot cache[CACHE_SLOTS];
+   uint64_t useClock;
+
+   int64_t storedBytes;
+   int64_t rawBytes;
+
+   void seal();
+   const char *decode(int block, int need, Cursor &into) const;
+
+ public:
+   TextArena();
+   ~TextArena();
+
+   TextArena(const TextArena &) = delete;
+   TextArena &operator=(const TextArena &) = delete;
+
+   Ref append(std::string_view text);
+   // out is overwritten, its capacity is reused
+   void get(const Ref &ref, string &out);
+   void get(const Ref &ref, string &out, Cursor &cursor) const;
+   void clear();
+   // the text is no longer referenced
+   void discard(const Ref &ref) noexcept;
+
+   // Marks the sealed blocks that are more than a fifth garbage and returns how many. Their texts have to be
+   // appended again before releaseCondemned frees them
+   int condemn() noexcept;
+   [[nodiscard]] bool condemned(int block) const noexcept { return block < blocks.size() && blocks[block].condemned; }
+   void releaseCondemned();
+
+   // raw bytes of the texts the blocks hold, garbage included, and what the arena actually holds for them
+   [[nodiscard]] int64_t textBytes() const noexcept { return rawBytes; }
+   [[nodiscard]] int64_t residentBytes() const;
+   // the part of residentBytes held by decoded blocks in the cache
+   [[nodiscard]] int64_t cacheBytes() const;
+   // frees the decoded blocks, the next reads decode again
+   void trimCache();
+
+   // the block codec on its own. compressBound is the worst case for n input bytes
+   [[nodiscard]] static int compressBound(int n) noexcept { return n + n / 255 + 16; }
+   static int compress(const char *in, int n, char *out) noexcept;
+   // false when the input is malformed or would not fill exactly outSize bytes
+   static bool decompress(const char *in, int n, char *out, int outSize) noexcept;
+};
+
+// =====================================
+// Class InvertedIndex
+// =====================================
+
+// BM25 over the tokens TextNormalizer produces. Each document gets an internal number in insertion order, so the
+// postings of a term are sorted by construction and stored as varint (doc delta, term frequency) pairs in blocks
+// of 128 with a skip entry per block. Queries run document-at-a-time with block-max WAND: per-term score bounds
+// pick the first document that could still reach the top k, per-block bounds then check it against the blocks
+// it falls in, and cursors jump over whatever cannot make it without decoding. Removed documents
+// leave dead postings behind that queries skip; like Lucene's deletes they keep counting towards document
+// frequencies and the average length until the index is rebuilt
+class InvertedIndex
+{
+ private:
+   struct Skip
+   {
+      int base;   // doc the first delta of the block is taken from
+      int last;   // last doc in the block
+      int offset; // first byte of the block
+      int count;
+      int maxTf;     // block-max bound: no posting in the block has more
+      int minLength; // or a shorter document
+   };
+
+   struct Term
+   {
+      ArrayList<char> bytes;
+      ArrayList<Skip> skips;
+      int postings; // document frequency, dead documents included
+      int lastDoc;
+      int maxTf;
+      int minLength; // shortest document the term was seen in
+   };
+
+   struct Cursor;
+
+   static constexpr int BLOCK { 128 };
+
+   double k1;
+   double b;
+   std::unordered_map<string, int> dictionary;
+   ArrayList<Term *> terms;
+   ArrayList<int> docKeys;    // internal doc -> key
+   ArrayList<int> docLengths; // in tokens, -1 once removed
+   std::unordered_map<int, int> liveDoc; // key -> internal doc
+   int64_t totalLength;
+
+   int termId(std::string_view token, bool create);
+
+ public:
+   explicit InvertedIndex(double k1 = 1.2, double b = 0.75);
+   ~InvertedIndex();
+
+   InvertedIndex(const InvertedIndex &) = delete;
+   InvertedIndex &operator=(const InvertedIndex &) = delete;
+
+   // text is the raw text, it is normalized here. Adding a key again replaces its document
+   void add(int key, std::string_view text);
+   // does nothing for an unknown key
+   void remove(int key);
+   void clear();
+
+   // The k best keys by BM25 for the query words, best first, ties to the smaller key. Only documents sharing a
+   // word with the query are returned, so fewer than k may come back; returns how many were written
+   int search(std::string_view query, int k, int *keys, double *scores) const;
+
+   [[nodiscard]] int documents() const noexcept { return static_cast<int>(liveDoc.size()); }
+   // removed or replaced documents whose postings are still in the lists
+   [[nodiscard]] int deadDocuments() const noexcept { return docKeys.size() - documents(); }
+   [[nodiscard]] int vocabulary() const noexcept { return terms.size(); }
+   [[nodiscard]] int64_t bytes() const noexcept;
+};
+
+// =====================================
+// Class LshIndex
+// =====================================
+
+// shape of the hash tables behind VectorStore::approximateTopK
+struct LshOptions
+{
+   string metric { "cosine" }; // sign random projections for cosine and, once reduced to cosine, dot; bit sampling
+                               // for hamming, p-stable hashing for the other distances
+   int tables { 8 };
+   int bits { 0 };           // hash functions combined into one table key, 0 means 14 for cosine and hamming, else 6
+   double width { 0 };       // bucket width of the p-stable hashes, 0 estimates it from the stored vectors
+   int probes { 4 };         // neighbouring buckets also looked at per table
+   int candidates { 0 };     // kept by the Hamming filter for exact scoring, 0 means max(10k, 100)
+   uint64_t seed { 0x5eed };
+};
+
+// Locality-sensitive hashing over keyed vectors. Every table hashes a vector with `bits` random projections: their
+// signs for cosine (SimHash), the signs of sampled components for hamming (bit sampling), or floor((a.v + b) / width)
+// with Gaussian a for euclidean and Cauchy a for manhattan. Inner product search reduces to cosine first: a stored
+// x becomes [x, sqrt(M^2 - |x|^2)] and a query [q, 0], with M at least the largest stored norm, so the largest
+// q.x is the smallest angle (Neyshabur and Srebro's simple LSH).
+// A query looks at its own bucket in every table plus the `probes` buckets one hash step away whose boundaries it
+// sits closest to. Each vector also carries a 128-bit SimHash signature; the candidates are ranked by Hamming
+// distance to the query's (popcount) and only the closest go on to exact scoring. Adding or removing a vector
+// touches one bucket per table, nothing is ever trained
+class LshIndex
+{
  public:
-   // Inner class Iterator
-   class Iterator
+   enum Family
    {
-#ifdef TESTING
-      noexcept friend class TestHelper;
-#endif
-    private:
-      int cursor;
-      ArrayList<T> *pList;
+      SimHash,
+      Gaussian,
+      Cauchy,
+      BitSampling, // SimHash over single components, for Hamming on the sign bits
+      Mips,        // SimHash after the inner product to cosine reduction
+   };
 
-    public:
-      using iterator_category = std::random_access_iterator_tag;
-      using value_type = T;
-      using difference_type = std::ptrdiff_t;
-      using pointer = T *;
-      using reference = T &;
+   static constexpr int SIGNATURE_WORDS { 2 };
 
-    public:
-      Iterator(ArrayList<T> *pList = nullptr, int index = 0);
-      Iterator(const Iterator &other) noexcept = default;
-      Iterator &operator=(const Iterator &other) noexcept; // Deep Copy
-    public:
-      Iterator &operator++();
-      Iterator operator++(int);
-      Iterator &operator--();
-      Iterator operator--(int);
+ private:
+   int dimension;
+   Family family;
+   int tables;
+   int bits;
+   double width;
+   int projections; // tables * bits hash functions, then the signature planes
+   std::unique_ptr<float[]> planes; // dimension x projections, so one pass over the vector feeds every projection
+                                    // (one more row, the appended component, for Mips)
+   std::unique_ptr<float[]> offsets; // b of the p-stable hashes
+   double normBound; // M of the Mips reduction
+
+   // vectors live in slots; a freed slot is reused by the next add
+   ArrayList<int> slotKeys; // -1 for a free slot
+   ArrayList<uint64_t> bucketKeys; // tables per slot
+   ArrayList<uint64_t> signatures; // SIGNATURE_WORDS per slot
+   ArrayList<int> freeSlots; // may hold slots past the end once compact dropped them
+   std::unordered_map<int, int> slotOf;
+   std::unordered_map<uint64_t, ArrayList<int>> *buckets; // one map per table, slots inside
+
+   void project(const float *vector, float *out, float appended) const;
+   void dropLastSlot();
+   void dropStaleSlots();
+   uint64_t tableKey(int table, const float *projected, int perturbed, int step) const;
 
-      [[nodiscard]] T &operator*();
+ public:
+   LshIndex(int dimension, Family family, int tables, int bits, double width, uint64_t seed);
+   ~LshIndex();
 
-    public:
-      Iterator &operator+=(int n);
-      Iterator &operator-=(int n);
-      [[nodiscard]] Iterator operator+(int n) const;
-      [[nodiscard]] Iterator operator-(int n) const;
+   LshIndex(const LshIndex &) = delete;
+   LshIndex &operator=(const LshIndex &) = delete;
 
-    public:
-      [[nodiscard]] int operator-(const Iterator &other) const;
-      [[nodiscard]] bool operator==(const Iterator &other) const noexcept;
-      [[nodiscard]] bool operator!=(const Iterator &other) const noexcept;
+   [[nodiscard]] Family hashFamily() const noexcept { return family; }
+   [[nodiscard]] bool signHashes() const noexcept { return family != Gaussian && family != Cauchy; }
 
-    public:
-      [[nodiscard]] bool operator<(const Iterator &other) const noexcept;
-      [[nodiscard]] bool operator<=(const Iterator &other) const noexcept;
-      [[nodiscard]] bool operator>(const Iterator &other) const noexcept;
-      [[nodiscard]] bool operator>=(const Iterator &other) const noexcept;
+   // M of the Mips reduction. Vectors added before a change keep their old hashes, the caller re-adds them
+   [[nodiscard]] double maxNorm() const noexcept { return normBound; }
+   void setMaxNorm(double bound) noexcept { normBound = bound; }
+   [[nodiscard]] int size() const noexcept { return static_cast<int>(slotOf.size()); }
 
-    public:
-      [[nodiscard]] T &operator[](int n) const;
-   };
+   // vector holds dimension floats. Adding a key again rehashes it
+   void add(int key, const float *vector);
+   void remove(int key);
+   void clear();
+   // Moves up to maxMoves live slots into free ones and returns how many it moved, nothing is rehashed. Done once
+   // freeSlotCount is 0
+   int compact(int maxMoves = INT_MAX);
+   [[nodiscard]] int freeSlotCount() const noexcept { return freeSlots.size(); }
+
+   // Keys colliding with query in some probed bucket, at most limit of them, closest signatures first.
+   // keys needs room for limit entries; returns how many were written
+   int candidates(const float *query, int probes, int limit, int *keys) const;
+
+   [[nodiscard]] int64_t bytes() const noexcept;
 };
 
 // =====================================
-// Class SinglyLinkedList
+// Class LatencyHistogram
 // =====================================
-template <class T> class SinglyLinkedList
-{
-#ifdef TESTING
-   friend class TestHelper;
+
+// Built with -DVECTORSTORE_METRICS, otherwise every timer and counter below compiles away
+#ifdef VECTORSTORE_METRICS
+inline constexpr bool vectorStoreMetrics { true };
+#else
+inline constexpr bool vectorStoreMetrics { false };
 #endif
+
+// HDR-style log-linear histogram of nanosecond latencies: exact below 32ns, then 16 buckets per power of two,
+// so any percentile is within ~6% of the true value. Recording is lock free and safe from several threads
+class LatencyHistogram
+{
  private:
-   class Node
-   {
-    public:
-      T data;
-      Node *next;
+   static constexpr int LINEAR { 32 };
+   static constexpr int SUB_BITS { 4 };
+   static constexpr int SUB { 1 << SUB_BITS };
+   static constexpr int BUCKETS { LINEAR + (64 - SUB_BITS - 1) * SUB };
 
-      Node() : data(), next(nullptr) {}
-      Node(const T &data, Node *next = nullptr) : data(data), next(next) {}
-   };
+   std::atomic<uint64_t> counts[BUCKETS];
+   std::atomic<uint64_t> total;
+   std::atomic<uint64_t> sum;
+   std::atomic<uint64_t> minimum;
+   std::atomic<uint64_t> maximum;
 
-   Node *head;
-   Node *tail;
-   int count;
+   static int bucketOf(uint64_t ns) noexcept;
+   static uint64_t lowerBound(int bucket) noexcept;
 
  public:
-   class Iterator;
-   friend class Iterator;
+   LatencyHistogram() noexcept;
 
-   using SList = SinglyLinkedList;
+   void record(uint64_t ns) noexcept;
+   void reset() noexcept;
 
- public:
-   SinglyLinkedList() noexcept;
-   ~SinglyLinkedList() noexcept;
+   [[nodiscard]] uint64_t count() const noexcept { return total.load(std::memory_order_relaxed); }
+   [[nodiscard]] uint64_t sumNs() const noexcept { return sum.load(std::memory_order_relaxed); }
+   [[nodiscard]] uint64_t minNs() const noexcept;
+   [[nodiscard]] uint64_t maxNs() const noexcept { return maximum.load(std::memory_order_relaxed); }
+   [[nodiscard]] double meanNs() const noexcept;
 
-   SinglyLinkedList(const SinglyLinkedList<T> &other)
+   // p in [0, 1], 0 when nothing was recorded
+   [[nodiscard]] uint64_t percentileNs(double p) const noexcept;
+};
 
-       noexcept(std::is_nothrow_copy_constructible_v<T> && std::is_nothrow_copy_assignable_v<T>)
-       : head { nullptr }, tail { nullptr }, count {}
-   {
-      Node *current { other.head };
-      while (current)
-      {
-         add(current->data);
-         current = current->next;
-      }
-   }
+// =====================================
+// Class VectorStoreMetrics
+// =====================================
 
+class VectorStoreMetrics
+{
  public:
-   SinglyLinkedList(const std::initializer_list<T> &init) noexcept(std::is_nothrow_copy_constructible_v<T>)
-
-       : head { nullptr }, tail { nullptr }, count {}
+   enum Stage
    {
-      for (const T &v : init)
-      {
-         add(v);
-      }
-   }
+      AddText,
+      Preprocessing,
+      Embedding,
+      FindNearest,
+      TopKNearest,
+      StageCount
+   };
 
-   SinglyLinkedList &operator=(const std::initializer_list<T> &init)
+   LatencyHistogram latency[StageCount];
 
-       noexcept(std::is_nothrow_copy_constructible_v<T>)
-   {
-      clear();
+   std::atomic<uint64_t> queries;
+   std::atomic<uint64_t> vectorsScanned;
+   std::atomic<uint64_t> distancesComputed;
 
-      for (const T &v : init)
-      {
-         add(v);
-      }
+ public:
+   VectorStoreMetrics() noexcept;
 
-      return *this;
-   }
+   static const char *stageName(Stage stage) noexcept;
 
-   [[nodiscard]] friend bool operator==(const SinglyLinkedList<T> &lhs, const SinglyLinkedList<T> &rhs)
+   void reset() noexcept;
 
-       noexcept
-   {
-      if (&lhs == &rhs)
-      {
-         return true;
-      }
+   // Prometheus text exposition format: one summary per stage plus the counters
+   string toPrometheus() const;
+   string toJson() const;
+};
 
-      if (lhs.count != rhs.count)
-      {
-         return false;
-      }
+// =====================================
+// Class QueryExecutor
+// =====================================
 
-      Node *n1 { lhs.head };
-      Node *n2 { rhs.head };
+// Fixed pool of workers behind a bounded priority queue. Higher priority runs first, equal priorities in
+// submission order. A task whose deadline has passed when it is dequeued is told so instead of being run, and a
+// full queue rejects new work rather than letting it pile up
+class QueryExecutor
+{
+ public:
+   using Clock = std::chrono::steady_clock;
 
-      while (n1 != nullptr && n2 != nullptr)
+   // expired is true when the deadline passed before a worker got to the task
+   using Task = std::function<void(bool expired)>;
+
+ private:
+   struct Entry
+   {
+      int priority;
+      uint64_t sequence;
+      Clock::time_point deadline;
+      Task task;
+   };
+
+   struct RunsLater
+   {
+      bool operator()(const Entry &a, const Entry &b) const
       {
-         if (!(n1->data == n2->data))
+         if (a.priority != b.priority)
          {
-            return false;
+            return a.priority < b.priority;
          }
-
-         n1 = n1->next;
-         n2 = n2->next;
+         return a.sequence > b.sequence;
       }
+   };
 
-      return true;
-   }
-
-   [[nodiscard]] friend bool operator!=(const SinglyLinkedList<T> &lhs, const SinglyLinkedList<T> &rhs)
+   std::mutex lock;
+   std::condition_variable ready;
+   algorithms::heap<Entry, RunsLater, 4> queue;
+   int queueCapacity;
+   uint64_t nextSequence;
+   bool stopping;
+   std::thread *workers;
+   int workerCount;
 
-       noexcept
-   {
-      return !(lhs == rhs);
-   }
+   void work();
 
  public:
-   friend std::ostream &operator<<(std::ostream &os, const SinglyLinkedList<T> &list) noexcept
-   {
-      os << list.toString();
-      return os;
-   }
+   // threads <= 0 means one per hardware thread
+   explicit QueryExecutor(int threads = 0, int queueCapacity = 1024);
+   ~QueryExecutor();
 
- public:
-   [[nodiscard]] constexpr inline bool empty() const noexcept { return this->count == 0; }
-   [[nodiscard]] constexpr inline int size() const noexcept { return this->count; }
-   [[nodiscard]] int indexOf(T item) const;
-   [[nodiscard]] bool contains(T item) const;
+   QueryExecutor(const QueryExecutor &) = delete;
+   QueryExecutor &operator=(const QueryExecutor &) = delete;
 
- public:
-   void add(T e);
-   void add(int index, T e);
+   // false when the queue is full, the task is then dropped without being called
+   bool submit(Task task, int priority = 0, Clock::time_point deadline = Clock::time_point::max());
 
- public:
-   T removeAt(int index);
-   bool removeItem(T item);
-   void clear() noexcept(std::is_nothrow_destructible_v<T>);
+   [[nodiscard]] int threads() const noexcept { return workerCount; }
+   [[nodiscard]] int capacity() const noexcept { return queueCapacity; }
+   [[nodiscard]] int pending();
+};
 
- public:
-   T &get(int index);
+// per-query scheduling for the async VectorStore calls
+struct QueryOptions
+{
+   int priority { 0 }; // higher runs first
+   QueryExecutor::Clock::time_point deadline { QueryExecutor::Clock::time_point::max() };
+};
 
- public:
-   string toString(string (*item2str)(T &) = 0) const;
+// how VectorStore::hybridTopK merges the lexical and the vector ranking
+struct HybridOptions
+{
+   enum Fusion
+   {
+      Weighted,       // min-max normalized scores, mixed by lexicalWeight
+      ReciprocalRank, // sum of 1 / (rrfK + rank) over both rankings
+   };
 
- public:
-   Iterator begin() noexcept;
-   Iterator end() noexcept;
+   Fusion fusion { ReciprocalRank };
+   double lexicalWeight { 0.5 };
+   int rrfK { 60 };
+   int candidates { 0 }; // taken from each side, 0 means max(4k, 50)
+   string metric { "cosine" };
+};
 
-   // Inner class Iterator
-   class Iterator
-   {
-#ifdef TESTING
-      friend class TestHelper;
-#endif
-    private:
-      Node *current;
+// how VectorStore::mmrTopK trades relevance against redundancy
+struct MmrOptions
+{
+   double lambda { 0.5 }; // 1 keeps the relevance order, 0 only cares about not repeating earlier picks
+   int candidates { 0 };  // re-ranked from topKNearest, 0 means max(4k, 100)
+   string metric { "cosine" };
+};
 
-    public:
-      Iterator(Node *node = nullptr) noexcept;
-      Iterator &operator=(const Iterator &other) noexcept; // Deep Copy
+// Heap bytes behind a VectorStore by what they hold. Allocations are counted the way glibc malloc hands them out
+// (an 8-byte header, 16-byte granules, 32 bytes at least), so tiny ones such as list nodes show their real cost
+struct MemoryUsage
+{
+   int64_t vectorData;   // the floats in the records' lists
+   int64_t nodeOverhead; // everything else the lists take: next pointers, padding, headers, list objects
+   int64_t packedRows;   // the rows the queries scan, with their norms and sign codes
+   int64_t slack;        // reserved but unused: records array, packed rows, string capacity
+   int64_t rawText;      // raw strings, or the text arena's blocks
+   int64_t records;      // the VectorRecord objects and the array pointing at them
+   int64_t indexes;      // lexical index and LSH tables
+   int64_t caches;       // decoded text blocks, metrics
+
+   [[nodiscard]] int64_t total() const noexcept;
+   string toString() const;
+};
 
-      [[nodiscard]] T &operator*();
-      [[nodiscard]] bool operator!=(const Iterator &other) const noexcept;
+// how VectorStore::cluster runs mini-batch k-means
+struct ClusterOptions
+{
+   string metric { "euclidean" }; // or "cosine", which clusters the directions (spherical k-means)
+   int batchSize { 1024 };
+   int iterations { 100 }; // mini-batches after seeding
+   int seedSample { 0 };   // records k-means++ seeds from, 0 means min(size, 32k + 1024)
+   int threads { 0 };      // 0 means one per core
+   uint64_t seed { 42 };
+};
 
-      Iterator &operator++();
-      Iterator operator++(int);
-   };
+class VectorStore;
+
+// what VectorStore::cluster returns
+struct Clustering
+{
+   ArrayList<int> assignments; // cluster of every record, in record order
+   ArrayList<int> sizes;       // records per cluster
+   std::unique_ptr<VectorStore> centroids; // record c is centroid c, with "cluster c" as its raw text
+   double inertia; // summed squared distance, or summed 1 - cosine, of every record to its centroid
 };
 
 // =====================================
@@ -483,29 +2425,165 @@ class VectorStore
       string rawText;
       int rawLength;
       SinglyLinkedList<float> *vector;
+      TextArena::Ref text; // where rawText lives when text compression is on, block -1 otherwise
 
-      VectorRecord(int id, const string &rawText, SinglyLinkedList<float> *vector);
+      VectorRecord(int id, string rawText, SinglyLinkedList<float> *vector);
    };
 
    using EmbedFn = SinglyLinkedList<float> *(*)(const string &);
 
+   // EXPLAIN for one topKNearest call: what ran, where the time went and how selective the heap was
+   struct QueryTrace
+   {
+      string path;   // "brute_force" or the index that answered
+      string metric; // distance kernel
+      string simd;   // instruction set the kernels were compiled for
+      int threads;
+      int k;
+
+      // stage times, ns
+      uint64_t prepareNs; // metric lookup and query flattening
+      uint64_t scanNs;    // distances plus heap pushes
+      uint64_t selectNs;  // draining the heap into the result
+      uint64_t totalNs;
+
+      int candidatesConsidered;
+      int candidatesPruned; // rejected by the heap threshold on arrival
+      double threshold;     // worst score kept, the bar a new vector had to clear
+
+      QueryTrace();
+
+      string toString() const;
+      string toJson() const;
+   };
+
  private:
    ArrayList<VectorRecord *> records;
    int dimension;
    int count;
    EmbedFn embeddingFunction;
+   int nextId;
+   std::atomic<bool> normalizeText;
+   std::unique_ptr<TextArena> texts; // set while text compression is on
+   std::unique_ptr<InvertedIndex> lexical; // set while the lexical index is on, keyed by record id
+   std::unique_ptr<LshIndex> lsh; // set while the LSH index is on, keyed by record id
+   LshOptions lshOptions;
+   std::unique_ptr<VectorStoreMetrics> stats; // only allocated when vectorStoreMetrics is on
+
+   // A compaction pass goes through these in order. Each call takes a step as far as its budget allows, the state
+   // below lets the next call pick up there
+   enum class CompactStep
+   {
+      Lists,
+      Rows,
+      Lsh,
+      Texts,
+      Lexical,
+   };
+
+   // smaller arrays the packed rows are being copied into, rows below copied are kept in step with every write
+   struct RowCopy
+   {
+      float *rows;
+      double *norms;
+      uint64_t *codes;
+      int capacity;
+      int copied;
+
+      RowCopy(int capacity, int stride, int words);
+      ~RowCopy();
+
+      RowCopy(const RowCopy &) = delete;
+      RowCopy &operator=(const RowCopy &) = delete;
+   };
+
+   CompactStep compactStep;
+   int compactCursor; // next record the lists step visits
+   int compactLastId; // last record the texts and lexical steps went through, they walk by id
+   std::unique_ptr<RowCopy> shrinking;
+   std::unique_ptr<InvertedIndex> rebuiltLexical; // filled in id order by the lexical step, then swapped in
+
+   // Every vector is also packed into rows of `stride` floats (64-byte aligned, zero padded) in record order,
+   // which is what the queries scan. norms caches each row's L2 norm for cosine, codes its sign bits for hamming
+   float *rows;
+   double *norms;
+   uint64_t *codes;
+   int stride;
+   int rowCapacity;
+   ArrayList<int> pinnedIds; // records handed out by getVector and not committed, re-packed before every scan
+
+   // queries share it, anything that changes records or rows takes it exclusively
+   mutable std::shared_mutex storeLock;
+
+   mutable std::mutex executorLock;
+   mutable std::unique_ptr<QueryExecutor> executor; // started on the first async query
+
+   VectorRecord &recordAt(int index) const;
+   bool submitQuery(QueryExecutor::Task task, const QueryOptions &options) const;
+   void ensureRows(int cap);
+   void reallocateRows(int newCapacity);
+   void packRow(int index) const;
+   void mirrorRow(int index) const;
+   std::shared_lock<std::shared_mutex> scanLock() const;
+   void repackPinned() const;
+   void unpin(int id);
+   void writeBack(int index);
+   SinglyLinkedList<float> *embedText(const string &text);
+   void addRecord(string rawText, SinglyLinkedList<float> *vector);
+   void storeText(VectorRecord &record, string text);
+   const string &rawTextOf(const VectorRecord &record, TextArena::Cursor *cursor = nullptr) const;
+   int positionOf(int id) const;
+   void rehashRows() const;
+
+   template <typename Fn> static constexpr bool readOnlyVisitor {
+      std::is_invocable_v<Fn &, algorithms::span<const float>, int, const string &>
+   };
+
+   // fn(first, last) over record ranges with the right lock held; rows are written back after mutable visits
+   template <typename Fn, typename Body> void visitRange(int threads, int chunk, Body body);
+   void nearest(const float *query, int k, const string &metric, int *ids, double *scores,
+                QueryTrace *trace = nullptr) const;
+   const float *flattenQuery(const SinglyLinkedList<float> &query) const;
 
  public:
    VectorStore(int dimension = 512, EmbedFn embeddingFunction = nullptr);
    ~VectorStore();
    int size() const;
    bool empty() const;
+   int getDimension() const { return dimension; }
    void clear();
 
-   SinglyLinkedList<float> *preprocessing(string rawText);
+   // embeds the text, run through TextNormalizer first when normalization is on, and fits the result to the
+   // store's dimension. The caller owns the returned list
+   SinglyLinkedList<float> *preprocessing(std::string_view rawText);
+
+   // off by default, the embedding then sees the text exactly as given. Stored raw text is never changed
+   void setTextNormalization(bool enabled);
+
+   // Keeps raw texts block-compressed in a TextArena instead of one string per record. getRawText then
+   // decompresses on demand; rawLength stays on the record. Switching moves the existing texts over
+   void setTextCompression(bool enabled);
+   bool textCompression() const;
+
+   // BM25 index over the normalized words of the raw text, kept up to date by every change while it is on
+   void setLexicalIndex(bool enabled);
+   bool lexicalIndex() const;
+
+   // LSH tables over the vectors (see LshIndex), kept up to date by every change while they are on. Turning
+   // them on again rebuilds them with the new options. An estimated width is fixed when the tables are built, so a
+   // store that starts empty or changes scale needs them turned on again or an explicit width
+   void setLshIndex(bool enabled, const LshOptions &options = {});
+   bool lshIndex() const;
 
    void addText(string rawText);
+   // The list stays the caller's to edit: until commitVector the record's packed row is re-packed before every
+   // query, and queries take the lock exclusively for it. The store reads the list without the caller's knowledge,
+   // so it must not be written while any other call on the store runs, queries included. removeAt and updateText
+   // drop the hand-out, and the reference with it
    SinglyLinkedList<float> &getVector(int index);
+   // Re-packs the row of a list edited through getVector once and ends the hand-out, queries stop paying for it.
+   // The reference is only safe to use until the next compact from then on
+   void commitVector(int index);
    string getRawText(int index) const;
    int getId(int index) const;
    bool removeAt(int index);
@@ -514,13 +2592,201 @@ class VectorStore
 
    void forEach(void (*action)(SinglyLinkedList<float> &, int, string &));
 
+   // Visits every record in order as fn(vector, id, rawText) with the vector as a view of its packed row, so any
+   // callable works and can inline. If fn accepts algorithms::span<const float> the pass is read-only; a fn that
+   // needs span<float> may edit the vector in place and the change is written back to the record. The store is
+   // locked for the whole pass, fn must not call back into it
+   template <typename Fn> void forEach(Fn &&fn);
+
+   // Same, spread over threads (0 = one per core) in chunks of records. fn runs concurrently, in no set order
+   template <typename Fn> void parallelForEach(Fn &&fn, int threads = 0, int chunk = 4096);
+
+   // fn(vector, id, rawText) returns a value, computed in parallel; sink receives the values on the calling thread
+   // in record order. Results are buffered a few chunks per thread at a time
+   template <typename Fn, typename Sink>
+   void parallelForEachOrdered(Fn &&fn, Sink &&sink, int threads = 0, int chunk = 4096);
+
    double cosineSimilarity(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
    double l1Distance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
    double l2Distance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
-
+   double dotProduct(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
+   double chebyshevDistance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
+   // components that differ in sign, a component counting as set when it is positive
+   int hammingDistance(const SinglyLinkedList<float> &v1, const SinglyLinkedList<float> &v2) const;
+
+   // metric is "cosine" or "dot" (highest similarity wins, dot being the raw inner product for MIPS), or
+   // "euclidean", "manhattan", "chebyshev" (L-infinity) or "hamming" over the sign bits (smallest distance wins).
+   // Returns the index of the best record, -1 when the store is empty
    int findNearest(const SinglyLinkedList<float> &query, const string &metric = "cosine") const;
 
+   // indices of the k best records, best first, ties to the lower index. The caller owns the array (delete[])
    int *topKNearest(const SinglyLinkedList<float> &query, int k, const string &metric = "cosine") const;
+
+   // same results, and trace is overwritten with how the query ran
+   int *topKNearest(const SinglyLinkedList<float> &query, int k, const string &metric, QueryTrace &trace) const;
+
+   // Zero-copy versions: query points at dimension() floats and the k best ids, plus their scores when scores is
+   // not null, are written best first into caller buffers of at least k entries. Scores are the similarity for
+   // cosine and the distance otherwise. Once a thread has run a query nothing on this path allocates
+   int findNearest(const float *query, const string &metric = "cosine") const;
+   void topKNearest(const float *query, int k, int *ids, double *scores = nullptr,
+                    const string &metric = "cosine") const;
+
+   // Approximate topKNearest through the LSH index, in the index's metric: the candidates it finds are scored
+   // exactly and the k best written best first. Fewer than k come back when too few collide; returns how many
+   int approximateTopK(const float *query, int k, int *ids, double *scores = nullptr) const;
+
+   // Indices of the k best records by BM25 for the words of query, best first, written like the zero-copy
+   // topKNearest. Records sharing no word with the query never match; returns how many were written
+   int lexicalTopK(std::string_view query, int k, int *ids, double *scores = nullptr) const;
+
+   // Embeds query and ranks the records by both BM25 and vector similarity, then fuses the two rankings (see
+   // HybridOptions). Scores are the fused ones; returns how many were written
+   int hybridTopK(const string &query, int k, int *ids, double *scores = nullptr, const HybridOptions &options = {});
+
+   // Maximal marginal relevance over the best topKNearest candidates: each pick maximizes lambda * relevance minus
+   // (1 - lambda) * its similarity to the closest earlier pick, distances counting as negative similarities. The
+   // candidate x candidate scores come from one tiled pass of the kernels. Indices are written in pick order with
+   // their query scores; returns how many, min(k, size())
+   int mmrTopK(const float *query, int k, int *ids, double *scores = nullptr, const MmrOptions &options = {}) const;
+
+   // Mini-batch k-means over the records: k-means++ seeds drawn from a sample, then Sculley's per-centre learning
+   // rate over random batches, with batch assignment and the final pass spread over threads. A cluster left empty
+   // is reseeded with the record farthest from its centroid and the pass repeated. The read lock is only held to copy
+   // the seed sample and each batch, and for one slice of the final pass at a time, so writes go on meanwhile and
+   // the assignments cover the records as they are at the end. The centroids come back as a new store with this
+   // one's dimension and embedding function
+   Clustering cluster(int k, const ClusterOptions &options = {}) const;
+
+   MemoryUsage memoryUsage() const;
+
+   // Gives memory back after deletes, replacements and growth. Every record's list is re-allocated node by node so
+   // its nodes sit together, except the ones getVector handed out and commitVector has not taken back, and raw
+   // strings are shrunk to fit. Then the packed rows and the records array are cut to size, the LSH slots made
+   // dense, the texts of arena blocks over a fifth garbage moved out so the blocks can be freed, and the lexical
+   // index rebuilt when over a fifth of its documents are dead. Every step is resumable: a call does at most
+   // maxRecords records, rows or slots of work under one write lock, so a pass can be spread over quiet periods
+   // while writes go on in between. Returns true when the pass is complete, the next call then starts another
+   bool compact(int maxRecords = INT_MAX);
+
+   // Run on the store's executor. Failures, a full queue (query_rejected) and a deadline that passed before the
+   // query was picked up (deadline_exceeded) all surface through the future. The query is copied, so the caller
+   // may free it right away
+   std::future<int> findNearestAsync(const SinglyLinkedList<float> &query, const string &metric = "cosine",
+                                     QueryOptions options = {}) const;
+   std::future<ArrayList<int>> topKNearestAsync(const SinglyLinkedList<float> &query, int k,
+                                                const string &metric = "cosine", QueryOptions options = {}) const;
+
+   // replaces the executor, waiting for the queries already queued on the old one. threads <= 0 means one per core
+   void configureExecutor(int threads, int queueCapacity);
+
+   // all zero when built without VECTORSTORE_METRICS
+   const VectorStoreMetrics &metrics() const;
+   void resetMetrics();
 };
 
+template <typename Fn, typename Body> void VectorStore::visitRange(int threads, int chunk, Body body)
+{
+   if constexpr (readOnlyVisitor<Fn>)
+   {
+      std::shared_lock<std::shared_mutex> guard { scanLock() };
+      algorithms::parallel_for(count, threads, chunk, body);
+   }
+   else
+   {
+      std::unique_lock<std::shared_mutex> guard { storeLock };
+      // rows must be current before fn sees them
+      repackPinned();
+      algorithms::parallel_for(count, threads, chunk, [&](int first, int last) {
+         body(first, last);
+         for (int i { first }; i < last; i++)
+         {
+            writeBack(i);
+         }
+      });
+      rehashRows();
+   }
+}
+
+template <typename Fn> void VectorStore::forEach(Fn &&fn)
+{
+   // callables written for the function pointer version still get the lists
+   if constexpr (std::is_invocable_v<Fn &, SinglyLinkedList<float> &, int, string &>)
+   {
+      std::unique_lock<std::shared_mutex> guard { storeLock };
+      TextArena::Cursor cursor;
+      for (int i {}; i < count; i++)
+      {
+         VectorRecord &record { *records[i] };
+         if (!texts && !lexical)
+         {
+            fn(*record.vector, record.id, record.rawText);
+            packRow(i);
+            continue;
+         }
+         // the text is handed out as a copy and stored (and indexed) again only if fn changed it
+         string original { rawTextOf(record, &cursor) };
+         string text { original };
+         fn(*record.vector, record.id, text);
+         if (text != original)
+         {
+            storeText(record, std::move(text));
+         }
+         packRow(i);
+      }
+   }
+   else
+   {
+      parallelForEach(std::forward<Fn>(fn), 1);
+   }
+}
+
+template <typename Fn> void VectorStore::parallelForEach(Fn &&fn, int threads, int chunk)
+{
+   using View = std::conditional_t<readOnlyVisitor<Fn>, algorithms::span<const float>, algorithms::span<float>>;
+   visitRange<Fn>(threads, chunk, [&](int first, int last) {
+      // records next to each other mostly share a text block, each chunk decodes it once
+      TextArena::Cursor cursor;
+      float *row { rows + static_cast<size_t>(first) * stride };
+      for (int i { first }; i < last; i++, row += stride)
+      {
+         const VectorRecord &record { *records[i] };
+         fn(View { row, dimension }, record.id, rawTextOf(record, &cursor));
+      }
+   });
+}
+
+template <typename Fn, typename Sink>
+void VectorStore::parallelForEachOrdered(Fn &&fn, Sink &&sink, int threads, int chunk)
+{
+   using View = std::conditional_t<readOnlyVisitor<Fn>, algorithms::span<const float>, algorithms::span<float>>;
+   using Result = std::decay_t<std::invoke_result_t<Fn &, View, int, const string &>>;
+
+   threads = threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+   chunk = std::max(chunk, 1);
+   // a wave of chunks is computed in parallel, then handed to sink in order before the next one starts
+   const int wave { static_cast<int>(std::min<int64_t>(static_cast<int64_t>(chunk) * threads * 4, INT_MAX)) };
+
+   visitRange<Fn>(1, INT_MAX, [&](int first, int last) {
+      for (int base { first }; base < last; base += wave)
+      {
+         int n { std::min(wave, last - base) };
+         std::unique_ptr<std::optional<Result>[]> results { new std::optional<Result>[n] };
+         algorithms::parallel_for(n, threads, chunk, [&](int from, int to) {
+            TextArena::Cursor cursor;
+            float *row { rows + static_cast<size_t>(base + from) * stride };
+            for (int i { from }; i < to; i++, row += stride)
+            {
+               const VectorRecord &record { *records[base + i] };
+               results[i].emplace(fn(View { row, dimension }, record.id, rawTextOf(record, &cursor)));
+            }
+         });
+         for (int i {}; i < n; i++)
+         {
+            sink(std::move(*results[i]));
+         }
+      }
+   });
+}
+
 #endif // VECTORSTORE_H
@@ -0,0 +1,1327 @@
+// Microbenchmarks for the containers, the sorts and the VectorStore queries.
+// Flags and JSON layout follow Google Benchmark so its compare.py tooling can diff two runs:
+//   --benchmark_filter=<regex>      only run matching benchmarks
+//   --benchmark_min_time=<seconds>  time budget per benchmark (default 0.5)
+//   --benchmark_repetitions=<n>     repeat each benchmark and add mean/median/stddev aggregates
+//   --benchmark_format=<console|json>
+//   --benchmark_out=<file>          also write JSON to file
+//   --benchmark_list_tests          print the benchmark names and exit
+
+#include "main.h"
+#include "VectorStore.h"
+
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <regex>
+#include <vector>
+
+namespace bench
+{
+// ==========================================================================================
+// Harness
+
+// keeps the compiler from optimizing a value (and the work behind it) away
+template <typename T> inline void doNotOptimize(T &&value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+inline void clobberMemory() { asm volatile("" : : : "memory"); }
+
+enum class TimeUnit
+{
+   Nanosecond,
+   Microsecond,
+   Millisecond
+};
+
+class State
+{
+   using Clock = std::chrono::steady_clock;
+
+ private:
+   int64_t iterations;
+   int64_t done;
+   const std::vector<int64_t> &args;
+
+   bool running;
+   Clock::time_point realStart;
+   std::clock_t cpuStart;
+   double realElapsed;
+   double cpuElapsed;
+
+ public:
+   int64_t itemsProcessed;
+   int64_t bytesProcessed;
+   string label;
+
+ public:
+   State(int64_t iterations, const std::vector<int64_t> &args)
+       : iterations { iterations }, done {}, args { args }, running {}, realStart {}, cpuStart {}, realElapsed {},
+         cpuElapsed {}, itemsProcessed {}, bytesProcessed {}, label {}
+   {
+   }
+
+   // while (state.keepRunning()) { ... } - the timer starts on the first call and stops on the last
+   bool keepRunning()
+   {
+      if (this->done == 0 && !this->running)
+      {
+         resumeTiming();
+      }
+      if (this->done < this->iterations)
+      {
+         this->done++;
+         return true;
+      }
+      pauseTiming();
+      return false;
+   }
+
+   // setup work inside the loop goes between these two
+   void pauseTiming()
+   {
+      if (!this->running)
+      {
+         return;
+      }
+      this->realElapsed += std::chrono::duration<double>(Clock::now() - this->realStart).count();
+      this->cpuElapsed += static_cast<double>(std::clock() - this->cpuStart) / CLOCKS_PER_SEC;
+      this->running = false;
+   }
+
+   void resumeTiming()
+   {
+      this->running = true;
+      this->cpuStart = std::clock();
+      this->realStart = Clock::now();
+   }
+
+   int64_t range(int i) const { return this->args.at(i); }
+   int64_t getIterations() const { return this->iterations; }
+   double realTime() const { return this->realElapsed; }
+   double cpuTime() const { return this->cpuElapsed; }
+};
+
+struct Benchmark
+{
+   string name;
+   void (*fn)(State &);
+   std::vector<string> argNames;
+   std::vector<std::vector<int64_t>> argSets;
+   TimeUnit unit;
+};
+
+std::vector<Benchmark> &registry()
+{
+   static std::vector<Benchmark> benchmarks;
+   return benchmarks;
+}
+
+// Registration helper, chained like benchmark::internal::Benchmark
+class Registrar
+{
+ private:
+   int index;
+
+ public:
+   Registrar(const string &name, void (*fn)(State &))
+   {
+      registry().push_back(Benchmark { name, fn, {}, {}, TimeUnit::Nanosecond });
+      this->index = static_cast<int>(registry().size()) - 1;
+   }
+
+   Registrar &argNames(std::initializer_list<string> names)
+   {
+      registry()[this->index].argNames = names;
+      return *this;
+   }
+
+   Registrar &args(std::initializer_list<int64_t> values)
+   {
+      registry()[this->index].argSets.emplace_back(values);
+      return *this;
+   }
+
+   Registrar &arg(int64_t value) { return args({ value }); }
+
+   // every combination of the given values, first axis slowest
+   Registrar &argsProduct(const std::vector<std::vector<int64_t>> &axes)
+   {
+      std::vector<int64_t> current(axes.size());
+      std::function<void(size_t)> expand { [&](size_t axis) {
+         if (axis == axes.size())
+         {
+            registry()[this->index].argSets.push_back(current);
+            return;
+         }
+         for (int64_t v : axes[axis])
+         {
+            current[axis] = v;
+            expand(axis + 1);
+         }
+      } };
+      expand(0);
+      return *this;
+   }
+
+   Registrar &unit(TimeUnit u)
+   {
+      registry()[this->index].unit = u;
+      return *this;
+   }
+};
+
+#define BENCH_CONCAT2(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT2(a, b)
+#define BENCHMARK(fn) static bench::Registrar BENCH_CONCAT(registrar_, __LINE__) = bench::Registrar(#fn, fn)
+
+struct Options
+{
+   string filter { "." };
+   double minTime { 0.5 };
+   int repetitions { 1 };
+   bool json {};
+   string out {};
+   bool list {};
+};
+
+struct Run
+{
+   string name;
+   string runName;
+   string aggregate;
+   int repetitionIndex;
+   int repetitions;
+   int64_t iterations;
+   double realTime; // per iteration, in the benchmark's unit
+   double cpuTime;
+   double itemsPerSecond;
+   double bytesPerSecond;
+   string label;
+   TimeUnit unit;
+};
+
+const char *unitName(TimeUnit unit)
+{
+   switch (unit)
+   {
+   case TimeUnit::Microsecond:
+      return "us";
+   case TimeUnit::Millisecond:
+      return "ms";
+   default:
+      return "ns";
+   }
+}
+
+double unitScale(TimeUnit unit)
+{
+   switch (unit)
+   {
+   case TimeUnit::Microsecond:
+      return 1e6;
+   case TimeUnit::Millisecond:
+      return 1e3;
+   default:
+      return 1e9;
+   }
+}
+
+string runName(const Benchmark &b, const std::vector<int64_t> &args)
+{
+   std::ostringstream os;
+   os << b.name;
+   for (size_t i {}; i < args.size(); i++)
+   {
+      os << '/';
+      if (i < b.argNames.size())
+      {
+         os << b.argNames[i] << ':';
+      }
+      os << args[i];
+   }
+   return os.str();
+}
+
+// Grows the iteration count until one run fills min_time, the same schedule Google Benchmark uses
+Run measure(const Benchmark &b, const std::vector<int64_t> &args, double minTime)
+{
+   int64_t iterations { 1 };
+   const int64_t maxIterations { 1000000000 };
+   while (true)
+   {
+      State state { iterations, args };
+      b.fn(state);
+      double elapsed { state.realTime() };
+
+      if (elapsed >= minTime || iterations >= maxIterations)
+      {
+         double scale { unitScale(b.unit) };
+         Run run {};
+         run.name = runName(b, args);
+         run.runName = run.name;
+         run.iterations = iterations;
+         run.realTime = elapsed * scale / iterations;
+         run.cpuTime = state.cpuTime() * scale / iterations;
+         run.itemsPerSecond = elapsed > 0 ? state.itemsProcessed / elapsed : 0;
+         run.bytesPerSecond = elapsed > 0 ? state.bytesProcessed / elapsed : 0;
+         run.label = state.label;
+         run.unit = b.unit;
+         return run;
+      }
+
+      double multiplier { minTime * 1.4 / std::max(elapsed, 1e-9) };
+      if (elapsed / minTime <= 0.1)
+      {
+         multiplier = std::min(multiplier, 10.0);
+      }
+      int64_t next { static_cast<int64_t>(iterations * multiplier + 0.5) };
+      iterations = std::min(maxIterations, std::max(next, iterations + 1));
+   }
+}
+
+void aggregate(std::vector<Run> &out, const std::vector<Run> &reps)
+{
+   const char *names[] { "mean", "median", "stddev" };
+   for (const char *name : names)
+   {
+      Run agg { reps.front() };
+      agg.name = reps.front().runName + "_" + name;
+      agg.aggregate = name;
+      agg.repetitionIndex = -1;
+
+      auto reduce { [&](double Run::*field) {
+         std::vector<double> v;
+         for (const Run &r : reps)
+         {
+            v.push_back(r.*field);
+         }
+         double mean {};
+         for (double x : v)
+         {
+            mean += x;
+         }
+         mean /= v.size();
+         if (agg.aggregate == "mean")
+         {
+            return mean;
+         }
+         if (agg.aggregate == "median")
+         {
+            algorithms::sort(v.begin(), v.end());
+            size_t half { v.size() / 2 };
+            return v.size() % 2 ? v[half] : (v[half - 1] + v[half]) / 2;
+         }
+         double sq {};
+         for (double x : v)
+         {
+            sq += (x - mean) * (x - mean);
+         }
+         return v.size() > 1 ? std::sqrt(sq / (v.size() - 1)) : 0.0;
+      } };
+
+      agg.realTime = reduce(&Run::realTime);
+      agg.cpuTime = reduce(&Run::cpuTime);
+      agg.itemsPerSecond = reduce(&Run::itemsPerSecond);
+      agg.bytesPerSecond = reduce(&Run::bytesPerSecond);
+      out.push_back(agg);
+   }
+}
+
+string jsonEscape(const string &s)
+{
+   string out;
+   for (char c : s)
+   {
+      if (c == '"' || c == '\\')
+      {
+         out += '\\';
+      }
+      out += c;
+   }
+   return out;
+}
+
+void writeJson(std::ostream &os, const std::vector<Run> &runs, const char *executable)
+{
+   char date[64];
+   std::time_t now { std::time(nullptr) };
+   std::strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+#ifdef __OPTIMIZE__
+   const char *buildType { "release" };
+#else
+   const char *buildType { "debug" };
+#endif
+
+   os << "{\n";
+   os << "  \"context\": {\n";
+   os << "    \"date\": \"" << date << "\",\n";
+   os << "    \"executable\": \"" << jsonEscape(executable) << "\",\n";
+   os << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+   os << "    \"library_build_type\": \"" << buildType << "\"\n";
+   os << "  },\n";
+   os << "  \"benchmarks\": [";
+   for (size_t i {}; i < runs.size(); i++)
+   {
+      const Run &r { runs[i] };
+      os << (i ? ",\n" : "\n") << "    {\n";
+      os << "      \"name\": \"" << jsonEscape(r.name) << "\",\n";
+      os << "      \"run_name\": \"" << jsonEscape(r.runName) << "\",\n";
+      os << "      \"run_type\": \"" << (r.aggregate.empty() ? "iteration" : "aggregate") << "\",\n";
+      os << "      \"repetitions\": " << r.repetitions << ",\n";
+      if (r.aggregate.empty())
+      {
+         os << "      \"repetition_index\": " << r.repetitionIndex << ",\n";
+      }
+      else
+      {
+         os << "      \"aggregate_name\": \"" << r.aggregate << "\",\n";
+      }
+      os << "      \"threads\": 1,\n";
+      os << "      \"iterations\": " << r.iterations << ",\n";
+      os << "      \"real_time\": " << r.realTime << ",\n";
+      os << "      \"cpu_time\": " << r.cpuTime << ",\n";
+      os << "      \"time_unit\": \"" << unitName(r.unit) << "\"";
+      if (r.itemsPerSecond > 0)
+      {
+         os << ",\n      \"items_per_second\": " << r.itemsPerSecond;
+      }
+      if (r.bytesPerSecond > 0)
+      {
+         os << ",\n      \"bytes_per_second\": " << r.bytesPerSecond;
+      }
+      if (!r.label.empty())
+      {
+         os << ",\n      \"label\": \"" << jsonEscape(r.label) << "\"";
+      }
+      os << "\n    }";
+   }
+   os << "\n  ]\n}\n";
+}
+
+void writeConsoleRow(const Run &r)
+{
+   char line[256];
+   std::snprintf(line, sizeof line, "%-60s %12.1f %-2s %12.1f %-2s %12lld", r.name.c_str(), r.realTime, unitName(r.unit),
+                 r.cpuTime, unitName(r.unit), static_cast<long long>(r.iterations));
+   cout << line;
+   if (r.itemsPerSecond > 0)
+   {
+      cout << "  items/s=" << r.itemsPerSecond;
+   }
+   if (r.bytesPerSecond > 0)
+   {
+      cout << "  bytes/s=" << r.bytesPerSecond;
+   }
+   if (!r.label.empty())
+   {
+      cout << "  " << r.label;
+   }
+   cout << endl;
+}
+
+bool parseFlag(const string &arg, const string &flag, string &value)
+{
+   string prefix { "--" + flag + "=" };
+   if (arg.compare(0, prefix.size(), prefix) == 0)
+   {
+      value = arg.substr(prefix.size());
+      return true;
+   }
+   return false;
+}
+
+Options parseOptions(int argc, char **argv)
+{
+   Options opts;
+   for (int i { 1 }; i < argc; i++)
+   {
+      string arg { argv[i] };
+      string value;
+      if (parseFlag(arg, "benchmark_filter", value))
+      {
+         opts.filter = value;
+      }
+      else if (parseFlag(arg, "benchmark_min_time", value))
+      {
+         // "0.5s" is accepted as well as "0.5"
+         opts.minTime = std::stod(value);
+      }
+      else if (parseFlag(arg, "benchmark_repetitions", value))
+      {
+         opts.repetitions = std::max(1, std::stoi(value));
+      }
+      else if (parseFlag(arg, "benchmark_format", value))
+      {
+         opts.json = value == "json";
+      }
+      else if (parseFlag(arg, "benchmark_out", value))
+      {
+         opts.out = value;
+      }
+      else if (arg == "--benchmark_list_tests" || arg == "--benchmark_list_tests=true")
+      {
+         opts.list = true;
+      }
+      else
+      {
+         throw std::invalid_argument("Unknown flag: " + arg);
+      }
+   }
+   return opts;
+}
+
+int runAll(int argc, char **argv)
+{
+   Options opts { parseOptions(argc, argv) };
+   std::regex filter { opts.filter };
+
+   std::vector<Run> runs;
+   if (!opts.json && !opts.list)
+   {
+      char header[256];
+      std::snprintf(header, sizeof header, "%-60s %15s %15s %12s", "Benchmark", "Time", "CPU", "Iterations");
+      cout << header << endl << string(105, '-') << endl;
+   }
+
+   for (const Benchmark &b : registry())
+   {
+      std::vector<std::vector<int64_t>> argSets { b.argSets };
+      if (argSets.empty())
+      {
+         argSets.emplace_back();
+      }
+      for (const std::vector<int64_t> &args : argSets)
+      {
+         string name { runName(b, args) };
+         if (!std::regex_search(name, filter))
+         {
+            continue;
+         }
+         if (opts.list)
+         {
+            cout << name << endl;
+            continue;
+         }
+
+         std::vector<Run> reps;
+         for (int rep {}; rep < opts.repetitions; rep++)
+         {
+            Run run { measure(b, args, opts.minTime) };
+            run.repetitionIndex = rep;
+            run.repetitions = opts.repetitions;
+            if (!opts.json)
+            {
+               writeConsoleRow(run);
+            }
+            reps.push_back(run);
+            runs.push_back(run);
+         }
+         if (opts.repetitions > 1)
+         {
+            size_t first { runs.size() };
+            aggregate(runs, reps);
+            for (size_t i { first }; !opts.json && i < runs.size(); i++)
+            {
+               writeConsoleRow(runs[i]);
+            }
+         }
+      }
+   }
+
+   if (opts.list)
+   {
+      return 0;
+   }
+   if (opts.json)
+   {
+      writeJson(cout, runs, argv[0]);
+   }
+   if (!opts.out.empty())
+   {
+      std::ofstream file { opts.out };
+      if (!file)
+      {
+         throw std::runtime_error("Cannot open " + opts.out);
+      }
+      writeJson(file, runs, argv[0]);
+   }
+   return 0;
+}
+
+// ==========================================================================================
+// Inputs
+
+// splitmix64, so every run sees the same data
+class Rng
+{
+ private:
+   uint64_t state;
+
+ public:
+   explicit Rng(uint64_t seed) : state { seed } {}
+
+   uint64_t next()
+   {
+      uint64_t z { this->state += 0x9E3779B97F4A7C15ull };
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+   }
+
+   int nextInt(int bound) { return static_cast<int>(next() % static_cast<uint64_t>(bound)); }
+
+   // uniform in [-1, 1)
+   float nextFloat() { return static_cast<float>((next() >> 40) * (2.0 / (1ull << 24)) - 1.0); }
+};
+
+enum Pattern
+{
+   Random,
+   Sorted,
+   Reversed,
+   FewUnique,
+   OrganPipe,
+   PatternCount
+};
+
+const char *patternName(int64_t p)
+{
+   const char *names[] { "random", "sorted", "reversed", "few_unique", "organ_pipe" };
+   return names[p];
+}
+
+std::vector<int> makeInts(int n, int64_t pattern, uint64_t seed = 42)
+{
+   Rng rng { seed };
+   std::vector<int> v(n);
+   for (int i {}; i < n; i++)
+   {
+      switch (pattern)
+      {
+      case Sorted:
+         v[i] = i;
+         break;
+      case Reversed:
+         v[i] = n - i;
+         break;
+      case FewUnique:
+         v[i] = rng.nextInt(16);
+         break;
+      case OrganPipe:
+         v[i] = i < n / 2 ? i : n - i;
+         break;
+      default:
+         v[i] = static_cast<int>(rng.next());
+         break;
+      }
+   }
+   return v;
+}
+
+std::vector<string> makeStrings(int n, uint64_t seed = 42)
+{
+   Rng rng { seed };
+   std::vector<string> v(n);
+   for (string &s : v)
+   {
+      // shared prefixes, the case multikey quicksort is meant for
+      s = "doc/" + std::to_string(rng.nextInt(64)) + "/";
+      int len { 4 + rng.nextInt(12) };
+      for (int i {}; i < len; i++)
+      {
+         s += static_cast<char>('a' + rng.nextInt(26));
+      }
+   }
+   return v;
+}
+
+// The stub embedder is seeded by the text, so the same text always maps to the same vector
+int embedDimension { 128 };
+
+SinglyLinkedList<float> *stubEmbedding(const string &text)
+{
+   uint64_t h { 1469598103934665603ull };
+   for (char c : text)
+   {
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+   }
+   Rng rng { h };
+   SinglyLinkedList<float> *v { new SinglyLinkedList<float>() };
+   for (int i {}; i < embedDimension; i++)
+   {
+      v->add(rng.nextFloat());
+   }
+   return v;
+}
+
+const char *metricName(int64_t m)
+{
+   const char *names[] { "cosine", "euclidean", "manhattan", "dot", "hamming", "chebyshev" };
+   return names[m];
+}
+
+string docText(int i) { return "document " + std::to_string(i); }
+
+// Built stores are kept between calibration rounds, building 10^4 x 768 linked-list vectors takes a while
+VectorStore &cachedStore(int n, int dim)
+{
+   static std::unique_ptr<VectorStore> store;
+   static int cachedN { -1 };
+   static int cachedDim { -1 };
+   embedDimension = dim;
+   if (!store || cachedN != n || cachedDim != dim)
+   {
+      store.reset();
+      store = std::make_unique<VectorStore>(dim, stubEmbedding);
+      for (int i {}; i < n; i++)
+      {
+         store->addText(docText(i));
+      }
+      cachedN = n;
+      cachedDim = dim;
+   }
+   return *store;
+}
+
+// ==========================================================================================
+// ArrayList
+
+void BM_ArrayListAdd(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   while (state.keepRunning())
+   {
+      ArrayList<int> list;
+      for (int i {}; i < n; i++)
+      {
+         list.add(i);
+      }
+      doNotOptimize(list.rawData());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_ArrayListAdd).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+// insert into the middle, the O(n) shifting case
+void BM_ArrayListInsertMiddle(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   while (state.keepRunning())
+   {
+      ArrayList<int> list;
+      for (int i {}; i < n; i++)
+      {
+         list.add(list.size() / 2, i);
+      }
+      doNotOptimize(list.rawData());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_ArrayListInsertMiddle).arg(1 << 8).arg(1 << 12);
+
+void BM_ArrayListRemoveFront(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   ArrayList<int> list(n);
+   while (state.keepRunning())
+   {
+      state.pauseTiming();
+      for (int i {}; i < n; i++)
+      {
+         list.add(i);
+      }
+      state.resumeTiming();
+      while (!list.empty())
+      {
+         doNotOptimize(list.removeAt(0));
+      }
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_ArrayListRemoveFront).arg(1 << 8).arg(1 << 12);
+
+template <typename T> void sortList(State &state, const std::vector<T> &source)
+{
+   ArrayList<T> list(static_cast<int>(source.size()));
+   while (state.keepRunning())
+   {
+      state.pauseTiming();
+      list.clear();
+      for (const T &v : source)
+      {
+         list.add(v);
+      }
+      state.resumeTiming();
+      list.sort();
+      doNotOptimize(list.rawData());
+   }
+   state.itemsProcessed = state.getIterations() * static_cast<int64_t>(source.size());
+}
+
+void BM_ArrayListSortInt(State &state)
+{
+   sortList(state, makeInts(static_cast<int>(state.range(0)), Random));
+}
+BENCHMARK(BM_ArrayListSortInt).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_ArrayListSortDouble(State &state)
+{
+   std::vector<double> source;
+   Rng rng { 7 };
+   for (int64_t i {}; i < state.range(0); i++)
+   {
+      source.push_back(rng.nextFloat() * 1e6);
+   }
+   sortList(state, source);
+}
+BENCHMARK(BM_ArrayListSortDouble).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_ArrayListSortString(State &state) { sortList(state, makeStrings(static_cast<int>(state.range(0)))); }
+BENCHMARK(BM_ArrayListSortString).arg(1 << 10).arg(1 << 16);
+
+// ==========================================================================================
+// SinglyLinkedList
+
+void BM_SinglyLinkedListAdd(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   while (state.keepRunning())
+   {
+      SinglyLinkedList<int> list;
+      for (int i {}; i < n; i++)
+      {
+         list.add(i);
+      }
+      doNotOptimize(list.size());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_SinglyLinkedListAdd).arg(1 << 10).arg(1 << 16);
+
+// random-position get, each one walks from the head
+void BM_SinglyLinkedListGet(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   SinglyLinkedList<int> list;
+   for (int i {}; i < n; i++)
+   {
+      list.add(i);
+   }
+   Rng rng { 3 };
+   while (state.keepRunning())
+   {
+      doNotOptimize(list.get(rng.nextInt(n)));
+   }
+   state.itemsProcessed = state.getIterations();
+}
+BENCHMARK(BM_SinglyLinkedListGet).arg(1 << 6).arg(1 << 10).arg(1 << 14);
+
+void BM_SinglyLinkedListClear(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   SinglyLinkedList<int> list;
+   while (state.keepRunning())
+   {
+      state.pauseTiming();
+      for (int i {}; i < n; i++)
+      {
+         list.add(i);
+      }
+      state.resumeTiming();
+      list.clear();
+      clobberMemory();
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_SinglyLinkedListClear).arg(1 << 10).arg(1 << 16);
+
+// ==========================================================================================
+// algorithms::sort on the classic adversarial inputs, std::sort alongside as the reference
+
+template <typename Sort> void sortPattern(State &state, Sort sortFn)
+{
+   std::vector<int> source { makeInts(static_cast<int>(state.range(0)), state.range(1)) };
+   std::vector<int> v(source.size());
+   while (state.keepRunning())
+   {
+      state.pauseTiming();
+      std::copy(source.begin(), source.end(), v.begin());
+      state.resumeTiming();
+      sortFn(v.data(), v.data() + v.size());
+      doNotOptimize(v.data());
+   }
+   state.itemsProcessed = state.getIterations() * static_cast<int64_t>(source.size());
+   state.label = patternName(state.range(1));
+}
+
+void BM_AlgorithmsSort(State &state)
+{
+   sortPattern(state, [](int *first, int *last) { algorithms::sort(first, last); });
+}
+BENCHMARK(BM_AlgorithmsSort)
+    .argNames({ "n", "pattern" })
+    .argsProduct({ { 1 << 10, 1 << 16, 1 << 20 }, { Random, Sorted, Reversed, FewUnique, OrganPipe } });
+
+void BM_StdSort(State &state)
+{
+   sortPattern(state, [](int *first, int *last) { std::sort(first, last); });
+}
+BENCHMARK(BM_StdSort)
+    .argNames({ "n", "pattern" })
+    .argsProduct({ { 1 << 10, 1 << 16, 1 << 20 }, { Random, Sorted, Reversed, FewUnique, OrganPipe } });
+
+// ==========================================================================================
+// Text preprocessing, bytes_per_second is the GB/s figure
+
+// mostly ASCII prose with some punctuation and a sprinkling of multi-byte UTF-8
+string makeText(int bytes, uint64_t seed = 11)
+{
+   const char *words[] { "The", "quick", "brown", "fox", "jumps", "over", "lazy", "dogs", "Vector", "search,",
+                         "embedding", "index.", "caf\xC3\xA9", "na\xC3\xAFve", "2024", "(draft)" };
+   Rng rng { seed };
+   string text;
+   while (static_cast<int>(text.size()) < bytes)
+   {
+      text += words[rng.nextInt(16)];
+      text += rng.nextInt(8) == 0 ? "  \n" : " ";
+   }
+   text.resize(bytes);
+   return text;
+}
+
+void BM_TextNormalize(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   TextNormalizer normalizer;
+   while (state.keepRunning())
+   {
+      doNotOptimize(normalizer.normalize(text).data());
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(text.size());
+}
+BENCHMARK(BM_TextNormalize).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_TextToLowerAscii(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   while (state.keepRunning())
+   {
+      TextNormalizer::toLowerAscii(text.data(), text.size());
+      doNotOptimize(text.data());
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(text.size());
+}
+BENCHMARK(BM_TextToLowerAscii).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_TextValidUtf8(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   text.resize(text.size() - 3); // keep a trailing multi-byte sequence from being cut in half
+   while (state.keepRunning())
+   {
+      doNotOptimize(TextNormalizer::validUtf8(text));
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(text.size());
+}
+BENCHMARK(BM_TextValidUtf8).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_TextTokenize(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   TextNormalizer normalizer;
+   while (state.keepRunning())
+   {
+      int tokens {};
+      TextNormalizer::forEachToken(normalizer.normalize(text), [&tokens](std::string_view) { tokens++; });
+      doNotOptimize(tokens);
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(text.size());
+}
+BENCHMARK(BM_TextTokenize).arg(1 << 10).arg(1 << 16).arg(1 << 20);
+
+void BM_TextArenaCompress(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   std::unique_ptr<char[]> packed { new char[TextArena::compressBound(static_cast<int>(text.size()))] };
+   int size {};
+   while (state.keepRunning())
+   {
+      size = TextArena::compress(text.data(), static_cast<int>(text.size()), packed.get());
+      doNotOptimize(packed.get());
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(text.size());
+   state.label = "ratio " + std::to_string(static_cast<double>(text.size()) / size);
+}
+BENCHMARK(BM_TextArenaCompress).arg(1 << 12).arg(1 << 16);
+
+void BM_TextArenaDecompress(State &state)
+{
+   string text { makeText(static_cast<int>(state.range(0))) };
+   int n { static_cast<int>(text.size()) };
+   std::unique_ptr<char[]> packed { new char[TextArena::compressBound(n)] };
+   int size { TextArena::compress(text.data(), n, packed.get()) };
+   string out(text.size(), '\0');
+   while (state.keepRunning())
+   {
+      doNotOptimize(TextArena::decompress(packed.get(), size, out.data(), n));
+   }
+   state.bytesProcessed = state.getIterations() * static_cast<int64_t>(n);
+}
+BENCHMARK(BM_TextArenaDecompress).arg(1 << 12).arg(1 << 16);
+
+// getRawText-sized reads, in insertion order (0) and at random (1). The label is the resident share of the raw text
+void BM_TextArenaGet(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   bool random { state.range(1) != 0 };
+   TextArena arena;
+   std::vector<TextArena::Ref> refs;
+   for (int i {}; i < n; i++)
+   {
+      refs.push_back(arena.append(makeText(200, i + 1)));
+   }
+   Rng rng { 3 };
+   string out;
+   int i {};
+   while (state.keepRunning())
+   {
+      arena.get(refs[random ? rng.nextInt(n) : i], out);
+      doNotOptimize(out.data());
+      i = i + 1 == n ? 0 : i + 1;
+   }
+   state.itemsProcessed = state.getIterations();
+   state.label = std::to_string(100 * arena.residentBytes() / arena.textBytes()) + "% resident";
+}
+BENCHMARK(BM_TextArenaGet)
+    .argNames({ "n", "random" })
+    .argsProduct({ { 10000, 100000 }, { 0, 1 } })
+    .unit(TimeUnit::Nanosecond);
+
+// n documents of 20-60 words drawn Zipf-like from a 20000-word vocabulary, plus one identifier each
+string zipfDocument(Rng &rng, int id)
+{
+   static std::vector<double> cdf;
+   if (cdf.empty())
+   {
+      double total {};
+      for (int rank { 1 }; rank <= 20000; rank++)
+      {
+         total += 1.0 / rank;
+         cdf.push_back(total);
+      }
+      for (double &c : cdf)
+      {
+         c /= total;
+      }
+   }
+   string text;
+   int words { 20 + rng.nextInt(41) };
+   for (int i {}; i < words; i++)
+   {
+      double u { (rng.next() >> 11) * (1.0 / (1ull << 53)) };
+      text += "w" + std::to_string(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()) + " ";
+   }
+   return text + "id" + std::to_string(id);
+}
+
+// BM25 top-k for a query mixing very common, middling and rare words
+void BM_InvertedIndexSearch(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int k { static_cast<int>(state.range(1)) };
+   static InvertedIndex index;
+   static int built { -1 };
+   if (built != n)
+   {
+      index.clear();
+      Rng rng { 5 };
+      for (int i {}; i < n; i++)
+      {
+         index.add(i, zipfDocument(rng, i));
+      }
+      built = n;
+   }
+   std::unique_ptr<int[]> keys { new int[k] };
+   std::unique_ptr<double[]> scores { new double[k] };
+   while (state.keepRunning())
+   {
+      doNotOptimize(index.search("w1 w7 w60 w900 id42", k, keys.get(), scores.get()));
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = std::to_string(index.bytes() / n) + " B/doc";
+}
+BENCHMARK(BM_InvertedIndexSearch)
+    .argNames({ "n", "k" })
+    .argsProduct({ { 10000, 100000 }, { 10, 100 } })
+    .unit(TimeUnit::Microsecond);
+
+// ==========================================================================================
+// VectorStore
+
+void BM_VectorStoreAddText(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   embedDimension = dim;
+   while (state.keepRunning())
+   {
+      VectorStore store { dim, stubEmbedding };
+      for (int i {}; i < n; i++)
+      {
+         store.addText(docText(i));
+      }
+      doNotOptimize(store.size());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_VectorStoreAddText)
+    .argNames({ "n", "dim" })
+    .argsProduct({ { 1000 }, { 128, 768 } })
+    .unit(TimeUnit::Millisecond);
+
+void BM_VectorStoreFindNearest(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   string metric { metricName(state.range(2)) };
+   VectorStore &store { cachedStore(n, dim) };
+   std::unique_ptr<SinglyLinkedList<float>> query { stubEmbedding("query") };
+   while (state.keepRunning())
+   {
+      doNotOptimize(store.findNearest(*query, metric));
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = metric;
+}
+BENCHMARK(BM_VectorStoreFindNearest)
+    .argNames({ "n", "dim", "metric" })
+    .argsProduct({ { 1000, 10000 }, { 128, 768 }, { 0, 1, 2 } })
+    .unit(TimeUnit::Microsecond);
+
+void BM_VectorStoreTopKNearest(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int k { static_cast<int>(state.range(2)) };
+   string metric { metricName(state.range(3)) };
+   VectorStore &store { cachedStore(n, dim) };
+   std::unique_ptr<SinglyLinkedList<float>> query { stubEmbedding("query") };
+   while (state.keepRunning())
+   {
+      int *ids { store.topKNearest(*query, k, metric) };
+      doNotOptimize(ids);
+      delete[] ids;
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = metric;
+}
+BENCHMARK(BM_VectorStoreTopKNearest)
+    .argNames({ "n", "dim", "k", "metric" })
+    .argsProduct({ { 1000, 10000 }, { 128, 768 }, { 1, 10, 100 }, { 0, 1, 2 } })
+    .unit(TimeUnit::Microsecond);
+
+// same query through the float* overload, no list walk and no allocation per call
+void BM_VectorStoreTopKNearestBuffer(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int k { static_cast<int>(state.range(2)) };
+   string metric { metricName(state.range(3)) };
+   VectorStore &store { cachedStore(n, dim) };
+   std::unique_ptr<SinglyLinkedList<float>> query { stubEmbedding("query") };
+   std::vector<float> q(dim);
+   query->copyTo(q.data(), dim);
+   std::vector<int> ids(k);
+   std::vector<double> scores(k);
+   while (state.keepRunning())
+   {
+      store.topKNearest(q.data(), k, ids.data(), scores.data(), metric);
+      doNotOptimize(ids.data());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = metric;
+}
+BENCHMARK(BM_VectorStoreTopKNearestBuffer)
+    .argNames({ "n", "dim", "k", "metric" })
+    .argsProduct({ { 1000, 10000 }, { 128, 768 }, { 1, 10, 100 }, { 0, 1, 2, 3, 4, 5 } })
+    .unit(TimeUnit::Microsecond);
+
+// n vectors around n / 100 centres, spread by noise; the text "c/i" is document i of cluster c
+SinglyLinkedList<float> *clusterEmbedding(const string &text)
+{
+   Rng centre { std::stoull(text) * 7919 + 1 };
+   Rng noise { std::hash<string> {}(text) };
+   SinglyLinkedList<float> *v { new SinglyLinkedList<float>() };
+   for (int i {}; i < embedDimension; i++)
+   {
+      v->add(centre.nextFloat() + 0.25f * noise.nextFloat());
+   }
+   return v;
+}
+
+// LSH candidates rescored exactly over clustered data; the label is recall@k against the brute-force answer
+void BM_VectorStoreApproximateTopK(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int k { static_cast<int>(state.range(2)) };
+   string metric { metricName(state.range(3)) };
+   embedDimension = dim;
+   static std::unique_ptr<VectorStore> store;
+   static int built { -1 };
+   if (!store || built != n || store->getDimension() != dim)
+   {
+      store = std::make_unique<VectorStore>(dim, clusterEmbedding);
+      for (int i {}; i < n; i++)
+      {
+         store->addText(std::to_string(i % (n / 100)) + "/" + std::to_string(i));
+      }
+      built = n;
+   }
+   LshOptions options;
+   options.metric = metric;
+   // a few neighbour distances wide: L2 grows with sqrt(dim), L1 with dim and Cauchy hashes spread further
+   options.width = metric == "manhattan" ? dim : std::sqrt(dim / 6.0);
+   store->setLshIndex(true, options);
+
+   std::unique_ptr<SinglyLinkedList<float>> query { clusterEmbedding("42/query") };
+   std::vector<float> q(dim);
+   query->copyTo(q.data(), dim);
+   std::vector<int> ids(k);
+   std::vector<int> exact(k);
+   int found {};
+   while (state.keepRunning())
+   {
+      found = store->approximateTopK(q.data(), k, ids.data());
+      doNotOptimize(ids.data());
+   }
+   store->topKNearest(q.data(), k, exact.data(), nullptr, metric);
+   int hits {};
+   for (int i {}; i < found; i++)
+   {
+      hits += std::find(exact.begin(), exact.end(), ids[i]) != exact.end();
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = metric + " recall " + std::to_string(hits) + "/" + std::to_string(k);
+}
+BENCHMARK(BM_VectorStoreApproximateTopK)
+    .argNames({ "n", "dim", "k", "metric" })
+    .argsProduct({ { 10000, 100000 }, { 128 }, { 10 }, { 0, 1, 2 } })
+    .unit(TimeUnit::Microsecond);
+
+// top 100 by cosine, re-ranked down to k by maximal marginal relevance
+void BM_VectorStoreMmrTopK(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int k { static_cast<int>(state.range(2)) };
+   VectorStore &store { cachedStore(n, dim) };
+   std::unique_ptr<SinglyLinkedList<float>> query { stubEmbedding("query") };
+   std::vector<float> q(dim);
+   query->copyTo(q.data(), dim);
+   std::vector<int> ids(k);
+   std::vector<double> scores(k);
+   MmrOptions options;
+   options.candidates = 100;
+   while (state.keepRunning())
+   {
+      doNotOptimize(store.mmrTopK(q.data(), k, ids.data(), scores.data(), options));
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_VectorStoreMmrTopK)
+    .argNames({ "n", "dim", "k" })
+    .argsProduct({ { 10000 }, { 128, 768 }, { 10 } })
+    .unit(TimeUnit::Microsecond);
+
+// mini-batch k-means into 100 clusters, serial (threads:1) and spread over the cores (threads:0)
+void BM_VectorStoreCluster(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   ClusterOptions options;
+   options.threads = static_cast<int>(state.range(2));
+   VectorStore &store { cachedStore(n, dim) };
+   double inertia {};
+   while (state.keepRunning())
+   {
+      Clustering clustering { store.cluster(100, options) };
+      inertia = clustering.inertia;
+      doNotOptimize(clustering.assignments.rawData());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.label = "inertia/n " + std::to_string(inertia / n);
+}
+BENCHMARK(BM_VectorStoreCluster)
+    .argNames({ "n", "dim", "threads" })
+    .argsProduct({ { 10000 }, { 128 }, { 1, 0 } })
+    .unit(TimeUnit::Millisecond);
+
+// read-only pass summing every vector, serial (threads:1) and spread over the cores (threads:0)
+void BM_VectorStoreParallelForEach(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int threads { static_cast<int>(state.range(2)) };
+   VectorStore &store { cachedStore(n, dim) };
+   while (state.keepRunning())
+   {
+      std::atomic<double> total { 0 };
+      store.parallelForEach(
+          [&total](algorithms::span<const float> v, int, const string &) {
+             double sum {};
+             for (float x : v)
+             {
+                sum += x;
+             }
+             double seen { total.load() };
+             while (!total.compare_exchange_weak(seen, seen + sum))
+             {
+             }
+          },
+          threads, 1024);
+      doNotOptimize(total.load());
+   }
+   state.itemsProcessed = state.getIterations() * n;
+   state.bytesProcessed = state.getIterations() * n * static_cast<int64_t>(dim) * sizeof(float);
+}
+BENCHMARK(BM_VectorStoreParallelForEach)
+    .argNames({ "n", "dim", "threads" })
+    .argsProduct({ { 10000 }, { 128, 768 }, { 1, 0 } })
+    .unit(TimeUnit::Microsecond);
+// query embedding, BM25 and vector candidates, then reciprocal-rank fusion
+void BM_VectorStoreHybridTopK(State &state)
+{
+   int n { static_cast<int>(state.range(0)) };
+   int dim { static_cast<int>(state.range(1)) };
+   int k { static_cast<int>(state.range(2)) };
+   VectorStore &store { cachedStore(n, dim) };
+   store.setLexicalIndex(true);
+   std::vector<int> ids(k);
+   std::vector<double> scores(k);
+   while (state.keepRunning())
+   {
+      doNotOptimize(store.hybridTopK("document 42", k, ids.data(), scores.data()));
+   }
+   state.itemsProcessed = state.getIterations() * n;
+}
+BENCHMARK(BM_VectorStoreHybridTopK)
+    .argNames({ "n", "dim", "k" })
+    .argsProduct({ { 10000 }, { 128, 768 }, { 10 } })
+    .unit(TimeUnit::Microsecond);
+} // namespace bench
+
+int main(int argc, char **argv)
+{
+   try
+   {
+      return bench::runAll(argc, argv);
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << e.what() << endl;
+      return 1;
+   }
+}
@@ -0,0 +1,507 @@
+// Load generator: many client threads reading and writing one VectorStore at once, which the microbenchmarks never
+// do. The corpus, the embedder and every client's operation sequence come from the seed, so two runs with the same
+// flags do the same work and only the interleaving differs. Reports throughput, latency percentiles per operation
+// and recall@k of the LSH search path against the exact scan.
+//   --docs=<n>            records loaded before the clients start (default 20000)
+//   --dim=<n>             embedding width (default 128)
+//   --threads=<n>         client threads, 0 means one per core (default 8)
+//   --ops=<n>             operations over all clients (default 200000)
+//   --read_ratio=<x>      share of operations that are searches (default 0.9)
+//   --remove_ratio=<x>    share of writes that remove a record instead of adding one (default 0)
+//   --k=<n>               results per search (default 10)
+//   --metric=<name>       search metric (default cosine)
+//   --index=<brute|lsh>   search path, the exact scan or approximateTopK over LSH tables (default brute)
+//   --tables=<n>          LSH tables (default 8)
+//   --probes=<n>          neighbouring LSH buckets probed per table (default 4)
+//   --width=<x>           bucket width of the p-stable LSH hashes, 0 estimates it from the data (default 0)
+//   --recall_queries=<n>  queries checked against the exact scan after an LSH run (default 200)
+//   --seed=<n>
+//   --format=<console|json>
+
+#include "main.h"
+#include "VectorStore.h"
+
+#include <chrono>
+#include <vector>
+
+namespace loadgen
+{
+struct Options
+{
+   int docs { 20000 };
+   int dim { 128 };
+   int threads { 8 };
+   int64_t ops { 200000 };
+   double readRatio { 0.9 };
+   double removeRatio { 0 };
+   int k { 10 };
+   string metric { "cosine" };
+   string index { "brute" };
+   double width { 0 };
+   int tables { 8 };
+   int probes { 4 };
+   int recallQueries { 200 };
+   uint64_t seed { 42 };
+   bool json {};
+};
+
+bool parseFlag(const string &arg, const string &flag, string &value)
+{
+   string prefix { "--" + flag + "=" };
+   if (arg.compare(0, prefix.size(), prefix) == 0)
+   {
+      value = arg.substr(prefix.size());
+      return true;
+   }
+   return false;
+}
+
+Options parseOptions(int argc, char **argv)
+{
+   Options opts;
+   for (int i { 1 }; i < argc; i++)
+   {
+      string arg { argv[i] };
+      string value;
+      if (parseFlag(arg, "docs", value))
+      {
+         opts.docs = std::stoi(value);
+      }
+      else if (parseFlag(arg, "dim", value))
+      {
+         opts.dim = std::stoi(value);
+      }
+      else if (parseFlag(arg, "threads", value))
+      {
+         opts.threads = std::stoi(value);
+      }
+      else if (parseFlag(arg, "ops", value))
+      {
+         opts.ops = std::stoll(value);
+      }
+      else if (parseFlag(arg, "read_ratio", value))
+      {
+         opts.readRatio = std::stod(value);
+      }
+      else if (parseFlag(arg, "remove_ratio", value))
+      {
+         opts.removeRatio = std::stod(value);
+      }
+      else if (parseFlag(arg, "k", value))
+      {
+         opts.k = std::stoi(value);
+      }
+      else if (parseFlag(arg, "metric", value))
+      {
+         opts.metric = value;
+      }
+      else if (parseFlag(arg, "index", value))
+      {
+         if (value != "brute" && value != "lsh")
+         {
+            throw std::invalid_argument("Unknown index: " + value);
+         }
+         opts.index = value;
+      }
+      else if (parseFlag(arg, "tables", value))
+      {
+         opts.tables = std::stoi(value);
+      }
+      else if (parseFlag(arg, "probes", value))
+      {
+         opts.probes = std::stoi(value);
+      }
+      else if (parseFlag(arg, "width", value))
+      {
+         opts.width = std::stod(value);
+      }
+      else if (parseFlag(arg, "recall_queries", value))
+      {
+         opts.recallQueries = std::stoi(value);
+      }
+      else if (parseFlag(arg, "seed", value))
+      {
+         opts.seed = std::stoull(value);
+      }
+      else if (parseFlag(arg, "format", value))
+      {
+         if (value != "console" && value != "json")
+         {
+            throw std::invalid_argument("Unknown format: " + value);
+         }
+         opts.json = value == "json";
+      }
+      else
+      {
+         throw std::invalid_argument("Unknown flag: " + arg);
+      }
+   }
+   if (opts.docs <= opts.k || opts.dim <= 0 || opts.ops < 0 || opts.k <= 0)
+   {
+      throw std::invalid_argument("Need dim > 0, k > 0 and more docs than k");
+   }
+   if (opts.threads <= 0)
+   {
+      opts.threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+   }
+   return opts;
+}
+
+// ==========================================================================================
+// Corpus and embedder
+
+// splitmix64, so every run sees the same data
+class Rng
+{
+ private:
+   uint64_t state;
+
+ public:
+   explicit Rng(uint64_t seed) : state { seed } {}
+
+   uint64_t next()
+   {
+      uint64_t z { this->state += 0x9E3779B97F4A7C15ull };
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+   }
+
+   int nextInt(int bound) { return static_cast<int>(next() % static_cast<uint64_t>(bound)); }
+
+   // uniform in [0, 1)
+   double nextDouble() { return (next() >> 11) * (1.0 / (1ull << 53)); }
+
+   // uniform in [-1, 1)
+   float nextFloat() { return static_cast<float>((next() >> 40) * (2.0 / (1ull << 24)) - 1.0); }
+};
+
+// ranks of a 20000-word vocabulary, drawn Zipf-like
+class Vocabulary
+{
+ private:
+   std::vector<double> cdf;
+
+ public:
+   Vocabulary()
+   {
+      double total {};
+      for (int rank { 1 }; rank <= 20000; rank++)
+      {
+         total += 1.0 / rank;
+         cdf.push_back(total);
+      }
+      for (double &c : cdf)
+      {
+         c /= total;
+      }
+   }
+
+   string word(Rng &rng) const
+   {
+      return "w" + std::to_string(std::lower_bound(cdf.begin(), cdf.end(), rng.nextDouble()) - cdf.begin());
+   }
+};
+
+// document i is the same text on every run with the same seed, whichever thread writes it
+string document(const Vocabulary &vocabulary, uint64_t seed, int64_t i)
+{
+   Rng rng { seed ^ (static_cast<uint64_t>(i) * 0xD1B54A32D192ED03ull) };
+   string text;
+   int words { 20 + rng.nextInt(41) };
+   for (int w {}; w < words; w++)
+   {
+      text += vocabulary.word(rng) + " ";
+   }
+   return text + "doc" + std::to_string(i);
+}
+
+int embedDimension { 128 };
+
+// Feature hashing: every word seeds a random vector and a text is the sum of its words' vectors, a fixed random
+// projection of its bag of words. Texts sharing words land close together, and nothing leaves the process
+SinglyLinkedList<float> *stubEmbedding(const string &text)
+{
+   std::vector<float> sum(embedDimension);
+   size_t start {};
+   while (start < text.size())
+   {
+      size_t end { text.find(' ', start) };
+      end = end == string::npos ? text.size() : end;
+      if (end > start)
+      {
+         uint64_t h { 1469598103934665603ull };
+         for (size_t i { start }; i < end; i++)
+         {
+            h = (h ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+         }
+         Rng rng { h };
+         for (float &x : sum)
+         {
+            x += rng.nextFloat();
+         }
+      }
+      start = end + 1;
+   }
+   SinglyLinkedList<float> *v { new SinglyLinkedList<float>() };
+   v->resize(embedDimension);
+   v->copyFrom(sum.data(), embedDimension);
+   return v;
+}
+
+// ==========================================================================================
+// Run
+
+struct Report
+{
+   double loadSeconds;
+   double runSeconds;
+   LatencyHistogram reads;
+   LatencyHistogram writes;
+   std::atomic<int64_t> failedReads { 0 };  // searches run while removes had left fewer than k records
+   std::atomic<int64_t> failedWrites { 0 }; // removes that lost the race for their index
+   double recall; // -1 when not measured: the brute path is the exact scan itself, or the store ended empty
+   int finalSize;
+};
+
+uint64_t nsSince(std::chrono::steady_clock::time_point start)
+{
+   return static_cast<uint64_t>(
+       std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+void run(const Options &opts, Report &report)
+{
+   using Clock = std::chrono::steady_clock;
+   embedDimension = opts.dim;
+   Vocabulary vocabulary;
+   VectorStore store { opts.dim, stubEmbedding };
+
+   Clock::time_point start { Clock::now() };
+   for (int i {}; i < opts.docs; i++)
+   {
+      store.addText(document(vocabulary, opts.seed, i));
+   }
+
+   // searches use the opening words of a corpus document, embedded up front so reads time the search alone
+   constexpr int QUERIES { 1024 };
+   std::vector<float> queries(static_cast<size_t>(QUERIES) * opts.dim);
+   Rng queryRng { opts.seed + 1 };
+   for (int q {}; q < QUERIES; q++)
+   {
+      Rng words { queryRng.next() };
+      string doc { document(vocabulary, opts.seed, queryRng.nextInt(opts.docs)) };
+      string text;
+      for (int w { 10 + words.nextInt(7) }, from {}; w > 0; w--)
+      {
+         size_t space { doc.find(' ', from) };
+         if (space == string::npos)
+         {
+            break;
+         }
+         text += doc.substr(from, space - from) + " ";
+         from = static_cast<int>(space) + 1;
+      }
+      std::unique_ptr<SinglyLinkedList<float>> vector { store.preprocessing(text) };
+      vector->copyTo(queries.data() + static_cast<size_t>(q) * opts.dim, opts.dim);
+   }
+   if (opts.index == "lsh")
+   {
+      LshOptions lsh;
+      lsh.metric = opts.metric;
+      lsh.tables = opts.tables;
+      lsh.probes = opts.probes;
+      lsh.width = opts.width; // 0 lets the store estimate it
+      store.setLshIndex(true, lsh);
+   }
+   report.loadSeconds = nsSince(start) / 1e9;
+   auto search { [&](const float *query, int k, int *ids) {
+      if (opts.index == "lsh")
+      {
+         return store.approximateTopK(query, k, ids);
+      }
+      store.topKNearest(query, k, ids, nullptr, opts.metric);
+      return k;
+   } };
+
+   std::atomic<int64_t> nextDoc { opts.docs };
+   std::atomic<bool> go { false };
+   std::vector<std::thread> clients;
+   for (int t {}; t < opts.threads; t++)
+   {
+      int64_t share { opts.ops / opts.threads + (t < opts.ops % opts.threads) };
+      clients.emplace_back([&, t, share]() {
+         Rng rng { opts.seed * 0x9E3779B97F4A7C15ull + t + 2 };
+         std::vector<int> ids(opts.k);
+         while (!go)
+         {
+            std::this_thread::yield();
+         }
+         for (int64_t op {}; op < share; op++)
+         {
+            Clock::time_point begin { Clock::now() };
+            if (rng.nextDouble() < opts.readRatio)
+            {
+               try
+               {
+                  search(queries.data() + static_cast<size_t>(rng.nextInt(QUERIES)) * opts.dim, opts.k, ids.data());
+               }
+               catch (const invalid_k_value &)
+               {
+                  report.failedReads++;
+               }
+               report.reads.record(nsSince(begin));
+               continue;
+            }
+            if (rng.nextDouble() < opts.removeRatio)
+            {
+               try
+               {
+                  store.removeAt(rng.nextInt(std::max(store.size(), 1)));
+               }
+               catch (const std::out_of_range &)
+               {
+                  report.failedWrites++;
+               }
+            }
+            else
+            {
+               store.addText(document(vocabulary, opts.seed, nextDoc++));
+            }
+            report.writes.record(nsSince(begin));
+         }
+      });
+   }
+   start = Clock::now();
+   go = true;
+   for (std::thread &client : clients)
+   {
+      client.join();
+   }
+   report.runSeconds = nsSince(start) / 1e9;
+   report.finalSize = store.size();
+
+   // recall@k of the search path against the exact scan, on the store as the run left it. Removes may have left
+   // fewer than k records, all of them are the neighbours then
+   report.recall = -1;
+   if (opts.index != "lsh")
+   {
+      return;
+   }
+   int k { std::min(opts.k, report.finalSize) };
+   std::vector<int> found(opts.k);
+   std::vector<int> exact(opts.k);
+   double hits {};
+   int checked { k > 0 ? std::min(opts.recallQueries, QUERIES) : 0 };
+   for (int q {}; q < checked; q++)
+   {
+      const float *query { queries.data() + static_cast<size_t>(q) * opts.dim };
+      int n { search(query, k, found.data()) };
+      store.topKNearest(query, k, exact.data(), nullptr, opts.metric);
+      for (int i {}; i < n; i++)
+      {
+         hits += std::find(exact.begin(), exact.end(), found[i]) != exact.end();
+      }
+   }
+   report.recall = checked > 0 ? hits / (static_cast<double>(checked) * k) : -1;
+}
+
+// ==========================================================================================
+// Output
+
+double perSecond(uint64_t n, double seconds) { return seconds > 0 ? n / seconds : 0; }
+
+void writeConsole(const Options &opts, const Report &r)
+{
+   cout << "loadgen: " << opts.docs << " docs, dim " << opts.dim << ", " << opts.threads << " threads, " << opts.ops
+        << " ops, read ratio " << opts.readRatio << ", index " << opts.index << ", metric " << opts.metric << endl;
+   cout << "load " << r.loadSeconds << " s, run " << r.runSeconds << " s, "
+        << perSecond(r.reads.count() + r.writes.count(), r.runSeconds) << " ops/s, " << r.finalSize
+        << " records at the end" << endl;
+   char line[256];
+   std::snprintf(line, sizeof line, "%-6s %10s %12s %10s %10s %10s %10s", "op", "count", "per second", "p50 us",
+                 "p99 us", "p999 us", "max us");
+   cout << line << endl;
+   for (const auto &[name, h] : { std::pair<const char *, const LatencyHistogram *> { "read", &r.reads },
+                                  std::pair<const char *, const LatencyHistogram *> { "write", &r.writes } })
+   {
+      std::snprintf(line, sizeof line, "%-6s %10llu %12.0f %10.1f %10.1f %10.1f %10.1f", name,
+                    static_cast<unsigned long long>(h->count()), perSecond(h->count(), r.runSeconds),
+                    h->percentileNs(0.5) / 1e3, h->percentileNs(0.99) / 1e3, h->percentileNs(0.999) / 1e3,
+                    h->maxNs() / 1e3);
+      cout << line << endl;
+   }
+   if (r.failedReads > 0)
+   {
+      cout << r.failedReads << " searches found fewer than k records" << endl;
+   }
+   if (r.failedWrites > 0)
+   {
+      cout << r.failedWrites << " removes lost the race for their index" << endl;
+   }
+   if (r.recall >= 0)
+   {
+      cout << "recall@" << opts.k << " " << r.recall << endl;
+   }
+   else
+   {
+      cout << "recall@" << opts.k << " n/a" << endl;
+   }
+}
+
+void writeHistogram(std::ostream &os, const char *name, const LatencyHistogram &h, double seconds)
+{
+   os << "    \"" << name << "\": {\"count\": " << h.count() << ", \"per_second\": " << perSecond(h.count(), seconds)
+      << ", \"p50_ns\": " << h.percentileNs(0.5) << ", \"p99_ns\": " << h.percentileNs(0.99)
+      << ", \"p999_ns\": " << h.percentileNs(0.999) << ", \"max_ns\": " << h.maxNs() << "}";
+}
+
+void writeJson(std::ostream &os, const Options &opts, const Report &r)
+{
+   os << "{\n  \"options\": {\"docs\": " << opts.docs << ", \"dim\": " << opts.dim << ", \"threads\": " << opts.threads
+      << ", \"ops\": " << opts.ops << ", \"read_ratio\": " << opts.readRatio << ", \"remove_ratio\": "
+      << opts.removeRatio << ", \"k\": " << opts.k << ", \"metric\": \"" << opts.metric << "\", \"index\": \""
+      << opts.index << "\", \"seed\": " << opts.seed << "},\n";
+   os << "  \"load_seconds\": " << r.loadSeconds << ",\n  \"run_seconds\": " << r.runSeconds
+      << ",\n  \"ops_per_second\": " << perSecond(r.reads.count() + r.writes.count(), r.runSeconds)
+      << ",\n  \"final_size\": " << r.finalSize << ",\n  \"failed_reads\": " << r.failedReads
+      << ",\n  \"failed_writes\": " << r.failedWrites << ",\n  \"recall\": ";
+   if (r.recall >= 0)
+   {
+      os << r.recall;
+   }
+   else
+   {
+      os << "null";
+   }
+   os << ",\n  \"latency\": {\n";
+   writeHistogram(os, "read", r.reads, r.runSeconds);
+   os << ",\n";
+   writeHistogram(os, "write", r.writes, r.runSeconds);
+   os << "\n  }\n}\n";
+}
+} // namespace loadgen
+
+int main(int argc, char **argv)
+{
+   try
+   {
+      loadgen::Options opts { loadgen::parseOptions(argc, argv) };
+      loadgen::Report report {};
+      loadgen::run(opts, report);
+      if (opts.json)
+      {
+         loadgen::writeJson(cout, opts, report);
+      }
+      else
+      {
+         loadgen::writeConsole(opts, report);
+      }
+      return 0;
+   }
+   catch (const std::exception &e)
+   {
+      std::cerr << e.what() << endl;
+      return 1;
+   }
+}
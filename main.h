@@ -4,8 +4,27 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <cmath>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <limits>
+#include <utility>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+#include <unordered_map>
 #include "utils.h"
 
 using namespace std;
@@ -22,5 +41,23 @@ public:
     explicit invalid_k_value(const std::string& what_arg) : std::logic_error(what_arg) {}
 };
 
+class index_not_enabled : public std::logic_error {
+public:
+    index_not_enabled() : std::logic_error("Index is not enabled!") {}
+    explicit index_not_enabled(const std::string& what_arg) : std::logic_error(what_arg) {}
+};
+
+class query_rejected : public std::runtime_error {
+public:
+    query_rejected() : std::runtime_error("Query queue is full!") {}
+    explicit query_rejected(const std::string& what_arg) : std::runtime_error(what_arg) {}
+};
+
+class deadline_exceeded : public std::runtime_error {
+public:
+    deadline_exceeded() : std::runtime_error("Query deadline exceeded!") {}
+    explicit deadline_exceeded(const std::string& what_arg) : std::runtime_error(what_arg) {}
+};
+
 
 #endif // __MAIN_H__
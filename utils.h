@@ -13,57 +13,69 @@ class Point {
 private:
     double x, y, z;
 
+    static constexpr double absDiff(double a, double b) { return a > b ? a - b : b - a; }
+
 public:
-    Point() : x(0), y(0), z(0) {}
+    // coordinates closer than this compare equal
+    static constexpr double EPSILON = 1e-9;
 
-    Point(double x, double y) : x(x), y(y), z(0) {}
+    constexpr Point() : x(0), y(0), z(0) {}
 
-    Point(double x, double y, double z) : x(x), y(y), z(z) {}
+    constexpr Point(double x, double y) : x(x), y(y), z(0) {}
 
-    Point(const Point& other) : x(other.x), y(other.y), z(other.z) {}
+    constexpr Point(double x, double y, double z) : x(x), y(y), z(z) {}
 
-    double getX() const { return x; }
+    // defaulted so Point stays trivially copyable and ArrayList<Point> can grow with realloc
+    constexpr Point(const Point& other) = default;
 
-    double getY() const { return y; }
+    constexpr Point& operator=(const Point& other) = default;
 
-    double getZ() const { return z; }
+    constexpr double getX() const { return x; }
 
-    void setX(double newX) { x = newX; }
+    constexpr double getY() const { return y; }
 
-    void setY(double newY) { y = newY; }
+    constexpr double getZ() const { return z; }
 
-    void setZ(double newZ) { z = newZ; }
+    constexpr void setX(double newX) { x = newX; }
 
-    double distanceTo(const Point& other) const {
+    constexpr void setY(double newY) { y = newY; }
+
+    constexpr void setZ(double newZ) { z = newZ; }
+
+    // for comparing distances, skips the sqrt
+    constexpr double squaredDistanceTo(const Point& other) const {
         double dx = x - other.x;
         double dy = y - other.y;
         double dz = z - other.z;
-        return sqrt(dx*dx + dy*dy + dz*dz);
+        return dx*dx + dy*dy + dz*dz;
+    }
+
+    double distanceTo(const Point& other) const {
+        return sqrt(squaredDistanceTo(other));
     }
 
-    void translate(double dx, double dy, double dz) {
+    constexpr void translate(double dx, double dy, double dz) {
         x += dx;
         y += dy;
         z += dz;
     }
 
-    Point operator+(const Point& other) const {
+    constexpr Point operator+(const Point& other) const {
         return Point(x + other.x, y + other.y, z + other.z);
     }
 
-    Point operator-(const Point& other) const {
+    constexpr Point operator-(const Point& other) const {
         return Point(x - other.x, y - other.y, z - other.z);
     }
 
-    Point operator*(double scalar) const {
+    constexpr Point operator*(double scalar) const {
         return Point(x * scalar, y * scalar, z * scalar);
     }
 
-    bool operator==(const Point& other) const {
-        const double EPSILON = 1e-9;
-        return (fabs(x - other.x) < EPSILON) && 
-               (fabs(y - other.y) < EPSILON) && 
-               (fabs(z - other.z) < EPSILON);
+    constexpr bool operator==(const Point& other) const {
+        return (absDiff(x, other.x) < EPSILON) && 
+               (absDiff(y, other.y) < EPSILON) && 
+               (absDiff(z, other.z) < EPSILON);
     }
 
     friend std::ostream& operator<<(std::ostream& os, const Point& point) {